@@ -6,8 +6,10 @@
 //
 // Dependencies:
 //   *  olcPixelGameEngine.h - (olc::PixelGameEngine header file) by JavidX9 (see: https://github.com/OneLoneCoder/olcPixelGameEngine)
-//   *  ManipulatedSprite.h and .cpp (see: https://github.com/Joseph21-6147/Sprite-manipulation-warping-rotating-scaling)
 //   *  my_utility.h and .cpp (which is made available in the same github site as this program)
+//
+// For headless builds (no window, no GPU) set HEADLESS_MODE to true. This requires a version of the PGE that
+// supports OLC_PGE_HEADLESS (v2.24 or later).
 
 /* Short description
    -----------------
@@ -18,17 +20,169 @@
    4. use an occlusion list to determine if the screen is fully rendered, and which quads must be rendered and clipped at which locations
    5. render the walls one quad at a time
 
+   Benchmark mode
+   --------------
+   With the --bench option the player is moved along a fixed (deterministic) path through the map, once for every
+   texture mode. Per frame the time spent in each stage of the render pipeline is measured. The per frame timings are
+   written to file in csv format, and a summary with percentiles is printed at the end.
+
+   Headless mode
+   -------------
+   In headless mode the complete pipeline of OnUserUpdate() is run, but the frames are only composed in an
+   in-memory frame buffer. Use the command line options to specify how many frames to render and whether they must
+   be dumped to file (as PPM or as raw RGBA). Start the program with -h to get an overview of the options.
+
+   Occlusion structures
+   --------------------
+   The occluded screen columns can be kept track of by three interchangeable structures: the original linked list,
+   a sorted array of spans, and a bitmask with one bit per screen column. Toggle between them with the O key, or
+   select one with the --occlusion option. Use --bench-occlusion to compare their performance - on the fly through
+   the span buffer is the fastest and the bitmask the slowest.
+
+   Walls of partial height
+   -----------------------
+   The digits '1' to '9' in the map denote walls of 0.1 to 0.9 cell height. Only faces of full height are merged into
+   the occlusion structure. Lower faces narrow the vertical clip range per screen column instead, so the faces behind
+   them are only rendered above them. The default map only has full height walls - use --map lowwalls to add a few
+   blocks of partial height to it.
+
+   Texture sampling
+   ----------------
+   In SPRITE texture mode the walls are by default textured column by column: per screen column the texture u is
+   worked out perspective correct, and v is stepped down the column. The original per pixel inverse bilinear warp is
+   still available - toggle with the X key, or select with the --sampler option. On CPUs that support AVX2 the warp
+   is evaluated 8 pixels at a time (use --noavx2 to force the scalar version). Use --bench-warp to compare both.
+
+   Multi threaded rendering
+   ------------------------
+   With the --threads option (or toggle with the P key) the screen is split in vertical bands of columns, that are
+   rendered in parallel. Every band has its own occlusion state and processes the complete sorted faces list, so the
+   output is identical to single threaded rendering.
+   Alternatively (--parallel jobs, or toggle with the J key) the faces are processed single threaded, and the visible
+   parts of them are cut into jobs of a few screen columns that are rendered in parallel. In both modes idle threads
+   steal work from busy ones. The utilization of the threads is shown on screen, and reported per thread at the end
+   of a benchmark run.
+
+   Pipelined frame execution
+   -------------------------
+   With --exec pipelined (or toggle with the L key) the visibility stage of the next frame (visible tiles and faces,
+   sorting and occlusion) runs on a background thread while the current frame is rasterized. This raises the frame
+   rate at the cost of one frame of latency.
+
+   Lazy face ordering
+   ------------------
+   Rendering stops as soon as the screen is covered, so the faces at the far end of the sorted list are often never
+   looked at. With --order lazy (or toggle with the K key) the faces are kept in a heap instead of being sorted, and
+   the nearest one is taken from it each time the next face is needed. So the ordering work follows the nr of faces
+   that are actually rendered. The order is the same as when the faces are sorted. Band mode needs the complete
+   order, so there the faces are always sorted.
+
+   Projection
+   ----------
+   By default a face column is projected onto the screen column that is linear in its angle from the player, and the
+   distance is corrected for the fish eye effect afterwards. With --projection pinhole (or toggle with the C key) the
+   corners are transformed into camera space instead, and projected with a single divide - this is a true perspective
+   projection, and doesn't need any trig per corner. The corners that a frame needs are gathered and transformed in
+   one batch, 4 at a time with SSE (see Batch corner transform). There's an AVX2 kernel that does 8 at a time as
+   well, but it measured slower than the SSE one, so it's only run by --bench-transform, which compares the kernels.
+
+   Near plane clipping
+   -------------------
+   A face that passes beside the player can extend behind it, and the part behind the player has no sensible
+   projection. So before a face is projected it is clipped in camera space against a plane just in front of the
+   player. The texture coordinates of what remains of the face are narrowed accordingly. A face that is closer to the
+   player than the plane is clipped at a fraction of its distance instead, so that only parts of it that are outside
+   the FoV are clipped away. Player movement keeps a distance of COLLISION_MIN_DIST to the walls in all directions.
+
+   BSP visibility
+   --------------
+   Sorting the faces on distance is a heuristic that can misorder long or diagonally adjacent faces. With
+   --visibility bsp (or toggle with the F key) the faces are ordered by walking a BSP tree over the wall segments
+   instead, which gives an exact front to back order for any player position. The tree is compiled when the map is
+   set up. Use --bsp-file to load it from file - if the file doesn't exist or doesn't match the map, the tree is
+   compiled and written to it.
+
+   Potentially visible sets
+   ------------------------
+   With --pvs (or toggle with the U key) the set of faces that can be seen from anywhere inside a cell is worked out
+   for every empty cell of the map, and only the faces in the set of the player's cell (or the union of the sets of
+   all cells the player touches, if it's on a cell boundary) are considered when the visible tiles and faces are
+   collected (the frontier, BSP and portal visibility modes walk the map themselves and don't use the sets). The sets
+   are kept compressed, per cell as a bitset, a list of face indices or a list of runs, whichever is smallest. Use
+   --pvs-file to load them from a sidecar file - if the file doesn't exist or doesn't match the map, they're computed
+   and written to it. Use --bench-pvs to check that no visible face is missing from the sets, and to compare the nr of
+   candidate faces.
+
+   Portal visibility
+   -----------------
+   With --visibility portals (or toggle with the F key) the open area of the map is decomposed into convex sectors,
+   that are connected by portals. The scene is rendered by recursing from the player's sector through the portals,
+   while narrowing the window of screen columns that the next sector can be seen in. So the work depends on the nr of
+   sectors that can be seen, rather than on the nr of tiles in the FoV, which pays off for large indoor maps. Use
+   --bench-portals to check that no face is missing compared to sorted visibility, also for poses close to a wall.
+
+   Merged wall segments
+   --------------------
+   The exposed faces that form a straight wall of equal height are merged into wall segments when the map is set up.
+   Per frame the visible part of a segment is projected, sorted and processed by the occlusion structure as a single
+   face. Since segments can be long, the distance sort is followed by a pass that puts every face in front of the
+   faces it hides. That pass only compares the faces that overlap on screen, so its cost follows the nr of overlapping
+   pairs rather than the square of the nr of faces. The tile faces of a segment are still rasterized one by one, so
+   merging saves work in the visibility stages, not in the rasterizer. The info panel shows the nr of visible faces
+   before and after merging. Toggle with the G key, or switch off with --nomerge.
+
    To do
    -----
 
     Have fun!
  */
 
+// set HEADLESS_MODE to true to build a version that doesn't need a display or GPU
+#ifndef HEADLESS_MODE
+#define HEADLESS_MODE   false
+#endif
+#if HEADLESS_MODE
+#define OLC_PGE_HEADLESS
+#endif
+
 #define OLC_PGE_APPLICATION
 #include "olcPixelGameEngine.h"
 
 #include "my_utility.h"
-#include "ManipulatedSprite.h"
+
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+// intrinsics for the bitmask occlusion backend, the warped sprite sampler and the corner transform
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#define X86_SIMD_KERNELS   true     // the SSE and AVX2 kernels are compiled in, AVX2 is selected at run time if the CPU supports it
+#else
+#define X86_SIMD_KERNELS   false
+#endif
+// lets the compiler generate AVX2 code for a single function, without requiring it for the whole program
+#if defined(__GNUC__)
+#define TARGET_AVX2   __attribute__(( target( "avx2,fma" )))
+// same, but without FMA so that multiplications and additions aren't contracted - for kernels that must give exactly
+// the same results as their scalar version
+#define TARGET_AVX2_EXACT   __attribute__(( target( "avx2" )))
+#define TARGET_SSE2   __attribute__(( target( "sse2" )))
+#else
+#define TARGET_AVX2
+#define TARGET_AVX2_EXACT
+#define TARGET_SSE2
+#endif
 
 
 #define PI 3.1415926535f
@@ -53,6 +207,280 @@
 #define SPEED_ROTATE      60.0f   //                          60 degrees per second
 #define SPEED_MOVE         5.0f   // forward and backward -    5 units (tiles) per second
 #define SPEED_STRAFE       5.0f   // left and right strafing - 5 units (tiles) per second
+#define COLLISION_MIN_DIST 0.2f   // min. distance (in cells) that the player keeps from the walls, in all directions
+
+// benchmark constants
+#define FILE_NAME_BENCH    "bench_output.txt"   // default file name for the per frame timings (csv format)
+#define BENCH_SWEEP_DEG   35.0f                 // amplitude of the looking angle sweep during the fly through
+
+// rasterizer constants
+#define FIXED_SHIFT       16                    // nr of fraction bits for the fixed point edge stepping
+#define NEAR_ZERO         0.000001              // Note: floats have only 6-7 significant digits, doubles have 15-16
+#define WARP_MAX_DIFF     0.1f                  // max. percentage of differing pixels for the AVX2 warped sampler
+#define PINHOLE_MIN_Z     0.0001f               // min. camera depth used by the pinhole projection
+#define NEAR_PLANE_Z      0.1f                  // camera depth of the near plane the faces are clipped against
+#define NEAR_PLANE_FACTOR 0.5f                  // faces closer than NEAR_PLANE_Z / NEAR_PLANE_FACTOR are clipped at
+                                                //     this factor times their distance, see ClipFaceToNearPlane()
+
+// face sorting constants
+#define SORT_RADIX_BITS   11                    // nr of key bits per pass of the radix sort
+#define SORT_RADIX_MIN   512                    // below this nr of faces sorting the keys with std::sort is faster
+
+// BSP constants
+#define BSP_SPLIT_COST     8                    // cost of splitting a fragment, relative to a difference of one fragment between both sides
+#define BSP_MAX_CANDIDATES 32                   // max. nr of splitter lines that are evaluated per node
+#define BSP_FILE_MAGIC    0x50534252            // "RBSP"
+#define BSP_FILE_VERSION   1                    // must be raised if the file format or the wall segments change
+
+// PVS constants
+#define PVS_FILE_MAGIC    0x53565052            // "RPVS"
+#define PVS_FILE_VERSION   3                    // must be raised if the file format (e.g. the set encodings) or the face table changes
+#define PVS_RAW            0                    // leading byte of a set that is stored as a bitset
+#define PVS_LIST           1                    // leading byte of a set that is stored as a list of face index gaps
+#define PVS_RUNS           2                    // leading byte of a set that is stored as a list of run lengths
+
+// band mode constants
+#define BANDS_PER_THREAD   2                    // nr of bands of screen columns per render thread
+#define BAND_MARGIN        2                    // nr of columns on either side of a band that its render state keeps track of
+#define JOB_COLUMNS       32                    // max. nr of screen columns per quad job
+
+// Worker pool
+// ===========
+
+// A fixed set of worker threads that run a batch of jobs at a time. The thread that calls Run() takes part in the
+// work as well (as worker 0), so a pool of size n has n - 1 worker threads. Run() returns when all jobs of the batch
+// are done.
+// The jobs of a batch are handed out in contiguous ranges, one per worker. Jobs can differ a lot in cost, so a worker
+// that runs out of jobs steals the upper half of the remaining range of the worker that has the most jobs left.
+class WorkerPool {
+public:
+    // per worker statistics of the last batch
+    typedef struct sWorkerStats {
+        double fBusy   = 0.0;     // time spent in jobs (in microseconds)
+        int    nJobs   = 0;       // nr of jobs done
+        int    nSteals = 0;       // nr of times jobs were stolen from another worker
+    } WorkerStats;
+
+    ~WorkerPool() { Stop(); }
+
+    // (re)starts the pool with nThreads threads in total
+    void Start( int nThreads ) {
+        Stop();
+        bStop  = false;
+        vSlots = std::vector<WorkerSlot>( std::max( 1, nThreads ));
+        // the threads only take part in the batches that are started after this call
+        long nStartBatch = nBatch;
+        for (int i = 1; i < nThreads; i++) {
+            vThreads.emplace_back( [this, i, nStartBatch]() { WorkerLoop( i, nStartBatch ); } );
+        }
+    }
+
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock( mtx );
+            bStop = true;
+        }
+        cvStart.notify_all();
+        for (auto &t : vThreads) t.join();
+        vThreads.clear();
+    }
+
+    int Size() { return (int)vThreads.size() + 1; }
+
+    // runs job( i, w ) for every i in [0, nJobs), where w is the index of the worker that runs it. Returns when all
+    // of the jobs are done
+    void Run( int nJobs, const std::function<void( int, int )> &job ) {
+        std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+        if (vSlots.empty()) vSlots = std::vector<WorkerSlot>( 1 );
+        int nWorkers = (int)vSlots.size();
+        for (int w = 0; w < nWorkers; w++) {
+            vSlots[w].stats = WorkerStats();
+            vSlots[w].nRange.store( PackRange( nJobs * w / nWorkers, nJobs * (w + 1) / nWorkers ));
+        }
+        pJob = &job;
+        if (!vThreads.empty()) {
+            {
+                std::lock_guard<std::mutex> lock( mtx );
+                nBusy   = (int)vThreads.size();
+                nBatch += 1;
+            }
+            cvStart.notify_all();
+        }
+        DoJobs( 0 );
+        if (!vThreads.empty()) {
+            std::unique_lock<std::mutex> lock( mtx );
+            cvDone.wait( lock, [this]() { return nBusy == 0; } );
+        }
+        pJob = nullptr;
+        fBatchMicros = std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - tStart ).count();
+    }
+
+    // statistics of the last batch - utilization of worker w is GetStats( w ).fBusy / GetBatchMicros()
+    int GetStatsCount() { return (int)vSlots.size(); }
+    const WorkerStats &GetStats( int w ) { return vSlots[w].stats; }
+    double GetBatchMicros() { return fBatchMicros; }
+
+private:
+    // the range [begin, end) of jobs that a worker still has to do, packed in 64 bits, so that both the owner (taking
+    // jobs at the begin) and thieves (taking jobs at the end) can update it with a single compare and swap
+    struct alignas( 64 ) WorkerSlot {
+        std::atomic<uint64_t> nRange{ 0 };
+        WorkerStats stats;    // only written by the owner
+    };
+
+    std::vector<std::thread> vThreads;
+    std::vector<WorkerSlot>  vSlots;
+    std::mutex mtx;
+    std::condition_variable cvStart, cvDone;
+    const std::function<void( int, int )> *pJob = nullptr;
+    int    nBusy        = 0;      // nr of worker threads that didn't finish the current batch yet
+    long   nBatch       = 0;      // incremented for every batch, so that the worker threads can detect a new one
+    bool   bStop        = false;
+    double fBatchMicros = 0.0;    // wall clock time of the last batch
+
+    static uint64_t PackRange( int nBegin, int nEnd ) { return (uint64_t( uint32_t( nEnd )) << 32) | uint32_t( nBegin ); }
+    static int RangeBegin( uint64_t nRange ) { return int( uint32_t( nRange       )); }
+    static int RangeEnd(   uint64_t nRange ) { return int( uint32_t( nRange >> 32 )); }
+
+    // takes the first job of the range of worker w. Returns false if the range is empty
+    bool PopJob( int w, int &nJob ) {
+        std::atomic<uint64_t> &range = vSlots[w].nRange;
+        uint64_t nCur = range.load();
+        while (RangeBegin( nCur ) < RangeEnd( nCur )) {
+            if (range.compare_exchange_weak( nCur, PackRange( RangeBegin( nCur ) + 1, RangeEnd( nCur )))) {
+                nJob = RangeBegin( nCur );
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // moves the upper half of the range of the worker with the most jobs left to the (empty) range of worker w.
+    // Returns false if there are no jobs left to steal
+    bool StealJobs( int w ) {
+        while (true) {
+            int nVictim = -1, nMostLeft = 0;
+            uint64_t nVictimRange = 0;
+            for (int v = 0; v < (int)vSlots.size(); v++) {
+                uint64_t nCur = vSlots[v].nRange.load();
+                if (v != w && RangeEnd( nCur ) - RangeBegin( nCur ) > nMostLeft) {
+                    nVictim      = v;
+                    nMostLeft    = RangeEnd( nCur ) - RangeBegin( nCur );
+                    nVictimRange = nCur;
+                }
+            }
+            if (nVictim < 0) return false;
+
+            int nSplit = RangeEnd( nVictimRange ) - (nMostLeft + 1) / 2;
+            if (vSlots[nVictim].nRange.compare_exchange_strong( nVictimRange, PackRange( RangeBegin( nVictimRange ), nSplit ))) {
+                vSlots[w].nRange.store( PackRange( nSplit, RangeEnd( nVictimRange )));
+                vSlots[w].stats.nSteals += 1;
+                return true;
+            }
+            // the victim's range changed in the mean time - try again
+        }
+    }
+
+    // does jobs of the current batch, stealing them from the other workers when worker w runs out of them
+    void DoJobs( int w ) {
+        WorkerStats &stats = vSlots[w].stats;
+        while (true) {
+            int nJob;
+            if (!PopJob( w, nJob )) {
+                if (!StealJobs( w )) return;
+                continue;
+            }
+            std::chrono::steady_clock::time_point tStart = std::chrono::steady_clock::now();
+            (*pJob)( nJob, w );
+            stats.fBusy += std::chrono::duration<double, std::micro>( std::chrono::steady_clock::now() - tStart ).count();
+            stats.nJobs += 1;
+        }
+    }
+
+    void WorkerLoop( int w, long nSeenBatch ) {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock( mtx );
+                cvStart.wait( lock, [&]() { return bStop || nBatch != nSeenBatch; } );
+                if (bStop) return;
+                nSeenBatch = nBatch;
+            }
+            DoJobs( w );
+            {
+                std::lock_guard<std::mutex> lock( mtx );
+                nBusy -= 1;
+            }
+            cvDone.notify_one();
+        }
+    }
+};
+
+// Background task
+// ===============
+
+// A single thread that runs one task at a time, next to the thread that launches it. Wait() returns when the last
+// task that was launched is done.
+class BackgroundTask {
+public:
+    ~BackgroundTask() { Stop(); }
+
+    // waits for the previous task, and runs task on the background thread
+    void Launch( std::function<void()> task ) {
+        Wait();
+        if (!thread.joinable()) {
+            bStop  = false;
+            thread = std::thread( [this]() { TaskLoop(); } );
+        }
+        {
+            std::lock_guard<std::mutex> lock( mtx );
+            pendingTask = std::move( task );
+            bPending    = true;
+        }
+        cvStart.notify_one();
+    }
+
+    void Wait() {
+        std::unique_lock<std::mutex> lock( mtx );
+        cvDone.wait( lock, [this]() { return !bPending; } );
+    }
+
+    void Stop() {
+        Wait();
+        {
+            std::lock_guard<std::mutex> lock( mtx );
+            bStop = true;
+        }
+        cvStart.notify_one();
+        if (thread.joinable()) thread.join();
+    }
+
+private:
+    std::thread thread;
+    std::mutex mtx;
+    std::condition_variable cvStart, cvDone;
+    std::function<void()> pendingTask;    // the task that was launched, but not started yet
+    bool bPending = false;                // a task was launched, and is not done yet
+    bool bStop    = false;
+
+    void TaskLoop() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock( mtx );
+                cvStart.wait( lock, [this]() { return bStop || pendingTask; } );
+                if (bStop) return;
+                task = std::move( pendingTask );
+                pendingTask = nullptr;
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> lock( mtx );
+                bPending = false;
+            }
+            cvDone.notify_all();
+        }
+    }
+};
 
 class AlternativeRayCaster : public olc::PixelGameEngine {
 
@@ -69,6 +497,13 @@ private:
     int nMapX = 16;
     int nMapY = 16;
 
+    // map layouts that can be selected with the --map option
+    enum MapLayout {
+        MAP_DEFAULT = 0,    // full height walls only
+        MAP_LOW_WALLS       // the default map with a few blocks of partial height added
+    };
+    int nMapLayout = MAP_DEFAULT;
+
     // player: position and looking angle
     float fPlayerX     = 2.0f;
     float fPlayerY     = 2.0f;
@@ -101,7 +536,63 @@ private:
     };
 
     int  nTextureMode   = 0;        // mode for monochrome, sprite textured or decal textured quad rendering
+
+    enum VisibilityMode {
+        VIS_SORTED = 0,     // collect visible tiles and faces, sort faces on distance, then render
+        VIS_FRONTIER,       // traverse the grid from the player outward, rendering faces as they are met
+        VIS_BSP,            // traverse the BSP tree of the map front to back, see RenderBspFrontToBack()
+        VIS_PORTALS         // recurse through the portals between the sectors of the map, see RenderPortalsFrontToBack()
+    };
+
+    int  nVisibilityMode = VIS_SORTED;   // mode for determining the visible faces and the order to render them
+
+    enum OcclusionMode {
+        OCC_LIST = 0,       // linked list of occluded intervals
+        OCC_SPANS,          // sorted array of occluded intervals
+        OCC_BITMASK         // one bit per screen column
+    };
+
+    int  nOcclusionMode = OCC_SPANS;     // data structure that keeps track of the occluded screen columns
+
+    enum SamplerMode {
+        SMP_COLUMNS = 0,    // one texel column per screen column, perspective correct
+        SMP_WARPED          // inverse bilinear warp per pixel, see DrawWarpedSprite()
+    };
+
+    int  nSamplerMode = SMP_COLUMNS;     // how the wall texture is sampled in SPRITE texture mode
+    bool bUseAVX2     = CPUSupportsAVX2();   // use the AVX2 kernels for the warped sampler and the occlusion bitmask
+    int  nRenderThreads = 1;             // nr of render threads (workers) - 1 means single threaded
+
+    enum ParallelMode {
+        PAR_BANDS = 0,      // every band of screen columns processes the complete faces list, see RenderBands()
+        PAR_JOBS            // the faces are processed single threaded, the visible spans are rendered as jobs, see RenderQuadJobs()
+    };
+
+    int  nParallelMode = PAR_BANDS;      // how the rendering is split over the render threads
+
+    enum FrameExecMode {
+        EXE_SERIAL = 0,     // the visibility stage and the rasterization of a frame are done one after the other
+        EXE_PIPELINED       // the visibility stage of the next frame runs during the rasterization, see BuildNextVisibleSet()
+    };
+
+    int  nFrameExecMode = EXE_SERIAL;
+
+    enum ProjectionMode {
+        PRJ_ANGULAR = 0,    // screen column is linear in the angle from the player, see GetColumnProjection()
+        PRJ_PINHOLE         // perspective projection of camera space locations, see BuildColInfo_pinhole()
+    };
+
+    int  nProjectionMode = PRJ_ANGULAR;  // how the face columns are projected onto the screen
+
+    enum OrderMode {
+        ORD_SORTED = 0,     // the faces list is sorted before it's rendered, see SortVisibleFaces()
+        ORD_LAZY            // the faces are taken from a heap in order while they're rendered, see NextLazyFace()
+    };
+
+    int  nOrderMode = ORD_SORTED;        // how the faces are put in front to back order
     bool bWireFrameMode = true;     // toggle for rendering wireframes in monochrome mode
+    bool bMergeFaces    = true;     // toggle for merging the visible faces into wall segments (see Merged wall segments)
+    bool bUsePVS        = false;    // toggle for culling the faces with the PVS of the player's cell (see Potentially visible sets)
 
     float fRenderMaxDist = 20.0f;   // for shading - at this distance things completely dark
 
@@ -120,6 +611,56 @@ private:
     int nLayerScene;
     int nLayerBG;
 
+    // formats for dumping frames to file
+    enum DumpFormat {
+        DUMP_NONE = 0,
+        DUMP_PPM,     // binary PPM (P6) - rgb only
+        DUMP_RGBA     // raw pixel data, 4 bytes per pixel, row by row, no header
+    };
+
+    olc::Sprite *pFrameBuffer = nullptr;      // in-memory composition of the background, scene and HUD layers
+    int nFrameCount = 0;                      // nr of frames rendered so far
+    int nMaxFrames  = HEADLESS_MODE ? 1 : 0;  // stop after this many frames - 0 means: run until user quits
+    int nDumpFormat = DUMP_NONE;
+    int nDumpEvery  = 1;                      // dump only every n-th frame
+    std::string sDumpPrefix = "frame_";
+
+    // wall clock time per stage of the render pipeline for the current frame (in microseconds)
+    typedef std::chrono::steady_clock BenchClock;
+    typedef struct sStageTimings {
+        double fTiles     = 0.0;    // GetVisibleTiles()
+        double fFaces     = 0.0;    // GetVisibleFaces()
+        double fSort      = 0.0;    // SortVisibleFaces()
+        double fOcclusion = 0.0;    // all calls to InsertOccList()                  - in band mode: summed over the bands
+        double fRaster    = 0.0;    // all calls to the RenderWallQuad_xyz() functions - in band mode: summed over the bands
+        double fFrame     = 0.0;    // complete scene rendering, including the stages above
+    } StageTimings;
+    StageTimings curTimings;
+
+    // benchmark (scripted fly through) administration
+    typedef struct sBenchRecord {
+        int nMode, nFrame;
+        float fX, fY, fA;
+        int nTiles, nFaces, nRendered;
+        StageTimings timings;
+        std::vector<WorkerPool::WorkerStats> vWorkerStats;   // empty if the frame was rendered single threaded
+        double fWorkerMicros = 0.0;
+    } BenchRecord;
+
+    int  nBenchOcclusion    = 0;      // nr of frames for the occlusion microbenchmark (0 = don't run it)
+    int  nBenchWarp         = 0;      // nr of frames for the warped sampler accuracy test and microbenchmark
+    int  nBenchTransform    = 0;      // nr of corners for the corner transform accuracy test and microbenchmark
+    int  nBenchPVS          = 0;      // nr of poses for the PVS accuracy test and microbenchmark
+    int  nBenchPortals      = 0;      // nr of poses for the portal visibility accuracy test and microbenchmark
+    bool bBenchMode         = false;
+    int  nBenchFramesPerRun = 0;      // nr of frames for one fly through (per texture mode)
+    int  nBenchFrame        = 0;      // frame within current run
+    int  nBenchRun          = 0;      // index into vBenchModes
+    std::vector<int> vBenchModes;     // texture modes to run the fly through for
+    std::vector<BenchRecord> vBenchRecords;
+    std::vector<olc::vf2d>   vFlyPath;  // closed path of way points
+    std::string sBenchFile = FILE_NAME_BENCH;
+
     // column descriptor - a column is a strictly vertical line that is either the left or the right side of a face
     typedef struct sColDescriptor {
         int nScreenX              = 0;       // projection of face column onto screen column
@@ -145,6 +686,10 @@ private:
         bool bVisible = false;     // for culling
 
         ColInfo leftCol, rghtCol;  // info on the columns for this face
+        float fHeight = 1.0f;      // height of the face - 1.0f is the full height of a cell
+        int nTiles = 1;            // nr of tile faces - more than 1 for a merged wall segment, TileID is its leftmost tile
+        float fLeftU = 0.0f;       // texture u of the left and right column, in tile faces from the left side of TileID -
+        float fRghtU = 1.0f;       // less than [0, nTiles] if the face is clipped by the near plane
     } FaceInfo;
 
     // tile descriptor - a tile has coordinates in the map
@@ -213,9 +758,12 @@ private:
     }
 
 public:
-    bool OnUserCreate() override {
-
+    // sets up the map - this is separated from OnUserCreate() because the microbenchmarks need the map as well
+    void InitMap() {
         // tile layout of the map - must be of size nMapX x nMapY
+        // '.' is an empty cell, '#' is a full height wall, and the digits '1' to '9' are walls of partial height
+        // (see GetCellHeight())
+        sMap.clear();
 
         //            0         1
         //            0123456789012345
@@ -236,9 +784,35 @@ public:
         sMap.append( "#..............#" );
         sMap.append( "################" );
 
+        if (nMapLayout == MAP_LOW_WALLS) {
+            // add a few blocks of partial height, off the fly through path
+            sMap[  6 * nMapX + 11 ] = '7';
+            sMap[  9 * nMapX + 12 ] = '5';
+            sMap[ 11 * nMapX +  5 ] = '5';
+        }
+
+        BuildFaceTable();
+    }
+
+    // work out distance to projection plane. This is a constant depending on the width of the projection plane and the field of view.
+    // Like InitMap() this is separated from OnUserCreate() for the microbenchmarks
+    void InitProjection() {
+        fDistToProjPlane = ((ScreenWidth() / 2.0f) / sin( Deg2Rad( fPlayerFoV_deg / 2.0f ))) * cos( Deg2Rad( fPlayerFoV_deg / 2.0f ));
+    }
+
+    bool OnUserCreate() override {
+
+        InitMap();
+
         // sprite used for texturing walls
 //        brickTexture = new olc::Sprite( "Bricks_06-128x128.png" );
         brickTexture = new olc::Sprite( "new wall.png" );
+        if (brickTexture->width == 0 || brickTexture->height == 0) {
+            // loading failed (or there's no image loader, as in headless builds)
+            std::cout << "WARNING: OnUserCreate() --> couldn't load wall texture, using synthetic texture instead" << std::endl;
+            delete brickTexture;
+            brickTexture = CreateFallbackTexture( 128 );
+        }
 
         int nSpriteSize = brickTexture->height;   // assumption !! sprite is square
         brickTextureB = brickTexture->Duplicate();
@@ -250,8 +824,9 @@ public:
             brickTextureB->SetPixel( nSpriteSize - 1,               b, olc::GREEN );
         }
 
-        // work out distance to projection plane. This is a constant depending on the width of the projection plane and the field of view.
-        fDistToProjPlane = ((ScreenWidth() / 2.0f) / sin( Deg2Rad( fPlayerFoV_deg / 2.0f ))) * cos( Deg2Rad( fPlayerFoV_deg / 2.0f ));
+        InitProjection();
+        mainState.nBandLeft = nextState.nBandLeft = 0;
+        mainState.nBandRght = nextState.nBandRght = ScreenWidth() - 1;
 
         fPlayerA_rad = Deg2Rad( fPlayerA_deg );
         fPlayerSin   = sin(     fPlayerA_rad );
@@ -318,12 +893,777 @@ public:
             pDecalWallsB[f] = new olc::Decal( pSpriteWallsB[f] );
         }
 
+        // way points for the scripted fly through (benchmark mode)
+        InitFlyThroughPath();
+
+        // frame buffer for composing the layers into (headless mode and frame dumping)
+        pFrameBuffer = new olc::Sprite( ScreenWidth(), ScreenHeight() );
+
         // reset draw target
         SetDrawTarget( nLayerHUD );
 
         return true;
     }
 
+    bool OnUserDestroy() override {
+        // in pipelined mode the visibility stage of the next frame may still be running
+        visibilityTask.Wait();
+        // release the frame buffer that was allocated in OnUserCreate()
+        delete pFrameBuffer;
+        pFrameBuffer = nullptr;
+
+        return true;
+    }
+
+    // creates a synthetic brick texture of nSize x nSize pixels
+    olc::Sprite *CreateFallbackTexture( int nSize ) {
+        olc::Sprite *pResult = new olc::Sprite( nSize, nSize );
+        int nBrickW = std::max( 2, nSize / 4 );
+        int nBrickH = std::max( 2, nSize / 8 );
+        for (int y = 0; y < nSize; y++) {
+            // every other row of bricks is shifted half a brick
+            int nOffset = ((y / nBrickH) % 2) * (nBrickW / 2);
+            for (int x = 0; x < nSize; x++) {
+                bool bMortar = (y % nBrickH == 0) || ((x + nOffset) % nBrickW == 0);
+                pResult->SetPixel( x, y, bMortar ? olc::Pixel( 190, 190, 180 ) : olc::Pixel( 150, 60, 40 ));
+            }
+        }
+        return pResult;
+    }
+
+    // Headless rendering and frame dumping
+    // ====================================
+
+    // composes the background, scene and HUD layer into pFrameBuffer, in the same order as the PGE renders them
+    // NOTE: decals are rendered by the GPU, so they don't end up in the frame buffer. That's why the background is
+    //       taken from pSpriteBG, and why DECAL texture mode is not available in headless mode.
+    void ComposeFrame() {
+        int nPixels = pFrameBuffer->width * pFrameBuffer->height;
+        olc::Pixel *pDst = pFrameBuffer->GetData();
+        std::copy( pSpriteBG->GetData(), pSpriteBG->GetData() + nPixels, pDst );
+
+        // the scene and HUD layers only contain opaque or blank pixels, so no blending is needed
+        int vLayers[2] = { nLayerScene, nLayerHUD };
+        for (int l = 0; l < 2; l++) {
+            SetDrawTarget( vLayers[l] );
+            olc::Pixel *pSrc = GetDrawTarget()->GetData();
+            for (int i = 0; i < nPixels; i++) {
+                if (pSrc[i].a != 0) pDst[i] = pSrc[i];
+            }
+        }
+        SetDrawTarget( nLayerHUD );
+    }
+
+    // writes the contents of pFrameBuffer to file sFileName, in either PPM or raw RGBA format
+    bool DumpFrame( const std::string &sFileName, int nFormat ) {
+        std::ofstream dumpFile( sFileName, std::ios::binary );
+        if (!dumpFile.is_open()) {
+            std::cout << "ERROR: DumpFrame() --> can't open file for writing: " << sFileName << std::endl;
+            return false;
+        }
+        int w = pFrameBuffer->width;
+        int h = pFrameBuffer->height;
+        olc::Pixel *pSrc = pFrameBuffer->GetData();
+        if (nFormat == DUMP_PPM) {
+            dumpFile << "P6\n" << w << " " << h << "\n255\n";
+            std::vector<char> vRow( 3 * w );
+            for (int y = 0; y < h; y++) {
+                for (int x = 0; x < w; x++) {
+                    olc::Pixel &p = pSrc[ y * w + x ];
+                    vRow[ 3 * x + 0 ] = p.r;
+                    vRow[ 3 * x + 1 ] = p.g;
+                    vRow[ 3 * x + 2 ] = p.b;
+                }
+                dumpFile.write( vRow.data(), vRow.size() );
+            }
+        } else {
+            // an olc::Pixel is laid out in memory as r, g, b, a bytes
+            dumpFile.write( (char *)pSrc, std::streamsize( w ) * h * sizeof( olc::Pixel ));
+        }
+        return dumpFile.good();
+    }
+
+    // returns the name of the dump file for frame nFrame, e.g. "frame_00012.ppm"
+    std::string DumpFileName( int nFrame ) {
+        std::string sNr = std::to_string( nFrame );
+        while (sNr.length() < 5) sNr = "0" + sNr;
+        return sDumpPrefix + sNr + (nDumpFormat == DUMP_PPM ? ".ppm" : ".rgba");
+    }
+
+    // Benchmarking
+    // ============
+
+    // returns the nr of microseconds elapsed since tStart
+    double MicrosSince( BenchClock::time_point tStart ) {
+        return std::chrono::duration<double, std::micro>( BenchClock::now() - tStart ).count();
+    }
+
+    // sets up the (closed) fly through path. The way points are cell centers that are connected by straight lines
+    // through empty cells of the map
+    void InitFlyThroughPath() {
+        vFlyPath = {
+            {  2.5f,  1.5f }, { 13.5f,  1.5f }, { 13.5f, 14.5f }, {  2.5f, 14.5f }, {  2.5f,  8.5f },
+            {  9.5f,  8.5f }, {  9.5f, 12.0f }, {  9.5f,  8.5f }, {  2.5f,  7.5f }
+        };
+        for (auto &p : vFlyPath) {
+            if (sMap[ int( p.y ) * nMapX + int( p.x ) ] != '.') {
+                std::cout << "WARNING: InitFlyThroughPath() --> way point inside non empty cell: " << p.x << ", " << p.y << std::endl;
+            }
+        }
+    }
+
+    // works out player position and looking angle for fraction t in [0, 1) of the fly through path.
+    // The player looks in the direction of movement, with a sinusoidal sweep to the left and right
+    void GetFlyThroughPose( float t, float &fX, float &fY, float &fA_deg ) {
+        int nPoints = (int)vFlyPath.size();
+        float fTotalLen = 0.0f;
+        for (int i = 0; i < nPoints; i++) {
+            fTotalLen += (vFlyPath[ (i + 1) % nPoints ] - vFlyPath[i]).mag();
+        }
+        // walk the path segments until the one containing t is found
+        float fToGo = t * fTotalLen;
+        for (int i = 0; i < nPoints; i++) {
+            olc::vf2d p1 = vFlyPath[i];
+            olc::vf2d p2 = vFlyPath[ (i + 1) % nPoints ];
+            float fSegLen = (p2 - p1).mag();
+            if (fToGo <= fSegLen || i == nPoints - 1) {
+                olc::vf2d dir = (p2 - p1) / std::max( fSegLen, 0.0001f );
+                olc::vf2d pos = p1 + dir * std::min( fToGo, fSegLen );
+                fX     = pos.x;
+                fY     = pos.y;
+                fA_deg = Rad2Deg( atan2f( dir.y, dir.x )) + BENCH_SWEEP_DEG * sinf( 8.0f * PI * t );
+                while (fA_deg <    0.0f) fA_deg += 360.0f;
+                while (fA_deg >= 360.0f) fA_deg -= 360.0f;
+                return;
+            }
+            fToGo -= fSegLen;
+        }
+    }
+
+    // stores the info and timings of the current frame for the benchmark
+    void RecordBenchFrame() {
+        BenchRecord rec;
+        rec.nMode     = nTextureMode;
+        rec.nFrame    = nBenchFrame;
+        rec.fX        = fPlayerX;
+        rec.fY        = fPlayerY;
+        rec.fA        = fPlayerA_deg;
+        rec.nTiles    = (int)vTilesToRender.size();
+        rec.nFaces    = (int)vFacesToRender.size();
+        rec.nRendered = nFacesRendered;
+        rec.timings   = curTimings;
+        rec.vWorkerStats  = vWorkerStats;
+        rec.fWorkerMicros = fWorkerMicros;
+        vBenchRecords.push_back( rec );
+    }
+
+    // returns the p-th percentile (nearest rank method) of the values in vValues
+    double Percentile( std::vector<double> vValues, float p ) {
+        if (vValues.empty()) return 0.0;
+        std::sort( vValues.begin(), vValues.end() );
+        int nRank = int( ceil( p / 100.0f * float( vValues.size() )));
+        return vValues[ Clamp( nRank - 1, 0, (int)vValues.size() - 1 ) ];
+    }
+
+    // writes the per frame benchmark records to sBenchFile (csv), and prints a summary per texture mode
+    void WriteBenchResults() {
+        // little lambdas for formatting the output
+        auto mode_string = [=]( int nMode ) {
+            std::string sResult = TextureMode2String( nMode );
+            sResult.erase( sResult.find_last_not_of( ' ' ) + 1 );
+            return sResult;
+        };
+        auto micros_string = [=]( double fMicros ) {
+            std::ostringstream os;
+            os << std::fixed << std::setprecision( 1 ) << fMicros;
+            return os.str();
+        };
+
+        std::ofstream csvFile( sBenchFile );
+        if (!csvFile.is_open()) {
+            std::cout << "ERROR: WriteBenchResults() --> can't open file for writing: " << sBenchFile << std::endl;
+        } else {
+            csvFile << "mode,frame,x,y,angle,tiles,faces,rendered,tiles_us,faces_us,sort_us,occlusion_us,raster_us,frame_us" << std::endl;
+            for (auto &r : vBenchRecords) {
+                csvFile << mode_string( r.nMode ) << "," << r.nFrame << "," << r.fX << "," << r.fY << "," << r.fA << ","
+                        << r.nTiles << "," << r.nFaces << "," << r.nRendered << ","
+                        << r.timings.fTiles << "," << r.timings.fFaces << "," << r.timings.fSort << ","
+                        << r.timings.fOcclusion << "," << r.timings.fRaster << "," << r.timings.fFrame << std::endl;
+            }
+            std::cout << "Benchmark: per frame timings written to " << sBenchFile << std::endl;
+        }
+
+        // summary - percentiles per stage for each texture mode
+        std::string vStageNames[6] = { "tiles", "faces", "sort", "occlusion", "raster", "frame" };
+        for (int nMode : vBenchModes) {
+            std::vector<double> vStageValues[6];
+            for (auto &r : vBenchRecords) {
+                if (r.nMode != nMode) continue;
+                double vValues[6] = { r.timings.fTiles, r.timings.fFaces, r.timings.fSort, r.timings.fOcclusion, r.timings.fRaster, r.timings.fFrame };
+                for (int s = 0; s < 6; s++) vStageValues[s].push_back( vValues[s] );
+            }
+            std::cout << std::endl << "Benchmark summary - texture mode: " << mode_string( nMode )
+                      << ", visibility mode: " << VisibilityMode2String( nVisibilityMode )
+                      << ", occlusion mode: " << OcclusionMode2String( nOcclusionMode )
+                      << ", sampler mode: " << SamplerMode2String( nSamplerMode )
+                      << ", threads: " << nRenderThreads
+                      << ", parallel mode: " << ParallelMode2String( nParallelMode )
+                      << ", frame exec: " << FrameExecMode2String( nFrameExecMode )
+                      << ", merge faces: " << (bMergeFaces ? "on" : "off")
+                      << ", pvs: " << (bUsePVS ? "on" : "off")
+                      << ", projection: " << ProjectionMode2String( nProjectionMode )
+                      << ", face order: " << OrderMode2String( nOrderMode )
+                      << " - " << vStageValues[0].size() << " frames (times in microseconds)" << std::endl;
+            std::cout << StringAlignedL( "stage", 12 ) << StringAlignedR( "p50", 12 ) << StringAlignedR( "p95", 12 ) << StringAlignedR( "p99", 12 ) << std::endl;
+            for (int s = 0; s < 6; s++) {
+                std::cout << StringAlignedL( vStageNames[s], 12 )
+                          << StringAlignedR( micros_string( Percentile( vStageValues[s], 50.0f )), 12 )
+                          << StringAlignedR( micros_string( Percentile( vStageValues[s], 95.0f )), 12 )
+                          << StringAlignedR( micros_string( Percentile( vStageValues[s], 99.0f )), 12 ) << std::endl;
+            }
+
+            // per worker totals over the frames that were rendered in parallel
+            std::vector<WorkerPool::WorkerStats> vWorkerTotals;
+            double fWorkerMicrosTotal = 0.0;
+            for (auto &r : vBenchRecords) {
+                if (r.nMode != nMode || r.vWorkerStats.empty()) continue;
+                vWorkerTotals.resize( std::max( vWorkerTotals.size(), r.vWorkerStats.size() ));
+                for (int w = 0; w < (int)r.vWorkerStats.size(); w++) {
+                    vWorkerTotals[w].fBusy   += r.vWorkerStats[w].fBusy;
+                    vWorkerTotals[w].nJobs   += r.vWorkerStats[w].nJobs;
+                    vWorkerTotals[w].nSteals += r.vWorkerStats[w].nSteals;
+                }
+                fWorkerMicrosTotal += r.fWorkerMicros;
+            }
+            if (!vWorkerTotals.empty()) {
+                std::cout << StringAlignedL( "worker", 12 ) << StringAlignedR( "jobs", 12 ) << StringAlignedR( "steals", 12 )
+                          << StringAlignedR( "busy", 12 ) << StringAlignedR( "util %", 12 ) << std::endl;
+                for (int w = 0; w < (int)vWorkerTotals.size(); w++) {
+                    std::cout << StringAlignedL( std::to_string( w ), 12 )
+                              << StringAlignedR( vWorkerTotals[w].nJobs, 12 )
+                              << StringAlignedR( vWorkerTotals[w].nSteals, 12 )
+                              << StringAlignedR( micros_string( vWorkerTotals[w].fBusy ), 12 )
+                              << StringAlignedR( micros_string( 100.0 * vWorkerTotals[w].fBusy / std::max( 1.0, fWorkerMicrosTotal )), 12 ) << std::endl;
+                }
+            }
+        }
+    }
+
+    // Microbenchmark for the occlusion structures. The workload consists of the sorted occlusion records of the faces
+    // along the fly through path. The same workload is inserted into the occlusion list, the span buffer and the
+    // bitmask, and the insert throughput of each of them is reported.
+    // Per frame the structure is initialised and records are inserted until the screen is fully occluded.
+    void BenchOcclusion( int nFrames ) {
+
+        // build the workload - per frame the sorted face records, and the index of the first record of each frame
+        InitMap();
+        InitFlyThroughPath();
+        std::vector<OcclusionRec> vRecs;
+        std::vector<int> vFrameStart;
+        for (int f = 0; f < nFrames; f++) {
+            GetFlyThroughPose( float( f ) / float( nFrames ), fPlayerX, fPlayerY, fPlayerA_deg );
+            fPlayerA_rad = Deg2Rad( fPlayerA_deg );
+            fPlayerSin   = sin(     fPlayerA_rad );
+            fPlayerCos   = cos(     fPlayerA_rad );
+
+            vTilesToRender.clear();
+            vFacesToRender.clear();
+            ResetCornerCache();
+            GetVisibleTiles( vTilesToRender );
+            GetVisibleFaces( vTilesToRender, vFacesToRender );
+            SortVisibleFaces( vFacesToRender );
+
+            vFrameStart.push_back( (int)vRecs.size() );
+            for (auto &face : vFacesToRender) {
+                vRecs.push_back( { face.leftCol.nScreenX, face.rghtCol.nScreenX } );
+            }
+        }
+        vFrameStart.push_back( (int)vRecs.size() );
+
+        // little lambda to run the workload on either of the occlusion structures. Returns the elapsed time, and
+        // passes back the nr of inserts done and per frame the nr of columns that were reported visible
+        std::vector<OcclusionRec> vVisible;
+        auto run_workload = [&]( auto &occStruct, long long &nInserts, std::vector<int> &vVisibleCols ) {
+            nInserts = 0;
+            vVisibleCols.assign( nFrames, 0 );
+            BenchClock::time_point tStart = BenchClock::now();
+            for (int f = 0; f < nFrames; f++) {
+                InitOccList( occStruct );
+                for (int k = vFrameStart[f]; k < vFrameStart[f + 1] && !FullyOccluded( occStruct ); k++) {
+                    InsertOccList( occStruct, vRecs[k], vVisible );
+                    for (auto &span : vVisible) {
+                        vVisibleCols[f] += span.rght - span.left + 1;
+                    }
+                    nInserts += 1;
+                }
+            }
+            return MicrosSince( tStart );
+        };
+
+        OccListType   benchList;
+        OccSpanBuffer benchSpans;
+        OccBitmask    benchBits;
+        long long nListInserts, nSpanInserts, nBitsInserts;
+        std::vector<int> vListCols, vSpanCols, vBitsCols;
+        double fListMicros = run_workload( benchList , nListInserts, vListCols );
+        double fSpanMicros = run_workload( benchSpans, nSpanInserts, vSpanCols );
+        double fBitsMicros = run_workload( benchBits , nBitsInserts, vBitsCols );
+
+        int nListDiffs = 0, nBitsDiffs = 0;
+        for (int f = 0; f < nFrames; f++) {
+            if (vListCols[f] != vSpanCols[f]) nListDiffs += 1;
+            if (vBitsCols[f] != vSpanCols[f]) nBitsDiffs += 1;
+        }
+
+        auto report = [=]( const std::string &sName, double fMicros, long long nInserts ) {
+            std::cout << "  " << StringAlignedL( sName, 12 ) << ": " << StringAlignedR( int( fMicros ), 10 ) << " us total, "
+                      << StringAlignedR( float( 1000.0 * fMicros / std::max( 1LL, nInserts )), 12 ) << " ns per insert, "
+                      << StringAlignedR( float( double( nInserts ) / std::max( 1.0, fMicros )), 12 ) << " M inserts/s" << std::endl;
+        };
+        std::cout << "Occlusion microbenchmark - " << nFrames << " frames, " << vRecs.size() << " records, screen width " << ScreenWidth() << std::endl;
+        report( "list"       , fListMicros, nListInserts );
+        report( "span buffer", fSpanMicros, nSpanInserts );
+        report( "bitmask"    , fBitsMicros, nBitsInserts );
+        std::cout << "  speed up vs. list - span buffer: " << float( fListMicros / std::max( 1.0, fSpanMicros ))
+                  << ", bitmask: " << float( fListMicros / std::max( 1.0, fBitsMicros )) << std::endl;
+        std::cout << "  frames with different nr of visible columns than span buffer - list: " << nListDiffs
+                  << ", bitmask: " << nBitsDiffs << std::endl;
+    }
+
+    // Accuracy test and microbenchmark for the warped sprite sampler. The workload consists of the visible faces along
+    // the fly through path, each rendered over its full width into an off screen sprite. Every frame is rendered by
+    // both the scalar kernel (double precision) and the AVX2 kernel (float), and the results are compared per pixel.
+    // NOTE: the draw target is not restored afterwards, since the engine isn't started
+    void BenchWarpedSampler( int nFrames ) {
+#if X86_SIMD_KERNELS
+        if (!bUseAVX2) {
+            std::cout << "WARNING: BenchWarpedSampler() --> AVX2 kernel not available or disabled, nothing to compare" << std::endl;
+            return;
+        }
+
+        // build the workload - per frame the quads of the visible faces, and the index of the first quad of each frame
+        InitMap();
+        InitProjection();
+        InitFlyThroughPath();
+        std::vector<RenderCommand> vQuads;
+        std::vector<int> vFrameStart;
+        for (int f = 0; f < nFrames; f++) {
+            GetFlyThroughPose( float( f ) / float( nFrames ), fPlayerX, fPlayerY, fPlayerA_deg );
+            fPlayerA_rad = Deg2Rad( fPlayerA_deg );
+            fPlayerSin   = sin(     fPlayerA_rad );
+            fPlayerCos   = cos(     fPlayerA_rad );
+
+            vTilesToRender.clear();
+            vFacesToRender.clear();
+            ResetCornerCache();
+            GetVisibleTiles( vTilesToRender );
+            GetVisibleFaces( vTilesToRender, vFacesToRender );
+            SortVisibleFaces( vFacesToRender );
+
+            vFrameStart.push_back( (int)vQuads.size() );
+            for (auto &face : vFacesToRender) {
+                // wall segments are split in their tile faces, like when they are rendered
+                ForEachFacePiece( face, face.leftCol.nScreenX, face.rghtCol.nScreenX, face.leftCol.nScreenX, face.rghtCol.nScreenX, [&]( FaceInfo &piece, int, int ) {
+                    vQuads.push_back( { piece, piece.leftCol.nScreenX, piece.rghtCol.nScreenX } );
+                } );
+            }
+        }
+        vFrameStart.push_back( (int)vQuads.size() );
+
+        olc::Sprite *pTexture = CreateFallbackTexture( 128 );
+        olc::Sprite *pTargetScalar = new olc::Sprite( ScreenWidth(), ScreenHeight() );
+        olc::Sprite *pTargetAVX2   = new olc::Sprite( ScreenWidth(), ScreenHeight() );
+        int nPixels = ScreenWidth() * ScreenHeight();
+
+        // little lambda to render the quads of frame f into pTarget with either of the kernels. Returns the elapsed time
+        auto render_frame = [&]( int f, olc::Sprite *pTarget, bool bAVX2 ) {
+            std::fill( pTarget->GetData(), pTarget->GetData() + nPixels, olc::BLANK );
+            SetDrawTarget( pTarget );
+            BenchClock::time_point tStart = BenchClock::now();
+            for (int k = vFrameStart[f]; k < vFrameStart[f + 1]; k++) {
+                std::array<olc::vf2d, 4> quadPoints;
+                int nRenderStrt, nRenderStop;
+                GetWarpedQuad( vQuads[k].face, vQuads[k].nLeftClip, vQuads[k].nRghtClip, quadPoints, nRenderStrt, nRenderStop );
+                FaceInfo &face = vQuads[k].face;
+                if (bAVX2) {
+                    DrawWarpedSprite_avx2(   pTexture, quadPoints, nRenderStrt, nRenderStop, 256, face.fLeftU, face.fRghtU );
+                } else {
+                    DrawWarpedSprite_scalar( pTexture, quadPoints, nRenderStrt, nRenderStop, 256, face.fLeftU, face.fRghtU );
+                }
+            }
+            return MicrosSince( tStart );
+        };
+
+        double fScalarMicros = 0.0, fAVX2Micros = 0.0;
+        long long nCovered = 0, nDiffs = 0;
+        for (int f = 0; f < nFrames; f++) {
+            fScalarMicros += render_frame( f, pTargetScalar, false );
+            fAVX2Micros   += render_frame( f, pTargetAVX2  , true  );
+            for (int i = 0; i < nPixels; i++) {
+                olc::Pixel a = pTargetScalar->GetData()[i];
+                olc::Pixel b = pTargetAVX2->GetData()[i];
+                if (a.a != 0 || b.a != 0) nCovered += 1;
+                if (a != b) nDiffs += 1;
+            }
+        }
+        float fDiffPct = float( 100.0 * double( nDiffs ) / double( std::max( 1LL, nCovered )));
+
+        std::cout << "Warped sampler microbenchmark - " << nFrames << " frames, " << vQuads.size() << " quads, " << nCovered << " pixels covered" << std::endl;
+        std::cout << "  " << StringAlignedL( "scalar", 12 ) << ": " << StringAlignedR( int( fScalarMicros ), 10 ) << " us total" << std::endl;
+        std::cout << "  " << StringAlignedL( "avx2"  , 12 ) << ": " << StringAlignedR( int( fAVX2Micros   ), 10 ) << " us total" << std::endl;
+        std::cout << "  speed up vs. scalar: " << float( fScalarMicros / std::max( 1.0, fAVX2Micros )) << std::endl;
+        std::cout << "  accuracy: " << nDiffs << " pixels differ (" << fDiffPct << " % of covered pixels, max. " << WARP_MAX_DIFF << " %) - "
+                  << (fDiffPct <= WARP_MAX_DIFF ? "PASSED" : "FAILED") << std::endl;
+
+        delete pTargetScalar;
+        delete pTargetAVX2;
+        delete pTexture;
+#else
+        std::cout << "WARNING: BenchWarpedSampler() --> AVX2 kernel not compiled in for this platform, nothing to compare" << std::endl;
+#endif
+    }
+
+    // Accuracy test and microbenchmark for the corner transform kernels of the pinhole projection. The workload is
+    // nCorners random grid corners of the map, transformed for a number of poses along the fly through path by the
+    // scalar, SSE and AVX2 kernels. The results of the SIMD kernels are compared with the scalar ones.
+    void BenchCornerTransform( int nCorners ) {
+        InitMap();
+        InitProjection();
+        InitFlyThroughPath();
+
+        CornerBatch b;
+        srand( 1 );
+        for (int i = 0; i < nCorners; i++) {
+            b.vX.push_back( float( rand() % (nMapX + 1)));
+            b.vY.push_back( float( rand() % (nMapY + 1)));
+        }
+        std::vector<float> vRaw( nCorners ), vDepth( nCorners );
+        std::vector<int>   vScreenX( nCorners );
+        b.vRaw.resize( nCorners );
+        b.vDepth.resize( nCorners );
+        b.vScreenX.resize( nCorners );
+
+        // little lambda to run the workload with kernel nKernel (0 = scalar, 1 = SSE, 2 = AVX2). The results of the
+        // scalar kernel are put in the batch, the others are compared with them. Returns the elapsed time
+        long long nDiffs[3] = { 0, 0, 0 };
+        auto run_kernel = [&]( int nKernel, float fT ) {
+            GetFlyThroughPose( fT, fPlayerX, fPlayerY, fPlayerA_deg );
+            fPlayerA_rad = Deg2Rad( fPlayerA_deg );
+            fPlayerSin   = sin(     fPlayerA_rad );
+            fPlayerCos   = cos(     fPlayerA_rad );
+
+            float *pRaw   = (nKernel == 0) ? b.vRaw.data()     : vRaw.data();
+            float *pDepth = (nKernel == 0) ? b.vDepth.data()   : vDepth.data();
+            int   *pX     = (nKernel == 0) ? b.vScreenX.data() : vScreenX.data();
+            BenchClock::time_point tStart = BenchClock::now();
+            int nDone = 0;
+#if X86_SIMD_KERNELS
+            if (nKernel == 1) nDone = TransformCorners_sse(  b.vX.data(), b.vY.data(), nCorners, pRaw, pDepth, pX );
+            if (nKernel == 2) nDone = TransformCorners_avx2( b.vX.data(), b.vY.data(), nCorners, pRaw, pDepth, pX );
+#endif
+            TransformCorners_scalar( b.vX.data() + nDone, b.vY.data() + nDone, nCorners - nDone, pRaw + nDone, pDepth + nDone, pX + nDone );
+            double fMicros = MicrosSince( tStart );
+
+            if (nKernel != 0) {
+                for (int i = 0; i < nCorners; i++) {
+                    if (vRaw[i] != b.vRaw[i] || vDepth[i] != b.vDepth[i] || vScreenX[i] != b.vScreenX[i]) nDiffs[nKernel] += 1;
+                }
+            }
+            return fMicros;
+        };
+
+        int nPoses = 20;
+        bool bAVX2 = X86_SIMD_KERNELS && bUseAVX2;
+        double fMicros[3] = { 0.0, 0.0, 0.0 };
+        for (int p = 0; p < nPoses; p++) {
+            float fT = float( p ) / float( nPoses );
+            fMicros[0] += run_kernel( 0, fT );
+            if (X86_SIMD_KERNELS) fMicros[1] += run_kernel( 1, fT );
+            if (bAVX2)            fMicros[2] += run_kernel( 2, fT );
+        }
+
+        long long nTotal = (long long)nCorners * nPoses;
+        auto report = [=]( const std::string &sName, double fKernelMicros ) {
+            std::cout << "  " << StringAlignedL( sName, 12 ) << ": " << StringAlignedR( int( fKernelMicros ), 10 ) << " us total, "
+                      << StringAlignedR( float( 1000.0 * fKernelMicros / double( nTotal )), 12 ) << " ns per corner, speed up vs. scalar: "
+                      << float( fMicros[0] / std::max( 1.0, fKernelMicros )) << std::endl;
+        };
+        std::cout << "Corner transform microbenchmark - " << nCorners << " corners, " << nPoses << " poses" << std::endl;
+        report( "scalar", fMicros[0] );
+        if (X86_SIMD_KERNELS) report( "sse" , fMicros[1] );
+        if (bAVX2)            report( "avx2", fMicros[2] );
+        if (!X86_SIMD_KERNELS) {
+            std::cout << "WARNING: BenchCornerTransform() --> SIMD kernels not compiled in for this platform, nothing to compare" << std::endl;
+        } else {
+            std::cout << "  accuracy: results that differ from scalar - sse: " << nDiffs[1] << ", avx2: " << (bAVX2 ? std::to_string( nDiffs[2] ) : "n/a")
+                      << " - " << (nDiffs[1] + nDiffs[2] == 0 ? "PASSED" : "FAILED") << std::endl;
+        }
+    }
+
+    // runs the microbenchmarks that were requested on the command line. Returns true if any of them was run
+    // NOTE: this must be called after Construct(), but the engine doesn't need to be started
+    bool RunMicroBenchmarks() {
+        bool bResult = false;
+        if (nBenchOcclusion > 0) {
+            BenchOcclusion( nBenchOcclusion );
+            bResult = true;
+        }
+        if (nBenchWarp > 0) {
+            BenchWarpedSampler( nBenchWarp );
+            bResult = true;
+        }
+        if (nBenchTransform > 0) {
+            BenchCornerTransform( nBenchTransform );
+            bResult = true;
+        }
+        if (nBenchPVS > 0) {
+            BenchPVS( nBenchPVS );
+            bResult = true;
+        }
+        if (nBenchPortals > 0) {
+            BenchPortals( nBenchPortals );
+            bResult = true;
+        }
+        return bResult;
+    }
+
+    // Command line processing
+    // =======================
+
+    void PrintUsage( const std::string &sProgName ) {
+        std::cout << "Usage: " << sProgName << " [options]" << std::endl;
+        std::cout << "  -h, --help             show this overview" << std::endl;
+        std::cout << "  --frames <n>           stop after n frames (0 = run until quit, default " << nMaxFrames << ")" << std::endl;
+        std::cout << "  --dump <ppm|rgba>      dump frames to file in the specified format" << std::endl;
+        std::cout << "  --dump-prefix <s>      prefix for the dump file names (default " << sDumpPrefix << ")" << std::endl;
+        std::cout << "  --dump-every <n>       only dump every n-th frame (default 1)" << std::endl;
+        std::cout << "  --texture <mode>       texture mode: mono, sprite or decal" << std::endl;
+        std::cout << "  --visibility <mode>    visibility mode: sorted, frontier, bsp or portals" << std::endl;
+        std::cout << "  --bsp-file <file>      load the BSP tree from file - if that fails it's compiled and saved to file" << std::endl;
+        std::cout << "  --occlusion <mode>     occlusion structure: list, spans or bitmask" << std::endl;
+        std::cout << "  --sampler <mode>       texture sampler for sprite mode: columns or warped" << std::endl;
+        std::cout << "  --threads <n>          render with n threads (0 = nr of cores, default 1)" << std::endl;
+        std::cout << "  --parallel <mode>      split the rendering over the threads in bands or jobs (default bands)" << std::endl;
+        std::cout << "  --exec <mode>          frame execution: serial or pipelined (visibility overlaps rasterization)" << std::endl;
+        std::cout << "  --projection <mode>    projection of the faces: angular or pinhole (camera space)" << std::endl;
+        std::cout << "  --order <mode>         front to back order of the faces: sorted or lazy (heap, as far as needed)" << std::endl;
+        std::cout << "  --map <layout>         map layout: default, or lowwalls (with blocks of partial height)" << std::endl;
+        std::cout << "  --pos <x> <y> <a>      initial player position and looking angle (degrees)" << std::endl;
+        std::cout << "  --nomap, --noinfo      don't render minimap resp. info panels" << std::endl;
+        std::cout << "  --nowire               don't render wire frames / texture borders" << std::endl;
+        std::cout << "  --nomerge              don't merge the visible faces into wall segments" << std::endl;
+        std::cout << "  --pvs                  only consider the faces in the potentially visible set of the player's cell" << std::endl;
+        std::cout << "  --pvs-file <file>      as --pvs, load the PVS from file - if that fails they're computed and saved to file" << std::endl;
+        std::cout << "  --bench <n>            fly through benchmark, n frames per texture mode" << std::endl;
+        std::cout << "  --bench-csv <file>     output file for per frame timings (default " << FILE_NAME_BENCH << ")" << std::endl;
+        std::cout << "  --bench-occlusion <n>  microbenchmark of the occlusion structures, n frames" << std::endl;
+        std::cout << "  --bench-warp <n>       accuracy test and microbenchmark of the warped sampler kernels, n frames" << std::endl;
+        std::cout << "  --bench-transform <n>  accuracy test and microbenchmark of the corner transform kernels, n corners" << std::endl;
+        std::cout << "  --bench-pvs <n>        accuracy test and microbenchmark of the PVS, n random poses" << std::endl;
+        std::cout << "  --bench-portals <n>    accuracy test and microbenchmark of portal visibility, n random poses" << std::endl;
+        std::cout << "  --noavx2               don't use the AVX2 kernels (warped sampler, occlusion bitmask)" << std::endl;
+    }
+
+    // processes the command line options. Returns false if the program should not continue - nExitCode is then set to
+    // the exit code of the program: 0 if the overview of the options was asked for, 1 if an option is invalid
+    bool ParseCommandLine( int argc, char *argv[], int &nExitCode ) {
+        nExitCode = 0;
+        std::string sProgName = (argc > 0) ? argv[0] : "RayCaster";
+
+        // little lambda to fetch the next argument, if available
+        int i = 1;
+        auto next_arg = [&]( std::string &sArg ) {
+            if (i + 1 >= argc) {
+                std::cout << "ERROR: ParseCommandLine() --> missing value for option: " << argv[i] << std::endl;
+                return false;
+            }
+            sArg = argv[++i];
+            return true;
+        };
+
+        bool bOK = true;
+        for ( ; i < argc && bOK; i++) {
+            std::string sOption = argv[i], sArg;
+            if (sOption == "-h" || sOption == "--help") {
+                PrintUsage( sProgName );
+                nExitCode = 0;
+                return false;
+            } else if (sOption == "--frames") {
+                bOK = next_arg( sArg ); if (bOK) nMaxFrames = std::max( 0, atoi( sArg.c_str()));
+            } else if (sOption == "--dump-every") {
+                bOK = next_arg( sArg ); if (bOK) nDumpEvery = std::max( 1, atoi( sArg.c_str()));
+            } else if (sOption == "--dump-prefix") {
+                bOK = next_arg( sDumpPrefix );
+            } else if (sOption == "--dump") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    if      (sArg == "ppm" ) nDumpFormat = DUMP_PPM;
+                    else if (sArg == "rgba") nDumpFormat = DUMP_RGBA;
+                    else bOK = false;
+                }
+            } else if (sOption == "--texture") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    if      (sArg == "mono"  ) nTextureMode = MONO;
+                    else if (sArg == "sprite") nTextureMode = SPRITE;
+                    else if (sArg == "decal" ) nTextureMode = DECAL;
+                    else bOK = false;
+                }
+            } else if (sOption == "--visibility") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    if      (sArg == "sorted"  ) nVisibilityMode = VIS_SORTED;
+                    else if (sArg == "frontier") nVisibilityMode = VIS_FRONTIER;
+                    else if (sArg == "bsp"     ) nVisibilityMode = VIS_BSP;
+                    else if (sArg == "portals" ) nVisibilityMode = VIS_PORTALS;
+                    else bOK = false;
+                }
+            } else if (sOption == "--bsp-file") {
+                bOK = next_arg( sBspFile );
+            } else if (sOption == "--occlusion") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    if      (sArg == "list"   ) nOcclusionMode = OCC_LIST;
+                    else if (sArg == "spans"  ) nOcclusionMode = OCC_SPANS;
+                    else if (sArg == "bitmask") nOcclusionMode = OCC_BITMASK;
+                    else bOK = false;
+                }
+            } else if (sOption == "--sampler") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    if      (sArg == "columns") nSamplerMode = SMP_COLUMNS;
+                    else if (sArg == "warped" ) nSamplerMode = SMP_WARPED;
+                    else bOK = false;
+                }
+            } else if (sOption == "--threads") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    nRenderThreads = atoi( sArg.c_str());
+                    if (nRenderThreads == 0) nRenderThreads = std::max( 1, (int)std::thread::hardware_concurrency());
+                    bOK = (nRenderThreads > 0);
+                }
+            } else if (sOption == "--parallel") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    if      (sArg == "bands") nParallelMode = PAR_BANDS;
+                    else if (sArg == "jobs" ) nParallelMode = PAR_JOBS;
+                    else bOK = false;
+                }
+            } else if (sOption == "--exec") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    if      (sArg == "serial"   ) nFrameExecMode = EXE_SERIAL;
+                    else if (sArg == "pipelined") nFrameExecMode = EXE_PIPELINED;
+                    else bOK = false;
+                }
+            } else if (sOption == "--projection") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    if      (sArg == "angular") nProjectionMode = PRJ_ANGULAR;
+                    else if (sArg == "pinhole") nProjectionMode = PRJ_PINHOLE;
+                    else bOK = false;
+                }
+            } else if (sOption == "--order") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    if      (sArg == "sorted") nOrderMode = ORD_SORTED;
+                    else if (sArg == "lazy"  ) nOrderMode = ORD_LAZY;
+                    else bOK = false;
+                }
+            } else if (sOption == "--map") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    if      (sArg == "default" ) nMapLayout = MAP_DEFAULT;
+                    else if (sArg == "lowwalls") nMapLayout = MAP_LOW_WALLS;
+                    else bOK = false;
+                }
+            } else if (sOption == "--pos") {
+                std::string sX, sY, sA;
+                bOK = next_arg( sX ) && next_arg( sY ) && next_arg( sA );
+                if (bOK) {
+                    fPlayerX     = float( atof( sX.c_str()));
+                    fPlayerY     = float( atof( sY.c_str()));
+                    fPlayerA_deg = Mod360_deg( float( atof( sA.c_str())));
+                }
+            } else if (sOption == "--nomap") {
+                bMapMode = false;
+            } else if (sOption == "--noinfo") {
+                bInfoMode = false;
+            } else if (sOption == "--nowire") {
+                bWireFrameMode = false;
+            } else if (sOption == "--nomerge") {
+                bMergeFaces = false;
+            } else if (sOption == "--pvs") {
+                bUsePVS = true;
+            } else if (sOption == "--pvs-file") {
+                bOK = next_arg( sPvsFile );
+                bUsePVS = true;
+            } else if (sOption == "--bench") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    nBenchFramesPerRun = atoi( sArg.c_str());
+                    bBenchMode = bOK = (nBenchFramesPerRun > 0);
+                }
+            } else if (sOption == "--bench-csv") {
+                bOK = next_arg( sBenchFile );
+            } else if (sOption == "--bench-occlusion") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    nBenchOcclusion = atoi( sArg.c_str());
+                    bOK = (nBenchOcclusion > 0);
+                }
+            } else if (sOption == "--bench-warp") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    nBenchWarp = atoi( sArg.c_str());
+                    bOK = (nBenchWarp > 0);
+                }
+            } else if (sOption == "--bench-transform") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    nBenchTransform = atoi( sArg.c_str());
+                    bOK = (nBenchTransform > 0);
+                }
+            } else if (sOption == "--bench-pvs") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    nBenchPVS = atoi( sArg.c_str());
+                    bOK = (nBenchPVS > 0);
+                }
+            } else if (sOption == "--bench-portals") {
+                bOK = next_arg( sArg );
+                if (bOK) {
+                    nBenchPortals = atoi( sArg.c_str());
+                    bOK = (nBenchPortals > 0);
+                }
+            } else if (sOption == "--noavx2") {
+                bUseAVX2 = false;
+            } else {
+                bOK = false;
+            }
+            if (!bOK) {
+                std::cout << "ERROR: ParseCommandLine() --> invalid option or value: " << sOption << std::endl;
+                PrintUsage( sProgName );
+                nExitCode = 1;
+            }
+        }
+
+        if (HEADLESS_MODE && nTextureMode == DECAL) {
+            std::cout << "WARNING: ParseCommandLine() --> DECAL texture mode is not available in headless mode, using SPRITE mode" << std::endl;
+            nTextureMode = SPRITE;
+        }
+        if (bBenchMode) {
+            // decals are rendered by the GPU, so there's no point in benchmarking them headless
+            vBenchModes = { MONO, SPRITE };
+            if (!HEADLESS_MODE) vBenchModes.push_back( DECAL );
+        }
+        if (HEADLESS_MODE && nMaxFrames == 0 && !bBenchMode) {
+            std::cout << "WARNING: ParseCommandLine() --> headless mode needs a frame limit, rendering 1 frame" << std::endl;
+            nMaxFrames = 1;
+        }
+        return bOK;
+    }
+
     // Generic convenience functions
     // =============================
 
@@ -383,19 +1723,24 @@ public:
         return vecToLoc.mag();
     }
 
-    // returns the world coordinates of one of the columns of one of the faces of the denoted tile
+    // returns the grid corner of one of the columns of one of the faces of the denoted tile
     // * (nTileX, nTileY) - the coordinated of the tile in the map
     // * nFace            - denotes which face must be picked
     // * bLeft            - signals to return either the left column (if true) or the right column (if false)
-    olc::vf2d GetColumnCoordinates( int nTileX, int nTileY, int nFace, bool bLeft ) {
+    olc::vi2d GetColumnCorner( int nTileX, int nTileY, int nFace, bool bLeft ) {
         switch (nFace) {
-            case EAST : return bLeft ? olc::vf2d( nTileX + 1.0f, nTileY + 1.0f ) : olc::vf2d( nTileX + 1.0f, nTileY        );
-            case SOUTH: return bLeft ? olc::vf2d( nTileX       , nTileY + 1.0f ) : olc::vf2d( nTileX + 1.0f, nTileY + 1.0f );
-            case WEST : return bLeft ? olc::vf2d( nTileX       , nTileY        ) : olc::vf2d( nTileX       , nTileY + 1.0f );
-            case NORTH: return bLeft ? olc::vf2d( nTileX + 1.0f, nTileY        ) : olc::vf2d( nTileX       , nTileY        );
+            case EAST : return bLeft ? olc::vi2d( nTileX + 1, nTileY + 1 ) : olc::vi2d( nTileX + 1, nTileY     );
+            case SOUTH: return bLeft ? olc::vi2d( nTileX    , nTileY + 1 ) : olc::vi2d( nTileX + 1, nTileY + 1 );
+            case WEST : return bLeft ? olc::vi2d( nTileX    , nTileY     ) : olc::vi2d( nTileX    , nTileY + 1 );
+            case NORTH: return bLeft ? olc::vi2d( nTileX + 1, nTileY     ) : olc::vi2d( nTileX    , nTileY     );
         }
-        std::cout << "WARNING: GetColumnCoordinates() --> called with unknown nFace value: " << nFace << std::endl;
-        return olc::vf2d( -1.0f, -1.0f );
+        std::cout << "WARNING: GetColumnCorner() --> called with unknown nFace value: " << nFace << std::endl;
+        return olc::vi2d( -1, -1 );
+    }
+
+    // returns the world coordinates of one of the columns of one of the faces of the denoted tile, see GetColumnCorner()
+    olc::vf2d GetColumnCoordinates( int nTileX, int nTileY, int nFace, bool bLeft ) {
+        return olc::vf2d( GetColumnCorner( nTileX, nTileY, nFace, bLeft ));
     }
 
     // returns true if the tile at (nTileX, nTileY) is within the field of view of the player
@@ -423,25 +1768,134 @@ public:
         return bResult;
     }
 
+    // works out the triangle that bounds the FoV cone of the player up to fRenderMaxDist. The first point is the
+    // player location, the other two are the far corners of the cone. The far side of the triangle is at distance
+    // fRenderMaxDist from the player, so the triangle encloses the circle sector with that radius.
+    void GetFoVTriangle( olc::vf2d tri[3] ) {
+        float fHalfFoV_rad = Deg2Rad( fPlayerFoV_deg / 2 );
+        float fReach       = fRenderMaxDist / cosf( fHalfFoV_rad );
+        tri[0] = { fPlayerX, fPlayerY };
+        tri[1] = { fPlayerX + cosf( fPlayerA_rad - fHalfFoV_rad ) * fReach, fPlayerY + sinf( fPlayerA_rad - fHalfFoV_rad ) * fReach };
+        tri[2] = { fPlayerX + cosf( fPlayerA_rad + fHalfFoV_rad ) * fReach, fPlayerY + sinf( fPlayerA_rad + fHalfFoV_rad ) * fReach };
+    }
+
+    // works out the horizontal extent [fMinX, fMaxX] of the part of triangle tri that lies in the horizontal slab
+    // between fY0 and fY1. Returns false if the triangle doesn't overlap the slab.
+    // Since the triangle is convex, the extremes are found among its vertices inside the slab and the points where its
+    // edges cross the slab boundaries
+    bool GetSlabExtent( olc::vf2d tri[3], float fY0, float fY1, float &fMinX, float &fMaxX ) {
+        fMinX = +FLT_MAX;
+        fMaxX = -FLT_MAX;
+        for (int i = 0; i < 3; i++) {
+            olc::vf2d a = tri[i];
+            olc::vf2d b = tri[ (i + 1) % 3 ];
+            if (InBetween( a.y, fY0, fY1 )) {
+                fMinX = std::min( fMinX, a.x );
+                fMaxX = std::max( fMaxX, a.x );
+            }
+            float vBoundaries[2] = { fY0, fY1 };
+            for (int j = 0; j < 2; j++) {
+                float fYb = vBoundaries[j];
+                if ((a.y - fYb) * (b.y - fYb) < 0.0f) {
+                    float fCrossX = a.x + (b.x - a.x) * (fYb - a.y) / (b.y - a.y);
+                    fMinX = std::min( fMinX, fCrossX );
+                    fMaxX = std::max( fMaxX, fCrossX );
+                }
+            }
+        }
+        return fMinX <= fMaxX;
+    }
+
     // selects only the tiles that are in the FoV of the player, doesn't init the faces of these tiles
+    // Instead of testing every cell of the map with TileInFoV(), only the cells that overlap the FoV triangle (see
+    // GetFoVTriangle()) are visited, row by row. So the cost depends on what's in view, not on the size of the map.
+    // NOTE: tiles that are completely beyond fRenderMaxDist are not selected
+    // If the PVS is used, only the tiles that have faces in the PVS of the player's cell are visited
     void GetVisibleTiles( std::vector<TileInfo> &vVisibleTiles ) {
-        for (int y = 0; y < nMapY; y++) {
-            for (int x = 0; x < nMapX; x++) {
-                if (sMap[ y * nMapX + x ] != '.' && TileInFoV( x, y )) {
+        olc::vf2d tri[3];
+        GetFoVTriangle( tri );
+
+        if (PlayerCellPVS()) {
+            // the tiles are in map order, so the part of the row that overlaps the triangle is only worked out per row
+            int nRow = -1, nStrtX = 0, nStopX = -1;
+            for (int nTile : vPvsTiles) {
+                int x = nTile % nMapX, y = nTile / nMapX;
+                if (y != nRow) {
+                    float fMinX, fMaxX;
+                    nRow = y;
+                    nStrtX = 0;
+                    nStopX = -1;
+                    if (GetSlabExtent( tri, float( y ), float( y + 1 ), fMinX, fMaxX )) {
+                        nStrtX = int( floor( fMinX ));
+                        nStopX = int( floor( fMaxX ));
+                    }
+                }
+                if (InBetween( x, nStrtX, nStopX )) {
                     TileInfo newTile;
                     newTile.TileID = olc::vi2d( x, y );
                     vVisibleTiles.push_back( newTile );
                 }
             }
+            return;
         }
-    }
 
-    // checks on ...
-    //   * face direction irt player angle,
-    //   * face direction irt tile and player location
-    //   * occlusion by other tiles
-    // ... to determine and return visibility of face
-    bool FaceVisible( int nTileX, int nTileY, int nFace ) {
+        float fMinY = std::min( { tri[0].y, tri[1].y, tri[2].y } );
+        float fMaxY = std::max( { tri[0].y, tri[1].y, tri[2].y } );
+        int nStrtY = std::max(         0, int( floor( fMinY )));
+        int nStopY = std::min( nMapY - 1, int( floor( fMaxY )));
+
+        for (int y = nStrtY; y <= nStopY; y++) {
+            // get the part of this row of cells that overlaps the triangle
+            float fMinX, fMaxX;
+            if (!GetSlabExtent( tri, float( y ), float( y + 1 ), fMinX, fMaxX )) continue;
+            int nStrtX = std::max(         0, int( floor( fMinX )));
+            int nStopX = std::min( nMapX - 1, int( floor( fMaxX )));
+
+            for (int x = nStrtX; x <= nStopX; x++) {
+                if (sMap[ y * nMapX + x ] != '.') {
+                    TileInfo newTile;
+                    newTile.TileID = olc::vi2d( x, y );
+                    vVisibleTiles.push_back( newTile );
+                }
+            }
+        }
+    }
+
+    // returns true if GetVisibleTiles() selects the tile at (nTileX, nTileY), i.e. if it's within the part of its row
+    // of cells that overlaps FoV triangle tri
+    bool TileInFoVTriangle( olc::vf2d tri[3], int nTileX, int nTileY ) {
+        float fMinX, fMaxX;
+        return GetSlabExtent( tri, float( nTileY ), float( nTileY + 1 ), fMinX, fMaxX ) &&
+               int( floor( fMinX )) <= nTileX && nTileX <= int( floor( fMaxX ));
+    }
+
+    // returns the height of the cell at (nTileX, nTileY): 0.0f for an empty cell, 1.0f for a full height wall and
+    // 0.1f to 0.9f for the digits '1' to '9'
+    float GetCellHeight( int nTileX, int nTileY ) {
+        char c = sMap[ nTileY * nMapX + nTileX ];
+        if (c == '.') return 0.0f;
+        if (c >= '1' && c <= '9') return float( c - '0' ) / 10.0f;
+        return 1.0f;
+    }
+
+    // returns true if location (fX, fY) is at least fDist away from the map boundary and from all full height walls,
+    // in all directions. The square around the location is tested, which contains the circle with radius fDist
+    bool KeepsDistanceFromWalls( float fX, float fY, float fDist ) {
+        int nMinX = int( floor( fX - fDist )), nMaxX = int( floor( fX + fDist ));
+        int nMinY = int( floor( fY - fDist )), nMaxY = int( floor( fY + fDist ));
+        if (nMinX < 0 || nMinY < 0 || nMaxX >= nMapX || nMaxY >= nMapY) return false;
+        for (int y = nMinY; y <= nMaxY; y++) {
+            for (int x = nMinX; x <= nMaxX; x++) {
+                if (sMap[ y * nMapX + x ] == '#') return false;
+            }
+        }
+        return true;
+    }
+
+    // returns a bit mask with a bit (1 << face) set for each of the faces EAST, SOUTH, WEST and NORTH that can be seen
+    // with the current looking direction of the player: a face can only be seen if at least one of the FoV boundaries
+    // points against the direction of the face
+    int GetFoVSideMask() {
         // get boundary angles for FoV - in radians for calls to AngleInSector()
         float fFOVleft_rad = Deg2Rad( Mod360_deg( fPlayerA_deg - fPlayerFoV_deg / 2 ));
         float fFOVrght_rad = Deg2Rad( Mod360_deg( fPlayerA_deg + fPlayerFoV_deg / 2 ));
@@ -450,6 +1904,21 @@ public:
         bool bUp = AngleInSector( fFOVleft_rad, 1.0f * PI, 2.0f * PI ) || AngleInSector( fFOVrght_rad, 1.0f * PI, 2.0f * PI );
         bool bDn = AngleInSector( fFOVleft_rad, 0.0f * PI, 1.0f * PI ) || AngleInSector( fFOVrght_rad, 0.0f * PI, 1.0f * PI );
         bool bLt = AngleInSector( fFOVleft_rad, 0.5f * PI, 1.5f * PI ) || AngleInSector( fFOVrght_rad, 0.5f * PI, 1.5f * PI );
+        return (bLt ? 1 << EAST : 0) | (bUp ? 1 << SOUTH : 0) | (bRt ? 1 << WEST : 0) | (bDn ? 1 << NORTH : 0);
+    }
+
+    // checks on ...
+    //   * face direction irt player angle,
+    //   * face direction irt tile and player location
+    //   * occlusion by other tiles
+    // ... to determine and return visibility of face
+    bool FaceVisible( int nTileX, int nTileY, int nFace ) {
+        // evaluate direction of player
+        int nSideMask = GetFoVSideMask();
+        bool bLt = nSideMask & (1 << EAST );
+        bool bRt = nSideMask & (1 << WEST );
+        bool bUp = nSideMask & (1 << SOUTH);
+        bool bDn = nSideMask & (1 << NORTH);
         // determine face visibility
         switch (nFace) {
             // faces are not visible
@@ -499,74 +1968,901 @@ public:
         return int( fFoVPerc * float( ScreenWidth() ));
     }
 
+    // works out the info for the column at world location coords: distance, angle from player to column, and
+    // projection on screen column
+    void BuildColInfo( olc::vf2d coords, ColInfo &col ) {
+        if (nProjectionMode == PRJ_PINHOLE) {
+            BuildColInfo_pinhole( coords, col );
+            return;
+        }
+        col.fAngleFromPlayer    = GetAngle_PlayerToLocation( coords );
+        // get raw (uncorreced) distance for distance comparison
+        col.fDistFromPlayer_raw = GetDistance_PlayerToLocation( coords );
+        // correct distance for fish eye by applying cos() on the angle view angle from the player
+        col.fDistFromPlayer     = col.fDistFromPlayer_raw * abs( cosf( fPlayerA_rad - col.fAngleFromPlayer ));
+        // get projected screen column for vertical edge of face
+        col.nScreenX            = GetColumnProjection( col.fAngleFromPlayer );
+    }
+
+    // pinhole version of BuildColInfo(): the location is transformed into camera space with the basis of the player
+    // (fPlayerCos, fPlayerSin), and projected onto the screen with a single divide. The camera z is the perpendicular
+    // distance, so there's no fish eye correction, and no trig at all. Unlike the angular projection, straight walls
+    // are projected onto straight lines, and the texture u that RenderWallQuad_columns() works out is exact.
+    // NOTE: locations at or behind the player have no projection - their depth is clamped to PINHOLE_MIN_Z. The faces
+    //       are clipped against the near plane (see ClipFaceToNearPlane()), so such locations aren't rendered
+    // NOTE: the angle from the player isn't needed for this projection, so it's left 0.0f
+    void BuildColInfo_pinhole( olc::vf2d coords, ColInfo &col ) {
+        float fDX = coords.x - fPlayerX;
+        float fDY = coords.y - fPlayerY;
+        float fCamX = fDY * fPlayerCos - fDX * fPlayerSin;    // to the right of the looking direction
+        float fCamZ = fDX * fPlayerCos + fDY * fPlayerSin;    // along the looking direction
+        col.fAngleFromPlayer    = 0.0f;
+        col.fDistFromPlayer_raw = sqrtf( fDX * fDX + fDY * fDY );
+        col.fDistFromPlayer     = std::max( fCamZ, PINHOLE_MIN_Z );
+        col.nScreenX            = int( ScreenWidth() * 0.5f + fCamX * fDistToProjPlane / col.fDistFromPlayer );
+    }
+
+    // returns the offset from a tile to the next one along face nFace, going from its left to its right column
+    olc::vi2d GetFaceTileStep( int nFace ) {
+        switch (nFace) {
+            case EAST : return olc::vi2d(  0, -1 );
+            case SOUTH: return olc::vi2d(  1,  0 );
+            case WEST : return olc::vi2d(  0,  1 );
+            case NORTH: return olc::vi2d( -1,  0 );
+        }
+        std::cout << "WARNING: GetFaceTileStep() --> called with unknown nFace value: " << nFace << std::endl;
+        return olc::vi2d( 0, 0 );
+    }
+
+    // returns the grid corner of the left (bLeft) or right column of the face nFace that starts at tile (nTileX, nTileY)
+    // and spans nTiles tile faces
+    olc::vi2d GetFaceCorner( int nTileX, int nTileY, int nFace, int nTiles, bool bLeft ) {
+        if (bLeft) return GetColumnCorner( nTileX, nTileY, nFace, true );
+        olc::vi2d lastTile = olc::vi2d( nTileX, nTileY ) + GetFaceTileStep( nFace ) * (nTiles - 1);
+        return GetColumnCorner( lastTile.x, lastTile.y, nFace, false );
+    }
+
+    // returns the depth of world location p in camera space: its distance from the player along the looking direction
+    float GetCameraDepth( olc::vf2d p ) {
+        return (p.x - fPlayerX) * fPlayerCos + (p.y - fPlayerY) * fPlayerSin;
+    }
+
+    // clips curFace, that runs from world location leftPos to rghtPos, against the near plane at camera depth
+    // NEAR_PLANE_Z. The column that is behind the near plane is replaced by the column where the face crosses it, and
+    // the texture u of that column is adapted. Returns false if the face is completely behind the near plane
+    // NOTE: the parts of a face at distance d from the player that are in the FoV are at a depth of at least
+    //       d * cos( FoV / 2 ). If the near plane were deeper than that, it would cut away a part of the face that can be
+    //       seen, and expose what's behind it. So a face that is closer than NEAR_PLANE_Z / NEAR_PLANE_FACTOR is clipped
+    //       at NEAR_PLANE_FACTOR * d instead (but not closer than PINHOLE_MIN_Z, the min. depth of the projection)
+    // NOTE: both projections misbehave for locations at or behind the player: the angular one wraps around (and may flip
+    //       the columns of a face), the pinhole one blows up. Clipping keeps the columns of all faces that are rendered
+    //       at a sensible depth, so their screen spans are bounded
+    bool ClipFaceToNearPlane( FaceInfo &curFace, olc::vf2d leftPos, olc::vf2d rghtPos ) {
+        float fLeftZ = GetCameraDepth( leftPos );
+        float fRghtZ = GetCameraDepth( rghtPos );
+        if (fLeftZ >= NEAR_PLANE_Z && fRghtZ >= NEAR_PLANE_Z) return true;
+
+        // depth of the near plane for this face, depending on the distance of the player to (the nearest point of) the face
+        olc::vf2d faceVec   = rghtPos - leftPos;
+        olc::vf2d playerVec = olc::vf2d( fPlayerX, fPlayerY ) - leftPos;
+        float t = std::min( 1.0f, std::max( 0.0f, (playerVec.x * faceVec.x + playerVec.y * faceVec.y) / (faceVec.x * faceVec.x + faceVec.y * faceVec.y)));
+        float fFaceDist = (playerVec - faceVec * t).mag();
+        float fNearZ = std::max( PINHOLE_MIN_Z, std::min( NEAR_PLANE_Z, NEAR_PLANE_FACTOR * fFaceDist ));
+        if (fLeftZ >= fNearZ && fRghtZ >= fNearZ) return true;
+        if (fLeftZ <  fNearZ && fRghtZ <  fNearZ) return false;
+
+        // the fraction of the face where it crosses the near plane
+        t = (fNearZ - fLeftZ) / (fRghtZ - fLeftZ);
+        olc::vf2d crossPos = leftPos + (rghtPos - leftPos) * t;
+        float fCrossU = curFace.fLeftU + (curFace.fRghtU - curFace.fLeftU) * t;
+        if (fLeftZ < fNearZ) {
+            BuildColInfo( crossPos, curFace.leftCol );
+            curFace.fLeftU = fCrossU;
+        } else {
+            BuildColInfo( crossPos, curFace.rghtCol );
+            curFace.fRghtU = fCrossU;
+        }
+        return true;
+    }
+
+    // works out the face info for face nFace of the tile at (nTileX, nTileY): for both columns of the face the
+    // distance, angle from player to column, and projection on screen column is determined
+    // The face is clipped against the near plane, if it's completely behind it bVisible is set to false
+    // If nTiles > 1 the face is a wall segment of that many tile faces, starting with this one (see Merged wall segments)
+    void BuildFaceInfo( int nTileX, int nTileY, int nFace, FaceInfo &curFace, int nTiles = 1 ) {
+        curFace.TileID   = olc::vi2d( nTileX, nTileY );
+        curFace.nSide    = nFace;
+        curFace.bVisible = true;
+        curFace.fHeight  = GetCellHeight( nTileX, nTileY );
+        curFace.nTiles   = nTiles;
+        curFace.fLeftU   = 0.0f;
+        curFace.fRghtU   = float( nTiles );
+
+        // get info for left and right column - the right one is on the last tile of the segment
+        ColInfo &left = curFace.leftCol;
+        ColInfo &rght = curFace.rghtCol;
+        olc::vi2d leftCorner = GetFaceCorner( nTileX, nTileY, nFace, nTiles, true  );
+        olc::vi2d rghtCorner = GetFaceCorner( nTileX, nTileY, nFace, nTiles, false );
+        left = GetCornerColInfo( leftCorner );
+        rght = GetCornerColInfo( rghtCorner );
+        // a face that is completely behind the near plane isn't visible after all
+        curFace.bVisible = ClipFaceToNearPlane( curFace, olc::vf2d( leftCorner ), olc::vf2d( rghtCorner ));
+        if (!curFace.bVisible) return;
+
+        // check on the resulted projections
+        if (left.nScreenX > rght.nScreenX) {
+            std::cout << "WARNING: BuildFaceInfo() --> projections are flipped (left = " << left.nScreenX << ", right = " << rght.nScreenX << ") for face: " << std::endl;
+            PrintFace( curFace );
+            std::cout << std::endl;
+        }
+    }
+
     // precondition - vVisibleTiles is filled with the tiles that are within the FoV of the player
     // processes each visible tile in vVisibleTiles to determine which of it's faces are visible.
-    // the visible faces are processed both in vVisibleTiles, and put into vVisibleFaces
-    // In the processing, the distance, angle from player to column, and projection on screen column is
-    // determined for both columns of each visible face
+    // the visible faces are put into vVisibleFaces, see BuildFaceInfo() for the info that's determined per face
+    // Only the exposed faces of the tile (see BuildFaceTable()) are considered, so the same faces are found as with
+    // FaceVisible(), but the map doesn't need to be inspected and the FoV direction test is done once per call
+    // In pinhole mode the corners of the visible faces are transformed in one batch before the face infos are built
+    // If the PVS is used, the faces that are not in the PVS of the player's cell are skipped
     void GetVisibleFaces( std::vector<TileInfo> &vVisibleTiles, std::vector<FaceInfo> &vVisibleFaces ) {
 
+        const FaceTable &ft = faceTable;
+        int nSideMask = GetFoVSideMask();
+        bool bPVS = PlayerCellPVS();
+        vFacesMarked.clear();
         for (int i = 0; i < (int)vVisibleTiles.size(); i++) {
             TileInfo &curTile = vVisibleTiles[i];
-            for (int face = EAST; face <= NORTH; face++) {
-
-                if (FaceVisible( curTile.TileID.x, curTile.TileID.y, face )) {
-                    // face is visible - add it to faces list
-                    FaceInfo curFace;
-                    curFace.TileID   = curTile.TileID;
-                    curFace.nSide    = face;
-                    curFace.bVisible = true;
-
-                    // work out info for left column
-                    ColInfo &left            = curFace.leftCol;
-                    olc::vf2d leftCoords     = GetColumnCoordinates( curTile.TileID.x, curTile.TileID.y, face, true );
-                    left.fAngleFromPlayer    = GetAngle_PlayerToLocation( leftCoords );
-                    // get raw (uncorreced) distance for distance comparison
-                    left.fDistFromPlayer_raw = GetDistance_PlayerToLocation( leftCoords );
-                    // correct distance for fish eye by applying cos() on the angle view angle from the player
-                    left.fDistFromPlayer     = left.fDistFromPlayer_raw * abs( cosf( fPlayerA_rad - left.fAngleFromPlayer ));
-                    // get projected screen column for left vertical edge of face
-                    left.nScreenX            = GetColumnProjection( left.fAngleFromPlayer );
-
-                    // work out info for right column
-                    ColInfo &rght            = curFace.rghtCol;
-                    olc::vf2d rghtCoords     = GetColumnCoordinates( curTile.TileID.x, curTile.TileID.y, face, false );
-                    rght.fAngleFromPlayer    = GetAngle_PlayerToLocation( rghtCoords );
-                    // get raw (uncorreced) distance for distance comparison
-                    rght.fDistFromPlayer_raw = GetDistance_PlayerToLocation( rghtCoords );
-                    // correct distance for fish eye by applying cos() on the angle view angle from the player
-                    rght.fDistFromPlayer     = rght.fDistFromPlayer_raw * abs( cosf( fPlayerA_rad - rght.fAngleFromPlayer ));
-                    // get projected screen column for right vertical edge of face
-                    rght.nScreenX            = GetColumnProjection( rght.fAngleFromPlayer );
-
-                    // check on the resulted projections
-                    if (left.nScreenX > rght.nScreenX) {
-                        std::cout << "WARNING: GetVisibleFaces() --> projections are flipped (left = " << left.nScreenX << ", right = " << rght.nScreenX << ") for face: " << std::endl;
-                        PrintFace( curFace );
-                        std::cout << std::endl;
+            int nTile = curTile.TileID.y * nMapX + curTile.TileID.x;
+            for (int f = ft.vTileFirst[nTile]; f < ft.vTileFirst[nTile + 1]; f++) {
+
+                if (FaceTableVisible( f, nSideMask ) && (!bPVS || vPvsMask[f])) {
+                    if (bMergeFaces) {
+                        // face is visible - widen the visible run of its wall segment
+                        MarkSegmentFace( f );
+                    } else {
+                        // face is visible - keep it for the faces list
+                        vFacesMarked.push_back( f );
                     }
-
-                    // fill faces list with same info
-                    vVisibleFaces.push_back( curFace );
                 } // if face is not visible, just ignore it
             }
         }
 
-        // sort assembled faces list - from smallest to largest distance
-        auto faces_sort_small2large = [=]( FaceInfo &a, FaceInfo &b ) {
+        if (nProjectionMode == PRJ_PINHOLE) {
+            for (int f : vFacesMarked) {
+                QueueCorner( GetFaceCorner( ft.vTileX[f], ft.vTileY[f], ft.vSide[f], 1, true  ));
+                QueueCorner( GetFaceCorner( ft.vTileX[f], ft.vTileY[f], ft.vSide[f], 1, false ));
+            }
+            for (int nSeg : vSegsMarked) {
+                int f = ft.vSegFirst[nSeg];
+                olc::vi2d tile = olc::vi2d( ft.vTileX[f], ft.vTileY[f] ) + GetFaceTileStep( ft.vSide[f] ) * vSegRunLeft[nSeg];
+                int nTiles = vSegRunRght[nSeg] - vSegRunLeft[nSeg] + 1;
+                QueueCorner( GetFaceCorner( tile.x, tile.y, ft.vSide[f], nTiles, true  ));
+                QueueCorner( GetFaceCorner( tile.x, tile.y, ft.vSide[f], nTiles, false ));
+            }
+            TransformCornerBatch();
+        }
+
+        for (int f : vFacesMarked) {
+            FaceInfo curFace;
+            BuildFaceInfo( ft.vTileX[f], ft.vTileY[f], ft.vSide[f], curFace );
+            if (curFace.bVisible) vVisibleFaces.push_back( curFace );
+        }
+        if (bMergeFaces) GetVisibleSegments( vVisibleFaces );
+    }
+
+    // per frame work space for SortVisibleFaces()
+    std::vector<uint64_t> vSortKeys, vSortTemp;
+    std::vector<FaceInfo> vSortedFaces;
+
+    // returns the sort key of curFace: the mean distance of its two columns. The distances are never negative, and the
+    // bit patterns of non negative floats are in the same order as their values, so the key can be radix sorted
+    uint32_t GetFaceSortKey( FaceInfo &curFace ) {
+        float fMeanDistance = (curFace.leftCol.fDistFromPlayer_raw + curFace.rghtCol.fDistFromPlayer_raw) / 2.0f;
+        // I wonder - would taking the smallest of the columns' distances yield better results?
+        // Well, I tried this and it doesn't seem to make any difference...
+        // NOTE: I didn't retry this after introducing the raw distances
+        uint32_t nKey;
+        memcpy( &nKey, &fMeanDistance, sizeof( nKey ));
+        return nKey;
+    }
+
+    // sorts the faces list - from smallest to largest distance
+    // Every face is keyed once (see GetFaceSortKey()), and the keys are sorted together with the index of their face.
+    // For more than SORT_RADIX_MIN faces an LSD radix sort is used, that takes SORT_RADIX_BITS bits of the key per pass
+    // and skips the passes in which all keys have the same digit. Then the faces are gathered in sorted order. Faces
+    // with equal keys keep their order in both cases.
+    // NOTE: this is linear in the nr of faces only if the faces are not merged. Merged faces are reordered afterwards
+    //       by OrderSegmentsFrontToBack(), which uses the sorted order as its priority, but adds O((n + p) log n) work
+    //       for the p pairs of faces that overlap on screen. With many faces that pass takes most of the time
+    void SortVisibleFaces( std::vector<FaceInfo> &vVisibleFaces ) {
+
+        // the key in the upper half, the index of the face in the lower half
+        int n = (int)vVisibleFaces.size();
+        vSortKeys.resize( n );
+        for (int i = 0; i < n; i++) {
+            vSortKeys[i] = (uint64_t( GetFaceSortKey( vVisibleFaces[i] )) << 32) | uint64_t( i );
+        }
+
+        if (n < SORT_RADIX_MIN) {
+            std::sort( vSortKeys.begin(), vSortKeys.end());
+        } else {
+            const int nBuckets = 1 << SORT_RADIX_BITS;
+            int vCount[nBuckets];
+            vSortTemp.resize( n );
+            for (int nShift = 32; nShift < 64; nShift += SORT_RADIX_BITS) {
+                std::fill( vCount, vCount + nBuckets, 0 );
+                for (int i = 0; i < n; i++) {
+                    vCount[(vSortKeys[i] >> nShift) & (nBuckets - 1)] += 1;
+                }
+                if (vCount[(vSortKeys[0] >> nShift) & (nBuckets - 1)] == n) continue;
+                // turn the counts into the start position per digit, then scatter the keys
+                for (int b = 0, nPos = 0; b < nBuckets; b++) {
+                    int nCount = vCount[b];
+                    vCount[b] = nPos;
+                    nPos += nCount;
+                }
+                for (int i = 0; i < n; i++) {
+                    vSortTemp[vCount[(vSortKeys[i] >> nShift) & (nBuckets - 1)]++] = vSortKeys[i];
+                }
+                vSortKeys.swap( vSortTemp );
+            }
+        }
+
+        vSortedFaces.resize( n );
+        for (int i = 0; i < n; i++) {
+            vSortedFaces[i] = vVisibleFaces[uint32_t( vSortKeys[i] )];
+        }
+        vVisibleFaces.swap( vSortedFaces );
+
+        // a wall segment can be long, so its mean distance doesn't tell whether it's in front of another face
+        if (bMergeFaces) OrderSegmentsFrontToBack( vVisibleFaces );
+    }
+
+    // Face table
+    // ==========
+
+    // Which faces border empty space (or a cell of partial height) only depends on the map, so these exposed faces
+    // are collected once, when the map is set up. The table is a structure of arrays, ordered by tile, and per map
+    // cell the index of its first face is kept (the faces of cell i are [vTileFirst[i], vTileFirst[i + 1]) ).
+    // Per frame only the FoV direction test and the back face test are left, see FaceTableVisible()
+    typedef struct sFaceTable {
+        std::vector<int>     vTileFirst;          // per map cell, plus a sentinel: index of the first face of the cell
+        std::vector<int16_t> vTileX, vTileY;      // per face: coords of the tile it belongs to
+        std::vector<uint8_t> vSide;               //           one of EAST, SOUTH, WEST, NORTH
+        std::vector<float>   vLeftX, vLeftY;      //           world coordinates of the left resp. right column
+        std::vector<float>   vRghtX, vRghtY;
+        std::vector<int>     vSegment;            //           the wall segment it's part of, and its position in it
+        std::vector<int>     vSegmentPos;
+        std::vector<int>     vSegFirst;           // per wall segment: index of its leftmost face, and nr of faces
+        std::vector<int>     vSegLength;
+    } FaceTable;
+
+    FaceTable faceTable;
+
+    // collects the exposed faces of the map in faceTable - must be called after every change of the map
+    void BuildFaceTable() {
+        FaceTable &ft = faceTable;
+        ft = FaceTable();
+        for (int y = 0; y < nMapY; y++) {
+            for (int x = 0; x < nMapX; x++) {
+                ft.vTileFirst.push_back( (int)ft.vSide.size() );
+                if (sMap[ y * nMapX + x ] == '.') continue;
+
+                for (int f = EAST; f <= NORTH; f++) {
+                    // the face is exposed if the neighbour cell in its direction is within the map, and not a full wall
+                    int nx = x + (f == EAST  ? 1 : (f == WEST  ? -1 : 0));
+                    int ny = y + (f == SOUTH ? 1 : (f == NORTH ? -1 : 0));
+                    if (!InBetween( nx, 0, nMapX - 1 ) || !InBetween( ny, 0, nMapY - 1 ) || sMap[ ny * nMapX + nx ] == '#') continue;
+
+                    olc::vf2d leftCoords = GetColumnCoordinates( x, y, f, true  );
+                    olc::vf2d rghtCoords = GetColumnCoordinates( x, y, f, false );
+                    ft.vTileX.push_back( int16_t( x ));
+                    ft.vTileY.push_back( int16_t( y ));
+                    ft.vSide.push_back( uint8_t( f ));
+                    ft.vLeftX.push_back( leftCoords.x );
+                    ft.vLeftY.push_back( leftCoords.y );
+                    ft.vRghtX.push_back( rghtCoords.x );
+                    ft.vRghtY.push_back( rghtCoords.y );
+                }
+            }
+        }
+        ft.vTileFirst.push_back( (int)ft.vSide.size() );
+        BuildWallSegments();
+        InitBspTree();
+        BuildSectors();
+        // the PVS are only computed if they're used
+        pvsData = PvsData();
+        if (bUsePVS) InitPVS();
+        ResetCornerCache();
+    }
+
+    // returns true if face f of faceTable passes the FoV direction test (nSideMask, see GetFoVSideMask()) and the back
+    // face test. A face is facing the player if the cross product of (right column - left column) and (player - left
+    // column) is positive. For axis aligned faces this is exact, and equal to the test in FaceVisible()
+    bool FaceTableVisible( int f, int nSideMask ) {
+        const FaceTable &ft = faceTable;
+        if (!(nSideMask & (1 << ft.vSide[f]))) return false;
+        float fCross = (ft.vRghtX[f] - ft.vLeftX[f]) * (fPlayerY - ft.vLeftY[f]) -
+                       (ft.vRghtY[f] - ft.vLeftY[f]) * (fPlayerX - ft.vLeftX[f]);
+        return fCross > 0.0f;
+    }
+
+    // Merged wall segments
+    // ====================
+
+    // A straight wall consists of a row of exposed faces of the same side, that lie on one line. Instead of handling
+    // each of these tile faces separately, they are merged into a wall segment when the map is set up. Per frame the
+    // visible faces of a segment (they always form a single run) are handled as one face: it is projected, sorted, and
+    // processed by the occlusion structure once. The FaceInfo of a segment covers nTiles tile faces, starting at tile
+    // TileID. Only faces of the same height are merged.
+    // NOTE: the angular column projection is linear in the angle from the player, so a wall is not a straight line on
+    //       screen. Therefore the visible spans of a segment are still rendered per tile face (see ForEachFacePiece()),
+    //       which also gives every tile face its own texture u range [0, 1]
+    // NOTE: ordering on the mean distance is a rough approximation that is good enough for faces of a single tile, but
+    //       not for long segments, see OrderSegmentsFrontToBack()
+
+    // groups the faces of faceTable into wall segments - called by BuildFaceTable()
+    void BuildWallSegments() {
+        FaceTable &ft = faceTable;
+        int nFaces = (int)ft.vSide.size();
+        // look up table from (tile, side) to face index
+        std::vector<int> vFaceAt( nMapX * nMapY * 4, -1 );
+        for (int f = 0; f < nFaces; f++) {
+            vFaceAt[ (ft.vTileY[f] * nMapX + ft.vTileX[f]) * 4 + ft.vSide[f] ] = f;
+        }
+        // returns the face at side nSide of the tile at tile if it's exposed and of height fHeight, -1 otherwise
+        auto face_at = [&]( olc::vi2d tile, int nSide, float fHeight ) {
+            if (!InBetween( tile.x, 0, nMapX - 1 ) || !InBetween( tile.y, 0, nMapY - 1 )) return -1;
+            int f = vFaceAt[ (tile.y * nMapX + tile.x) * 4 + nSide ];
+            return (f >= 0 && GetCellHeight( tile.x, tile.y ) == fHeight) ? f : -1;
+        };
+
+        ft.vSegment.assign( nFaces, -1 );
+        ft.vSegmentPos.assign( nFaces, 0 );
+        for (int f = 0; f < nFaces; f++) {
+            // a segment starts at a face that has no face to merge with at its left side
+            olc::vi2d tile( ft.vTileX[f], ft.vTileY[f] );
+            olc::vi2d step = GetFaceTileStep( ft.vSide[f] );
+            float fHeight = GetCellHeight( tile.x, tile.y );
+            if (face_at( tile - step, ft.vSide[f], fHeight ) >= 0) continue;
+
+            int nSegment = (int)ft.vSegFirst.size();
+            int nLength = 0;
+            for (int g = f; g >= 0; g = face_at( tile, ft.vSide[f], fHeight )) {
+                ft.vSegment[g]    = nSegment;
+                ft.vSegmentPos[g] = nLength++;
+                tile = tile + step;
+            }
+            ft.vSegFirst.push_back( f );
+            ft.vSegLength.push_back( nLength );
+        }
+        vSegRunLeft.assign( ft.vSegFirst.size(), -1 );
+        vSegRunRght.assign( ft.vSegFirst.size(), -1 );
+    }
+
+    // per wall segment: first and last position of the faces that are visible in this frame (-1 if none)
+    std::vector<int> vSegRunLeft, vSegRunRght;
+    std::vector<int> vSegsMarked;            // the segments that have visible faces in this frame
+    std::vector<int> vFacesMarked;           // the visible faces in this frame, if they aren't merged
+
+    // registers face f of faceTable as visible in this frame
+    void MarkSegmentFace( int f ) {
+        int nSeg = faceTable.vSegment[f];
+        int nPos = faceTable.vSegmentPos[f];
+        if (vSegRunLeft[nSeg] < 0) {
+            vSegsMarked.push_back( nSeg );
+            vSegRunLeft[nSeg] = nPos;
+            vSegRunRght[nSeg] = nPos;
+        } else {
+            vSegRunLeft[nSeg] = std::min( vSegRunLeft[nSeg], nPos );
+            vSegRunRght[nSeg] = std::max( vSegRunRght[nSeg], nPos );
+        }
+    }
+
+    // appends a face to vVisibleFaces for the visible run of faces of every segment that was marked by MarkSegmentFace(),
+    // and resets the marks. The visible tiles that a row or column of the map has in common with the FoV triangle are
+    // consecutive, so the visible faces of a segment don't have gaps
+    void GetVisibleSegments( std::vector<FaceInfo> &vVisibleFaces ) {
+        const FaceTable &ft = faceTable;
+        for (int nSeg : vSegsMarked) {
+            int f = ft.vSegFirst[nSeg];
+            olc::vi2d tile = olc::vi2d( ft.vTileX[f], ft.vTileY[f] ) + GetFaceTileStep( ft.vSide[f] ) * vSegRunLeft[nSeg];
+            FaceInfo curFace;
+            BuildFaceInfo( tile.x, tile.y, ft.vSide[f], curFace, vSegRunRght[nSeg] - vSegRunLeft[nSeg] + 1 );
+            if (curFace.bVisible) vVisibleFaces.push_back( curFace );
+            vSegRunLeft[nSeg] = -1;
+            vSegRunRght[nSeg] = -1;
+        }
+        vSegsMarked.clear();
+    }
+
+    // returns true if face a is in front of face b, as seen by the player. The faces may not intersect (they may
+    // touch), and they must both be facing the player. If b lies completely behind the line through a, or a lies
+    // completely at the player side of the line through b, a is in front. For faces that don't overlap on screen the
+    // result doesn't mean anything
+    bool FaceInFront( FaceInfo &a, FaceInfo &b ) {
+        olc::vf2d a0, a1, b0, b1;
+        GetFaceEnds( a, a0, a1 );
+        GetFaceEnds( b, b0, b1 );
+        return FaceInFront( a0, a1, b0, b1 );
+    }
+
+    // works out the world coordinates of the left (p0) and right (p1) end of curFace, which may be a wall segment
+    void GetFaceEnds( FaceInfo &curFace, olc::vf2d &p0, olc::vf2d &p1 ) {
+        olc::vi2d lastTile = curFace.TileID + GetFaceTileStep( curFace.nSide ) * (curFace.nTiles - 1);
+        p0 = GetColumnCoordinates( curFace.TileID.x, curFace.TileID.y, curFace.nSide, true  );
+        p1 = GetColumnCoordinates(     lastTile.x,     lastTile.y, curFace.nSide, false );
+    }
+
+    // like FaceInFront() above, for faces a and b with ends (a0, a1) and (b0, b1)
+    bool FaceInFront( const olc::vf2d &a0, const olc::vf2d &a1, const olc::vf2d &b0, const olc::vf2d &b1 ) {
+        // positive at the front side of the line through p0 and p1 (the side of the player)
+        auto side_of = []( olc::vf2d p0, olc::vf2d p1, olc::vf2d q ) {
+            return (p1.x - p0.x) * (q.y - p0.y) - (p1.y - p0.y) * (q.x - p0.x);
+        };
+        float fB0 = side_of( a0, a1, b0 ), fB1 = side_of( a0, a1, b1 );
+        if (fB0 <= 0.0f && fB1 <= 0.0f) return true;
+        if (fB0 >= 0.0f && fB1 >= 0.0f) return false;
+        // b is crossed by the line through a, so a can't be crossed by the line through b
+        float fA0 = side_of( b0, b1, a0 ), fA1 = side_of( b0, b1, a1 );
+        return fA0 >= 0.0f && fA1 >= 0.0f;
+    }
+
+    // per frame work space for OrderSegmentsFrontToBack()
+    std::vector<olc::vf2d> vFaceEnds;                // per face: world coordinates of its left and right end
+    std::vector<int> vByLeftCol;                     // face indices, in order of their left screen column
+    std::vector<int> vOverlapping;                   // sweep: the faces that extend beyond the current left column
+    std::vector<std::pair<int, int>> vFrontPairs;    // (i, j): face i must be rendered before face j
+    std::vector<int> vFirstBehind;                   // per face: the faces behind it are [vFirstBehind[i], vFirstBehind[i + 1])
+    std::vector<int> vBehind;                        //           of this array
+    std::vector<int> vNrInFront;                     // per face: nr of faces that must be rendered before it
+    std::vector<int> vReadyHeap;                     // min heap of the faces that have no faces in front of them left
+    std::vector<FaceInfo> vOrderedFaces;
+
+    // precondition - vVisibleFaces is sorted on distance
+    // reorders vVisibleFaces so that every face comes before the faces it (partly) hides on screen. Only pairs of faces
+    // that overlap on screen are compared (see FaceInFront()). Of the faces that have no faces in front of them left,
+    // the one that is nearest in the distance order is taken next, so the order only changes where it was wrong.
+    // Faces that don't intersect can always be ordered like this, but for safety a cycle is broken by taking the
+    // nearest remaining face.
+    // The overlapping pairs are found by a sweep over the faces in order of their left column, and the faces that
+    // are free to go are kept in a heap, so the cost is O((n + p) log n) for n faces that have p overlapping pairs
+    void OrderSegmentsFrontToBack( std::vector<FaceInfo> &vVisibleFaces ) {
+        int n = (int)vVisibleFaces.size();
+
+        // 1. collect the overlapping pairs, and per pair which face must go first. The relation is worked out from the
+        //    nearer face of the pair
+        vFaceEnds.resize( 2 * n );
+        vByLeftCol.resize( n );
+        for (int i = 0; i < n; i++) {
+            GetFaceEnds( vVisibleFaces[i], vFaceEnds[2 * i], vFaceEnds[2 * i + 1] );
+            vByLeftCol[i] = i;
+        }
+        std::sort( vByLeftCol.begin(), vByLeftCol.end(), [&]( int i, int j ) {
+            return vVisibleFaces[i].leftCol.nScreenX < vVisibleFaces[j].leftCol.nScreenX;
+        });
+        vFrontPairs.clear();
+        vOverlapping.clear();
+        for (int j : vByLeftCol) {
+            FaceInfo &b = vVisibleFaces[j];
+            int nKept = 0;
+            for (int i : vOverlapping) {
+                FaceInfo &a = vVisibleFaces[i];
+                // faces that only share a corner column can't hide each other. A face that ends left of b can't overlap
+                // the faces after b either
+                if (a.rghtCol.nScreenX <= b.leftCol.nScreenX) continue;
+                vOverlapping[nKept++] = i;
+                if (b.rghtCol.nScreenX <= a.leftCol.nScreenX) continue;
+
+                int nNear = std::min( i, j ), nFar = std::max( i, j );
+                if (FaceInFront( vFaceEnds[2 * nNear], vFaceEnds[2 * nNear + 1], vFaceEnds[2 * nFar], vFaceEnds[2 * nFar + 1] )) {
+                    vFrontPairs.push_back( { nNear, nFar } );
+                } else {
+                    vFrontPairs.push_back( { nFar, nNear } );
+                }
+            }
+            vOverlapping.resize( nKept );
+            vOverlapping.push_back( j );
+        }
+
+        // 2. group the faces behind per face (counting sort on the first face of the pairs), and count per face the
+        //    faces that must go before it
+        vFirstBehind.assign( n + 1, 0 );
+        vNrInFront.assign( n, 0 );
+        for (auto &pair : vFrontPairs) {
+            vFirstBehind[pair.first] += 1;
+            vNrInFront[pair.second] += 1;
+        }
+        for (int i = 1; i <= n; i++) vFirstBehind[i] += vFirstBehind[i - 1];    // end of the range per face
+        vBehind.resize( vFrontPairs.size());
+        for (auto &pair : vFrontPairs) {
+            vBehind[--vFirstBehind[pair.first]] = pair.second;                   // ends up at the start of the range
+        }
+
+        // 3. hand out the faces, nearest free face first
+        vReadyHeap.clear();
+        for (int i = 0; i < n; i++) {
+            if (vNrInFront[i] == 0) vReadyHeap.push_back( i );    // ascending, so this is a valid heap
+        }
+        vOrderedFaces.clear();
+        int nFirstLeft = 0;    // all faces before this one are taken
+        for (int k = 0; k < n; k++) {
+            int nNext;
+            if (!vReadyHeap.empty()) {
+                std::pop_heap( vReadyHeap.begin(), vReadyHeap.end(), std::greater<int>());
+                nNext = vReadyHeap.back();
+                vReadyHeap.pop_back();
+            } else {
+                // all remaining faces are blocked by a cycle - take the nearest one
+                while (vNrInFront[nFirstLeft] < 0) nFirstLeft += 1;
+                nNext = nFirstLeft;
+            }
+            vNrInFront[nNext] = -1;    // taken
+            for (int p = vFirstBehind[nNext]; p < vFirstBehind[nNext + 1]; p++) {
+                int j = vBehind[p];
+                if (vNrInFront[j] > 0 && --vNrInFront[j] == 0) {
+                    vReadyHeap.push_back( j );
+                    std::push_heap( vReadyHeap.begin(), vReadyHeap.end(), std::greater<int>());
+                }
+            }
+            vOrderedFaces.push_back( vVisibleFaces[nNext] );
+        }
+        vVisibleFaces.swap( vOrderedFaces );
+    }
+
+    // Lazy face ordering
+    // ==================
+
+    // In lazy order mode the faces list isn't sorted. Instead the faces are keyed like in SortVisibleFaces(), and the
+    // keys are put in a binary (min) heap by InitLazyOrder(). Each call to NextLazyFace() pops the nearest face, so
+    // building the heap is O(n), and every face that is actually rendered costs O(log n).
+    // If the faces are merged into wall segments the rule of OrderSegmentsFrontToBack() is applied on the fly: the
+    // popped faces wait in a window (in distance order), and the first one of them that has no remaining face in front
+    // of it is handed out. Only the faces that overlap it on screen are tested for that. This gives the same order as
+    // sorting the complete list, including the way cycles are broken.
+    // NOTE: the state is shared by the single threaded render loop and the visibility stage of pipelined mode, which
+    //       never run at the same time
+
+    typedef struct sLazyOrder {
+        std::vector<FaceInfo> *pFaces = nullptr;   // the (unordered) faces list
+        std::vector<uint64_t> vHeap;               // key and index (see SortVisibleFaces()) of the faces not popped yet
+        std::vector<uint64_t> vWindow;             // merge mode: popped faces that are not handed out yet, in order
+        bool bMerged = false;                      // the faces are wall segments
+        int nPopped = 0;                           // nr of faces popped from the heap
+        double fMicros = 0.0;                      // time spent in InitLazyOrder() and NextLazyFace()
+    } LazyOrder;
+    LazyOrder lazyOrder;
+
+    // returns true if the faces are taken from a heap while they're rendered. Band mode needs the complete order, since
+    // all bands process the same list
+    bool LazyOrderActive() {
+        return nOrderMode == ORD_LAZY && nVisibilityMode == VIS_SORTED && (PipelineModeActive() || !BandModeActive());
+    }
+
+    // prepares vVisibleFaces to be handed out in order by NextLazyFace()
+    void InitLazyOrder( std::vector<FaceInfo> &vVisibleFaces ) {
+        BenchClock::time_point tStart = BenchClock::now();
+        LazyOrder &lo = lazyOrder;
+        lo.pFaces  = &vVisibleFaces;
+        lo.bMerged = bMergeFaces;
+        lo.nPopped = 0;
+        lo.vWindow.clear();
+        lo.vHeap.resize( vVisibleFaces.size());
+        for (int i = 0; i < (int)vVisibleFaces.size(); i++) {
+            lo.vHeap[i] = (uint64_t( GetFaceSortKey( vVisibleFaces[i] )) << 32) | uint64_t( i );
+        }
+        std::make_heap( lo.vHeap.begin(), lo.vHeap.end(), std::greater<uint64_t>());
+        lo.fMicros = MicrosSince( tStart );
+    }
+
+    // returns true if the face with key kFace must wait for the face with key kOther to be rendered first (see
+    // OrderSegmentsFrontToBack())
+    bool LazyFaceBehind( uint64_t kFace, uint64_t kOther ) {
+        FaceInfo &a = (*lazyOrder.pFaces)[uint32_t( kFace  )];
+        FaceInfo &b = (*lazyOrder.pFaces)[uint32_t( kOther )];
+        // faces that only share a corner column can't hide each other
+        if (a.rghtCol.nScreenX <= b.leftCol.nScreenX || b.rghtCol.nScreenX <= a.leftCol.nScreenX) return false;
+        // the relation is worked out from the nearer face, like in OrderSegmentsFrontToBack()
+        return (kOther < kFace) ? FaceInFront( b, a ) : !FaceInFront( a, b );
+    }
+
+    // returns the next face in front to back order, or nullptr if all faces were handed out
+    FaceInfo *NextLazyFace() {
+        BenchClock::time_point tStart = BenchClock::now();
+        LazyOrder &lo = lazyOrder;
+        auto pop_face = [&]() {
+            std::pop_heap( lo.vHeap.begin(), lo.vHeap.end(), std::greater<uint64_t>());
+            uint64_t kFace = lo.vHeap.back();
+            lo.vHeap.pop_back();
+            lo.nPopped += 1;
+            return kFace;
+        };
+        uint64_t kNext = 0;
+        bool bFound = false;
+        if (!lo.bMerged) {
+            if (!lo.vHeap.empty()) {
+                kNext = pop_face();
+                bFound = true;
+            }
+        } else {
+            // take the first face of the window that has no remaining face in front of it, popping more faces as needed
+            int nWindowNext = -1;
+            for (int w = 0; nWindowNext < 0; w++) {
+                if (w == (int)lo.vWindow.size()) {
+                    if (lo.vHeap.empty()) break;
+                    lo.vWindow.push_back( pop_face());
+                }
+                bool bBlocked = false;
+                for (int v = 0; v < (int)lo.vWindow.size() && !bBlocked; v++) {
+                    bBlocked = (v != w) && LazyFaceBehind( lo.vWindow[w], lo.vWindow[v] );
+                }
+                for (int h = 0; h < (int)lo.vHeap.size() && !bBlocked; h++) {
+                    bBlocked = LazyFaceBehind( lo.vWindow[w], lo.vHeap[h] );
+                }
+                if (!bBlocked) nWindowNext = w;
+            }
+            // all remaining faces are blocked by a cycle - take the nearest one
+            if (nWindowNext < 0 && !lo.vWindow.empty()) nWindowNext = 0;
+            if (nWindowNext >= 0) {
+                kNext = lo.vWindow[nWindowNext];
+                lo.vWindow.erase( lo.vWindow.begin() + nWindowNext );
+                bFound = true;
+            }
+        }
+        lo.fMicros += MicrosSince( tStart );
+        return bFound ? &(*lo.pFaces)[uint32_t( kNext )] : nullptr;
+    }
 
-            // use mean distance of the two columns as distance for the face
-            return ((a.leftCol.fDistFromPlayer_raw + a.rghtCol.fDistFromPlayer_raw) / 2.0f) <
-                   ((b.leftCol.fDistFromPlayer_raw + b.rghtCol.fDistFromPlayer_raw) / 2.0f);
+    // works out the range [nFirst, nEnd) of tile faces of curFace that are (partly) in front of the near plane
+    void GetFacePieceRange( FaceInfo &curFace, int &nFirst, int &nEnd ) {
+        nFirst = std::max( 0, int( floor( curFace.fLeftU )));
+        nEnd   = std::min( curFace.nTiles, std::max( nFirst + 1, int( ceil( curFace.fRghtU ))));
+    }
 
-            // I wonder - would taking the smallest of the columns' distances yield better results?
-            // Well, I tried this and it doesn't seem to make any difference...
-            // NOTE: I didn't retry this after introducing the raw distances
-//            return (std::min( a.leftCol.fDistFromPlayer_raw, a.rghtCol.fDistFromPlayer_raw ) <
-//                    std::min( b.leftCol.fDistFromPlayer_raw, b.rghtCol.fDistFromPlayer_raw ));
+    // calls func( piece, nLeftClip, nRghtClip ) for each tile face (piece) of curFace that has columns in both
+    // [nLeftClip, nRghtClip] and [nBandLeft, nBandRght], with the clip range narrowed to the columns of the piece. The
+    // screen column on the boundary of two pieces is given to the nearest one, just like when the tile faces are
+    // rendered one by one in distance order. For a face of a single tile func is called once, for curFace itself
+    // If the segment is clipped by the near plane, only the pieces that are (partly) in front of it are visited, and
+    // the outer columns and texture u of the segment are used for the outer pieces
+    template <typename PieceFunc>
+    void ForEachFacePiece( FaceInfo &curFace, int nLeftClip, int nRghtClip, int nBandLeft, int nBandRght, PieceFunc func ) {
+        if (curFace.nTiles <= 1) {
+            func( curFace, nLeftClip, nRghtClip );
+            return;
+        }
+        int nFromX = std::max( nLeftClip, nBandLeft );
+        int nToX   = std::min( nRghtClip, nBandRght );
+        if (nFromX > nToX) return;
+
+        olc::vi2d step = GetFaceTileStep( curFace.nSide );
+        olc::vi2d leftCorner = GetColumnCorner( curFace.TileID.x, curFace.TileID.y, curFace.nSide, true );
+        int nFirst, nEnd;
+        GetFacePieceRange( curFace, nFirst, nEnd );
+        auto build_col = [&]( int k, ColInfo &col ) {
+            if (k == nFirst) {
+                col = curFace.leftCol;
+            } else if (k == nEnd) {
+                col = curFace.rghtCol;
+            } else {
+                col = GetCornerColInfo( leftCorner + step * k );
+            }
+        };
+        // same distance as used by SortVisibleFaces()
+        auto mean_dist = []( ColInfo &a, ColInfo &b ) {
+            return (a.fDistFromPlayer_raw + b.fDistFromPlayer_raw) / 2.0f;
         };
+        // the columns of the pieces are increasing on screen, so the first piece that reaches nFromX is searched
+        ColInfo prevCol, nextCol;
+        int nLo = nFirst, nHi = nEnd - 1;
+        while (nLo < nHi) {
+            int nMid = (nLo + nHi) / 2;
+            build_col( nMid + 1, nextCol );
+            if (nextCol.nScreenX < nFromX) nLo = nMid + 1; else nHi = nMid;
+        }
+        FaceInfo piece = curFace;
+        piece.nTiles = 1;
+        if (nLo > nFirst) build_col( nLo - 1, prevCol );
+        build_col( nLo    , piece.leftCol );
+        build_col( nLo + 1, piece.rghtCol );
+        for (int k = nLo; k < nEnd; k++) {
+            if (k + 1 < nEnd) build_col( k + 2, nextCol );
+            bool bOwnsLeft = (k == nFirst  ) || !(mean_dist( prevCol, piece.leftCol ) < mean_dist( piece.leftCol, piece.rghtCol ));
+            bool bOwnsRght = (k == nEnd - 1) ||   mean_dist( piece.leftCol, piece.rghtCol ) < mean_dist( piece.rghtCol, nextCol );
+            int nPieceLeft = piece.leftCol.nScreenX + (bOwnsLeft ? 0 : 1);
+            int nPieceRght = piece.rghtCol.nScreenX - (bOwnsRght ? 0 : 1);
+            if (nPieceLeft > nToX) break;
+
+            piece.TileID = curFace.TileID + step * k;
+            piece.fLeftU = (k == nFirst  ) ? curFace.fLeftU - float( k ) : 0.0f;
+            piece.fRghtU = (k == nEnd - 1) ? curFace.fRghtU - float( k ) : 1.0f;
+            int nLeft = std::max( nLeftClip, nPieceLeft );
+            int nRght = std::min( nRghtClip, nPieceRght );
+            if (nLeft <= nRght) func( piece, nLeft, nRght );
+
+            prevCol       = piece.leftCol;
+            piece.leftCol = piece.rghtCol;
+            piece.rghtCol = nextCol;
+        }
+    }
+
+    // Corner projection cache
+    // =======================
+
+    // The columns of all faces are at grid corners, and a corner is shared by up to four faces (as well as by the tile
+    // faces of a wall segment and the segment itself). So per frame every corner that is needed is transformed only
+    // once (see BuildColInfo()) and kept in vCornerCols. An entry is valid if its stamp equals nCornerStamp, which is
+    // incremented by ResetCornerCache() whenever the player may have moved.
+    // NOTE: the cache is only filled by the visibility stage. In band mode the bands process the faces in parallel, so
+    //       the corners of the wall segments are cached up front, see CacheSegmentCorners()
+    std::vector<ColInfo> vCornerCols;
+    std::vector<int>     vCornerStamp;
+    int nCornerStamp = 0;
+
+    // invalidates the cached corners - must be called before the visible faces of a new player state are determined
+    void ResetCornerCache() {
+        int nCorners = (nMapX + 1) * (nMapY + 1);
+        if ((int)vCornerStamp.size() != nCorners) {
+            vCornerCols.resize( nCorners );
+            vCornerStamp.assign( nCorners, 0 );
+        }
+        nCornerStamp += 1;
+    }
+
+    // returns the column info of grid corner corner, it is transformed if it isn't cached yet
+    const ColInfo &GetCornerColInfo( olc::vi2d corner ) {
+        int nIndex = corner.y * (nMapX + 1) + corner.x;
+        if (vCornerStamp[nIndex] != nCornerStamp) {
+            BuildColInfo( olc::vf2d( corner ), vCornerCols[nIndex] );
+            vCornerStamp[nIndex] = nCornerStamp;
+        }
+        return vCornerCols[nIndex];
+    }
+
+    // caches all corners of the wall segments in vFaces, so that ForEachFacePiece() doesn't need to transform corners
+    void CacheSegmentCorners( std::vector<FaceInfo> &vFaces ) {
+        bool bBatch = (nProjectionMode == PRJ_PINHOLE);
+        for (auto &face : vFaces) {
+            if (face.nTiles <= 1) continue;
+            int nFirst, nEnd;
+            GetFacePieceRange( face, nFirst, nEnd );
+            olc::vi2d step   = GetFaceTileStep( face.nSide );
+            olc::vi2d corner = GetColumnCorner( face.TileID.x, face.TileID.y, face.nSide, true ) + step * nFirst;
+            for (int k = nFirst; k <= nEnd; k++, corner = corner + step) {
+                if (bBatch) {
+                    QueueCorner( corner );
+                } else {
+                    GetCornerColInfo( corner );
+                }
+            }
+        }
+        if (bBatch) TransformCornerBatch();
+    }
+
+    // Batch corner transform
+    // ======================
+
+    // The pinhole projection (see BuildColInfo_pinhole()) is the same handful of multiplications for every corner, so
+    // the corners that are needed are gathered first and transformed in one go. The batch is kept as a structure of
+    // arrays, so that the SSE and AVX2 kernels can load 4 resp. 8 corners at a time. The kernels do the same operations
+    // in the same order as the scalar one (and without FMA), so they all give exactly the same results.
+    // The SSE kernel is used even if the CPU supports AVX2: with --bench-transform the AVX2 kernel measured slower
+    // (about 2.8x - 3.7x the scalar speed, against 3.5x - 4.0x for SSE). The AVX2 kernel is kept for the benchmark.
+    // NOTE: the angular projection needs atan2() per corner, so it isn't batched
+
+    typedef struct sCornerBatch {
+        std::vector<int>   vIndex;          // per corner: index into vCornerCols
+        std::vector<float> vX, vY;          //             world location
+        std::vector<float> vRaw, vDepth;    //             results: raw distance and camera depth (clamped)
+        std::vector<int>   vScreenX;        //                      and projected screen column
+    } CornerBatch;
+    CornerBatch cornerBatch;
+
+    // adds grid corner corner to the batch, unless it's cached already. The corner is marked as cached right away, so
+    // it must not be looked up before TransformCornerBatch() is called
+    void QueueCorner( olc::vi2d corner ) {
+        int nIndex = corner.y * (nMapX + 1) + corner.x;
+        if (vCornerStamp[nIndex] == nCornerStamp) return;
+        vCornerStamp[nIndex] = nCornerStamp;
+        cornerBatch.vIndex.push_back( nIndex );
+        cornerBatch.vX.push_back( float( corner.x ));
+        cornerBatch.vY.push_back( float( corner.y ));
+    }
+
+    // transforms the queued corners, puts the results in the corner cache and empties the batch
+    void TransformCornerBatch() {
+        CornerBatch &b = cornerBatch;
+        int nCount = (int)b.vIndex.size();
+        b.vRaw.resize( nCount );
+        b.vDepth.resize( nCount );
+        b.vScreenX.resize( nCount );
+        TransformCorners( b.vX.data(), b.vY.data(), nCount, b.vRaw.data(), b.vDepth.data(), b.vScreenX.data());
+        for (int i = 0; i < nCount; i++) {
+            ColInfo &col = vCornerCols[b.vIndex[i]];
+            col.fAngleFromPlayer    = 0.0f;
+            col.fDistFromPlayer_raw = b.vRaw[i];
+            col.fDistFromPlayer     = b.vDepth[i];
+            col.nScreenX            = b.vScreenX[i];
+        }
+        b.vIndex.clear();
+        b.vX.clear();
+        b.vY.clear();
+    }
+
+    // scalar kernel - must stay in line with BuildColInfo_pinhole()
+    void TransformCorners_scalar( const float *pX, const float *pY, int nCount, float *pRaw, float *pDepth, int *pScreenX ) {
+        float fHalfW = ScreenWidth() * 0.5f;
+        for (int i = 0; i < nCount; i++) {
+            float fDX = pX[i] - fPlayerX;
+            float fDY = pY[i] - fPlayerY;
+            float fCamX = fDY * fPlayerCos - fDX * fPlayerSin;
+            float fCamZ = fDX * fPlayerCos + fDY * fPlayerSin;
+            pRaw[i]     = sqrtf( fDX * fDX + fDY * fDY );
+            pDepth[i]   = std::max( fCamZ, PINHOLE_MIN_Z );
+            pScreenX[i] = int( fHalfW + fCamX * fDistToProjPlane / pDepth[i] );
+        }
+    }
+
+#if X86_SIMD_KERNELS
+    // SSE kernel - 4 corners at a time. Returns the nr of corners that were done, the rest is left for the scalar kernel
+    TARGET_SSE2 int TransformCorners_sse( const float *pX, const float *pY, int nCount, float *pRaw, float *pDepth, int *pScreenX ) {
+        __m128 vPlayerX = _mm_set1_ps( fPlayerX );
+        __m128 vPlayerY = _mm_set1_ps( fPlayerY );
+        __m128 vCos     = _mm_set1_ps( fPlayerCos );
+        __m128 vSin     = _mm_set1_ps( fPlayerSin );
+        __m128 vMinZ    = _mm_set1_ps( PINHOLE_MIN_Z );
+        __m128 vHalfW   = _mm_set1_ps( ScreenWidth() * 0.5f );
+        __m128 vProjD   = _mm_set1_ps( fDistToProjPlane );
+        int i = 0;
+        for ( ; i + 4 <= nCount; i += 4) {
+            __m128 vDX    = _mm_sub_ps( _mm_loadu_ps( pX + i ), vPlayerX );
+            __m128 vDY    = _mm_sub_ps( _mm_loadu_ps( pY + i ), vPlayerY );
+            __m128 vCamX  = _mm_sub_ps( _mm_mul_ps( vDY, vCos ), _mm_mul_ps( vDX, vSin ));
+            __m128 vCamZ  = _mm_add_ps( _mm_mul_ps( vDX, vCos ), _mm_mul_ps( vDY, vSin ));
+            __m128 vDepth = _mm_max_ps( vCamZ, vMinZ );
+            __m128 vRaw   = _mm_sqrt_ps( _mm_add_ps( _mm_mul_ps( vDX, vDX ), _mm_mul_ps( vDY, vDY )));
+            __m128 vX     = _mm_add_ps( vHalfW, _mm_div_ps( _mm_mul_ps( vCamX, vProjD ), vDepth ));
+            _mm_storeu_ps( pRaw   + i, vRaw   );
+            _mm_storeu_ps( pDepth + i, vDepth );
+            _mm_storeu_si128( (__m128i *)(pScreenX + i), _mm_cvttps_epi32( vX ));
+        }
+        return i;
+    }
 
-        std::sort( vVisibleFaces.begin(), vVisibleFaces.end(), faces_sort_small2large );
+    // AVX2 kernel - same as TransformCorners_sse(), but 8 corners at a time
+    TARGET_AVX2_EXACT int TransformCorners_avx2( const float *pX, const float *pY, int nCount, float *pRaw, float *pDepth, int *pScreenX ) {
+        __m256 vPlayerX = _mm256_set1_ps( fPlayerX );
+        __m256 vPlayerY = _mm256_set1_ps( fPlayerY );
+        __m256 vCos     = _mm256_set1_ps( fPlayerCos );
+        __m256 vSin     = _mm256_set1_ps( fPlayerSin );
+        __m256 vMinZ    = _mm256_set1_ps( PINHOLE_MIN_Z );
+        __m256 vHalfW   = _mm256_set1_ps( ScreenWidth() * 0.5f );
+        __m256 vProjD   = _mm256_set1_ps( fDistToProjPlane );
+        int i = 0;
+        for ( ; i + 8 <= nCount; i += 8) {
+            __m256 vDX    = _mm256_sub_ps( _mm256_loadu_ps( pX + i ), vPlayerX );
+            __m256 vDY    = _mm256_sub_ps( _mm256_loadu_ps( pY + i ), vPlayerY );
+            __m256 vCamX  = _mm256_sub_ps( _mm256_mul_ps( vDY, vCos ), _mm256_mul_ps( vDX, vSin ));
+            __m256 vCamZ  = _mm256_add_ps( _mm256_mul_ps( vDX, vCos ), _mm256_mul_ps( vDY, vSin ));
+            __m256 vDepth = _mm256_max_ps( vCamZ, vMinZ );
+            __m256 vRaw   = _mm256_sqrt_ps( _mm256_add_ps( _mm256_mul_ps( vDX, vDX ), _mm256_mul_ps( vDY, vDY )));
+            __m256 vX     = _mm256_add_ps( vHalfW, _mm256_div_ps( _mm256_mul_ps( vCamX, vProjD ), vDepth ));
+            _mm256_storeu_ps( pRaw   + i, vRaw   );
+            _mm256_storeu_ps( pDepth + i, vDepth );
+            _mm256_storeu_si256( (__m256i *)(pScreenX + i), _mm256_cvttps_epi32( vX ));
+        }
+        return i;
+    }
+#endif
+
+    // transforms nCount corners with the SSE kernel (see Batch corner transform), the remainder is done by the scalar
+    // kernel
+    void TransformCorners( const float *pX, const float *pY, int nCount, float *pRaw, float *pDepth, int *pScreenX ) {
+        int nDone = 0;
+#if X86_SIMD_KERNELS
+        nDone = TransformCorners_sse( pX, pY, nCount, pRaw, pDepth, pScreenX );
+#endif
+        TransformCorners_scalar( pX + nDone, pY + nDone, nCount - nDone, pRaw + nDone, pDepth + nDone, pScreenX + nDone );
     }
 
     // Convenience rendering functions
@@ -664,16 +2960,103 @@ public:
         return "ERROR ";
     }
 
+    std::string VisibilityMode2String( int nMode ) {
+        switch (nMode) {
+            case VIS_SORTED  : return "SORTED  ";
+            case VIS_FRONTIER: return "FRONTIER";
+            case VIS_BSP     : return "BSP     ";
+            case VIS_PORTALS : return "PORTALS ";
+        }
+        return "ERROR   ";
+    }
+
+    std::string OcclusionMode2String( int nMode ) {
+        switch (nMode) {
+            case OCC_LIST   : return "LIST   ";
+            case OCC_SPANS  : return "SPANS  ";
+            case OCC_BITMASK: return "BITMASK";
+        }
+        return "ERROR  ";
+    }
+
+    std::string SamplerMode2String( int nMode ) {
+        switch (nMode) {
+            case SMP_COLUMNS: return "COLUMNS";
+            case SMP_WARPED : return "WARPED ";
+        }
+        return "ERROR  ";
+    }
+
+    std::string ParallelMode2String( int nMode ) {
+        switch (nMode) {
+            case PAR_BANDS: return "BANDS";
+            case PAR_JOBS : return "JOBS ";
+        }
+        return "ERROR";
+    }
+
+    std::string ProjectionMode2String( int nMode ) {
+        switch (nMode) {
+            case PRJ_ANGULAR: return "ANGULAR";
+            case PRJ_PINHOLE: return "PINHOLE";
+        }
+        return "ERROR  ";
+    }
+
+    std::string OrderMode2String( int nMode ) {
+        switch (nMode) {
+            case ORD_SORTED: return "SORTED";
+            case ORD_LAZY  : return "LAZY  ";
+        }
+        return "ERROR ";
+    }
+
+    std::string FrameExecMode2String( int nMode ) {
+        switch (nMode) {
+            case EXE_SERIAL   : return "SERIAL   ";
+            case EXE_PIPELINED: return "PIPELINED";
+        }
+        return "ERROR    ";
+    }
+
+    // returns the lowest and highest utilization (in %) of the workers in the last parallel rendering, as a string
+    std::string WorkerUtilization2String() {
+        if (vWorkerStats.empty() || fWorkerMicros <= 0.0) return "-";
+        double fMin = 1.0, fMax = 0.0;
+        for (auto &stats : vWorkerStats) {
+            fMin = std::min( fMin, stats.fBusy / fWorkerMicros );
+            fMax = std::max( fMax, stats.fBusy / fWorkerMicros );
+        }
+        return std::to_string( int( 100.0 * fMin )) + "-" + std::to_string( int( 100.0 * fMax )) + "%";
+    }
+
     // Render some debug info on screen at pos
     void RenderDebugInfo( olc::vi2d pos ) {
         // first lay background for text drawing
-        FillRect( pos.x - 4, pos.y - 4, 180, 40 + 15, COL_BG );
+        FillRect( pos.x - 4, pos.y - 4, 180, 160 + 15, COL_BG );
         // then render info on top
+        // the visible faces before and after merging them into wall segments
+        int nTileFaces = 0;
+        for (auto &face : vFacesToRender) nTileFaces += face.nTiles;
         DrawString( pos.x, pos.y +  0, "#tiles visbl = " + std::to_string( vTilesToRender.size() ), COL_TEXT );
-        DrawString( pos.x, pos.y + 10, "#faces visbl = " + std::to_string( vFacesToRender.size() ), COL_TEXT );
-        DrawString( pos.x, pos.y + 20, "#faces rndrd = " + std::to_string( nFacesRendered        ), COL_TEXT );
-        DrawString( pos.x, pos.y + 30, "occList size = " + std::to_string(        occList.size() ), COL_TEXT );
-        DrawString( pos.x, pos.y + 40, "texture mode = " + TextureMode2String( nTextureMode      ), COL_TEXT );
+        DrawString( pos.x, pos.y + 10, "#faces visbl = " + std::to_string( nTileFaces            ), COL_TEXT );
+        DrawString( pos.x, pos.y + 20, "#segms visbl = " + std::to_string( vFacesToRender.size() ), COL_TEXT );
+        DrawString( pos.x, pos.y + 30, "#segms rndrd = " + std::to_string( nFacesRendered        ), COL_TEXT );
+        DrawString( pos.x, pos.y + 40, "occList size = " + std::to_string( SizeOcclusion( mainState )), COL_TEXT );
+        DrawString( pos.x, pos.y + 50, "texture mode = " + TextureMode2String( nTextureMode      ), COL_TEXT );
+        DrawString( pos.x, pos.y + 60, "visblty mode = " + VisibilityMode2String( nVisibilityMode ), COL_TEXT );
+        // in BSP mode the nr of tree nodes that were visited, in portal mode the nr of sectors
+        std::string sVisited = (nVisibilityMode == VIS_BSP ? "#nodes visit = " : (nVisibilityMode == VIS_PORTALS ? "#sectr visit = " : "#cells visit = "));
+        DrawString( pos.x, pos.y + 70, sVisited + std::to_string( nCellsVisited ), COL_TEXT );
+        DrawString( pos.x, pos.y + 80, "occlusn mode = " + OcclusionMode2String( nOcclusionMode  ), COL_TEXT );
+        DrawString( pos.x, pos.y + 90, "sampler mode = " + SamplerMode2String( nSamplerMode      ), COL_TEXT );
+        DrawString( pos.x, pos.y + 100, "#rndr thread = " + std::to_string( nRenderThreads        ), COL_TEXT );
+        DrawString( pos.x, pos.y + 110, "paralel mode = " + ParallelMode2String( nParallelMode    ), COL_TEXT );
+        DrawString( pos.x, pos.y + 120, "worker util  = " + WorkerUtilization2String(             ), COL_TEXT );
+        DrawString( pos.x, pos.y + 130, "frame exec   = " + FrameExecMode2String( nFrameExecMode  ), COL_TEXT );
+        DrawString( pos.x, pos.y + 140, "projection   = " + ProjectionMode2String( nProjectionMode ), COL_TEXT );
+        DrawString( pos.x, pos.y + 150, "face order   = " + OrderMode2String( nOrderMode          ), COL_TEXT );
+        DrawString( pos.x, pos.y + 160, "PVS culling  = " + std::string( bUsePVS ? "ON " : "OFF"    ), COL_TEXT );
     }
 
     // if bHorizontal is true, render horizontal grid lines every 10 pixels.
@@ -700,19 +3083,39 @@ public:
         }
     }
 
+    // works out the upper and lower screen points of column col of a face with height fHeight. The bottom of the face
+    // is on the floor, and the projection is relative to the eye height of the player
+    void GetColumnScreenPoints( ColInfo &col, float fHeight, olc::vf2d &upper, olc::vf2d &lower ) {
+        float fProjectionHeight = fDistToProjPlane / col.fDistFromPlayer;
+        upper = { float( col.nScreenX ), ScreenHeight() * 0.5f - (fHeight - fPlayerH) * fProjectionHeight };
+        lower = { float( col.nScreenX ), ScreenHeight() * 0.5f +            fPlayerH  * fProjectionHeight };
+    }
+
+    // works out the y value in screen column nStartX of the line through (nLeftX, fLeftY) and (nRghtX, fRghtY), and
+    // the increment of y per screen column. Both are in fixed point format, with FIXED_SHIFT fraction bits
+    // The y value is worked out at a fixed anchor column (the first column of the line that is on screen) and stepped
+    // from there to nStartX, so that the y value in a column doesn't depend on nStartX. Precondition: nStartX >= 0
+    void GetFixedPointEdge( int nLeftX, float fLeftY, int nRghtX, float fRghtY, int nStartX, int64_t &nY, int64_t &nStep ) {
+        double fSlope = (nRghtX == nLeftX) ? 0.0 : double( fRghtY - fLeftY ) / double( nRghtX - nLeftX );
+        int nAnchorX = std::max( 0, nLeftX );
+        nY    = int64_t( std::floor( (double( fLeftY ) + fSlope * double( nAnchorX - nLeftX )) * double( 1 << FIXED_SHIFT )));
+        nStep = int64_t( std::floor(                     fSlope                                * double( 1 << FIXED_SHIFT )));
+        nY   += nStep * (nStartX - nAnchorX);
+    }
+
+    // all state that changes while the faces of a frame are processed (see section Render state)
+    struct sRenderState;
+    typedef struct sRenderState RenderState;
+
     // monochrome (non textured) version
     // Fills a quad whose corner points are specified in curFace. Restricts rendering between screen columns as
-    // denoted by nLeftClip and nRghtClip
-    void RenderWallQuad_mono( FaceInfo &curFace, int nLeftClip, int nRghtClip ) {
+    // denoted by nLeftClip and nRghtClip, and vertically per column as denoted by the clip arrays of rs
+    void RenderWallQuad_mono( RenderState &rs, FaceInfo &curFace, int nLeftClip, int nRghtClip ) {
 
-        // work out this face's left column points
-        float leftProjectionHeight = fDistToProjPlane / curFace.leftCol.fDistFromPlayer;
-        olc::vf2d left_upper = { float( curFace.leftCol.nScreenX ), (ScreenHeight() - leftProjectionHeight) * 0.5f };
-        olc::vf2d left_lower = { float( curFace.leftCol.nScreenX ), (ScreenHeight() + leftProjectionHeight) * 0.5f };
-        // work out right column points
-        float rghtProjectionHeight = fDistToProjPlane / curFace.rghtCol.fDistFromPlayer;
-        olc::vf2d rght_upper = { float( curFace.rghtCol.nScreenX ), (ScreenHeight() - rghtProjectionHeight) * 0.5f };
-        olc::vf2d rght_lower = { float( curFace.rghtCol.nScreenX ), (ScreenHeight() + rghtProjectionHeight) * 0.5f };
+        // work out this face's left and right column points
+        olc::vf2d left_upper, left_lower, rght_upper, rght_lower;
+        GetColumnScreenPoints( curFace.leftCol, curFace.fHeight, left_upper, left_lower );
+        GetColumnScreenPoints( curFace.rghtCol, curFace.fHeight, rght_upper, rght_lower );
 
         // synthetic wall shading
         auto get_face_colour = [=]( int nFace ) {
@@ -731,46 +3134,72 @@ public:
         // clip horizontal rendering both by screen boundaries and clip coordinates
         int nRenderStrt = std::max( {                 0, curFace.leftCol.nScreenX, nLeftClip } );
         int nRenderStop = std::min( { ScreenWidth() - 1, curFace.rghtCol.nScreenX, nRghtClip } );
-
-        // variables for clipped wire frame points
-        olc::vf2d wf_ul, wf_ur, wf_ll, wf_lr;  // upper left/right & lower left/right
+        // only the columns of the band of rs are filled. The wire frame edges are based on the clipped range above
+        int nFillStrt = std::max( nRenderStrt, rs.nBandLeft );
+        int nFillStop = std::min( nRenderStop, rs.nBandRght );
 
         float fMeanDistance = (curFace.leftCol.fDistFromPlayer_raw + curFace.rghtCol.fDistFromPlayer_raw) / 2.0f;
         olc::Pixel quadColour = get_face_colour( curFace.nSide ) * (1.0f - std::min( 1.0f, fMeanDistance / fRenderMaxDist ));
 
-        // draw interior of quad by lerping
-        for (int x = nRenderStrt; x <= nRenderStop; x++) {
+        // little lambda to work out the upper and lower y value of the quad in screen column x, clamped to be within
+        // the clip range of that column. Returns false if nothing of the quad remains in this column
+        auto get_column_range = [&]( int x, float &y_upper, float &y_lower ) {
             float t = float( x - curFace.leftCol.nScreenX ) / float( curFace.rghtCol.nScreenX - curFace.leftCol.nScreenX );
-            float y_upper = left_upper.y + (rght_upper.y - left_upper.y) * t;
-            float y_lower = left_lower.y + (rght_lower.y - left_lower.y) * t;
+            y_upper = std::max( float( rs.vClipTop[x] ), left_upper.y + (rght_upper.y - left_upper.y) * t );
+            y_lower = std::min( float( rs.vClipBot[x] ), left_lower.y + (rght_lower.y - left_lower.y) * t );
+            return y_upper <= y_lower;
+        };
 
-            // save clipped border points for wire frame drawing
-            // (note that y coordinate is not clipped yet)
-            if (x == nRenderStrt) {
-                wf_ul = { float( x ), y_upper };
-                wf_ll = { float( x ), y_lower };
-            }
-            if (x == nRenderStop) {
-                wf_ur = { float( x ), y_upper };
-                wf_lr = { float( x ), y_lower };
+        // draw interior of quad column by column, directly into the pixel data of the draw target. The upper and lower
+        // side are stepped incrementally in fixed point, and clamped to the clip range of the column (which is always
+        // within the screen boundaries)
+        int64_t nUpper, nUpperStep, nLower, nLowerStep;
+        GetFixedPointEdge( curFace.leftCol.nScreenX, left_upper.y, curFace.rghtCol.nScreenX, rght_upper.y, nFillStrt, nUpper, nUpperStep );
+        GetFixedPointEdge( curFace.leftCol.nScreenX, left_lower.y, curFace.rghtCol.nScreenX, rght_lower.y, nFillStrt, nLower, nLowerStep );
+        int nPitch = GetDrawTarget()->width;
+        olc::Pixel *pPixels = GetDrawTarget()->GetData();
+
+        // little lambda to draw the part of the top or floor side of the wire frame in screen column x: from the side's
+        // y value in this column towards the one in the next column (so steep sides don't get gaps), clamped to the
+        // rows [nTop, nBot] that the quad is rendered in
+        auto draw_side = [&]( int x, int64_t nSide, int64_t nStep, int nTop, int nBot ) {
+            int y1 = int( nSide >> FIXED_SHIFT );
+            int y2 = int( (nSide + nStep) >> FIXED_SHIFT );
+            int y_from = std::max( nTop, std::min( y1, y2 ));
+            int y_to   = std::min( nBot, std::max( y1, y2 - (y2 > y1 ? 1 : 0)));
+            for (int y = y_from; y <= y_to; y++) {
+                pPixels[ y * nPitch + x ] = olc::BLACK;
             }
+        };
 
-            // clamp y values to be within screen boundaries
-            y_upper = std::max( float(                  0 ), y_upper );
-            y_lower = std::min( float( ScreenHeight() - 1 ), y_lower );
-            // draw vertical lines to build up the quad interior
-            DrawLine( x, y_upper, x, y_lower, quadColour );
+        for (int x = nFillStrt; x <= nFillStop; x++) {
+            int nTop = int( std::max( nUpper >> FIXED_SHIFT, int64_t( rs.vClipTop[x] )));
+            int nBot = int( std::min( nLower >> FIXED_SHIFT, int64_t( rs.vClipBot[x] )));
+            olc::Pixel *pDst = pPixels + nTop * nPitch + x;
+            for (int y = nTop; y <= nBot; y++, pDst += nPitch) {
+                *pDst = quadColour;
+            }
+            if (bWireFrameMode) {
+                // top and floor side of the wire frame - offset by 1 pixel to improve visibility
+                draw_side( x, nUpper + (int64_t( 1 ) << FIXED_SHIFT), nUpperStep, nTop, nBot );
+                draw_side( x, nLower - (int64_t( 1 ) << FIXED_SHIFT), nLowerStep, nTop, nBot );
+            }
+            nUpper += nUpperStep;
+            nLower += nLowerStep;
         }
 
-        bool bMonoColour = true;
-
         if (bWireFrameMode) {
-            // draw the quad as a wire frame - offset by 1 pixel to improve visibility
+            // draw the left and right column of the wire frame - offset by 1 pixel to improve visibility. The top and
+            // floor side are drawn while the interior is filled (see above), so that they're clipped vertically in the
+            // same way as the interior, without a line drawing call per column
             // NOTE - this line drawing is clipped in horizontal direction, so doesn't necessarily reflect the original shape!
-            DrawLine( wf_ul + olc::vf2d( +1,  0 ), wf_ll + olc::vf2d( +1,  0 ), bMonoColour ? olc::BLACK : olc::RED   );    // left  column
-            DrawLine( wf_ur + olc::vf2d( -1,  0 ), wf_lr + olc::vf2d( -1,  0 ), bMonoColour ? olc::BLACK : olc::GREEN );    // right column
-            DrawLine( wf_ul + olc::vf2d(  0, +1 ), wf_ur + olc::vf2d(  0, +1 ), bMonoColour ? olc::BLACK : olc::WHITE );    // top   side
-            DrawLine( wf_ll + olc::vf2d(  0, -1 ), wf_lr + olc::vf2d(  0, -1 ), bMonoColour ? olc::BLACK : olc::BLUE  );    // floor side
+            // For spans of a single column the left and right column would fall outside the span
+            float y_upper, y_lower;
+            for (int nEdgeX : { nRenderStrt + 1, nRenderStop - 1 }) {
+                if (InBetween( nEdgeX, nFillStrt, nFillStop ) && get_column_range( nEdgeX, y_upper, y_lower )) {
+                    DrawLine( nEdgeX, y_upper, nEdgeX, y_lower, olc::BLACK );
+                }
+            }
         }
     }
 
@@ -779,14 +3208,10 @@ public:
     // denoted by nLeftClip and nRghtClip
     void RenderWallQuad_decal( FaceInfo &curFace, int nLeftClip, int nRghtClip ) {
 
-        // work out this face's left column points
-        float leftProjHeight = fDistToProjPlane / curFace.leftCol.fDistFromPlayer;
-        olc::vf2d left_upper = { float( curFace.leftCol.nScreenX ), (ScreenHeight() - leftProjHeight) * 0.5f };
-        olc::vf2d left_lower = { float( curFace.leftCol.nScreenX ), (ScreenHeight() + leftProjHeight) * 0.5f };
-        // work out right column points
-        float rghtProjHeight = fDistToProjPlane / curFace.rghtCol.fDistFromPlayer;
-        olc::vf2d rght_upper = { float( curFace.rghtCol.nScreenX ), (ScreenHeight() - rghtProjHeight) * 0.5f };
-        olc::vf2d rght_lower = { float( curFace.rghtCol.nScreenX ), (ScreenHeight() + rghtProjHeight) * 0.5f };
+        // work out this face's left and right column points
+        olc::vf2d left_upper, left_lower, rght_upper, rght_lower;
+        GetColumnScreenPoints( curFace.leftCol, curFace.fHeight, left_upper, left_lower );
+        GetColumnScreenPoints( curFace.rghtCol, curFace.fHeight, rght_upper, rght_lower );
         // clip horizontal rendering both by screen boundaries and clip coordinates
         int nRenderStrt = std::max( {                 0, curFace.leftCol.nScreenX, nLeftClip } );
         int nRenderStop = std::min( { ScreenWidth() - 1, curFace.rghtCol.nScreenX, nRghtClip } );
@@ -803,11 +3228,13 @@ public:
         // this could be done by tinting a uniform decal as well
         olc::Decal *pCurrentDecal = bWireFrameMode ? pDecalWallsB[curFace.nSide] : pDecalWalls[curFace.nSide];
 
-        // determine position and size to render partial decal
+        // determine position and size to render partial decal - the texture u range of the face is mapped onto it
         float decalW = pCurrentDecal->sprite->width;
         float decalH = pCurrentDecal->sprite->height;
-        olc::vf2d quadPos  = {       t1  * decalW,   0.0f };
-        olc::vf2d quadSize = { (t2 - t1) * decalW, decalH };
+        float u1 = curFace.fLeftU + (curFace.fRghtU - curFace.fLeftU) * t1;
+        float u2 = curFace.fLeftU + (curFace.fRghtU - curFace.fLeftU) * t2;
+        olc::vf2d quadPos  = {       u1  * decalW,   0.0f };
+        olc::vf2d quadSize = { (u2 - u1) * decalW, decalH };
 
         // convert to std::array for call with DrawPartialWarpedDecal()
         std::array<olc::vf2d, 4> quadPoints = {
@@ -824,43 +3251,344 @@ public:
         DrawPartialWarpedDecal( pCurrentDecal, quadPoints, quadPos, quadSize, quadColour );
     }
 
-    void RenderWallQuad_sprite( FaceInfo &curFace, int nLeftClip, int nRghtClip ) {
+    // works out the corner points of curFace in the order that DrawWarpedSprite() expects them (ul, ll, lr, ur), and
+    // the range of screen columns to render, clipped by the screen boundaries and the clip coordinates
+    void GetWarpedQuad( FaceInfo &curFace, int nLeftClip, int nRghtClip, std::array<olc::vf2d, 4> &quadPoints, int &nRenderStrt, int &nRenderStop ) {
+        olc::vf2d left_upper, left_lower, rght_upper, rght_lower;
+        GetColumnScreenPoints( curFace.leftCol, curFace.fHeight, left_upper, left_lower );
+        GetColumnScreenPoints( curFace.rghtCol, curFace.fHeight, rght_upper, rght_lower );
+        quadPoints = { left_upper, left_lower, rght_lower, rght_upper };
 
-        // work out this face's left column points
-        float leftProjectionHeight = fDistToProjPlane / curFace.leftCol.fDistFromPlayer;
-        olc::vf2d left_upper = { float( curFace.leftCol.nScreenX ), (ScreenHeight() - leftProjectionHeight) * 0.5f };
-        olc::vf2d left_lower = { float( curFace.leftCol.nScreenX ), (ScreenHeight() + leftProjectionHeight) * 0.5f };
-        // work out right column points
-        float rghtProjectionHeight = fDistToProjPlane / curFace.rghtCol.fDistFromPlayer;
-        olc::vf2d rght_upper = { float( curFace.rghtCol.nScreenX ), (ScreenHeight() - rghtProjectionHeight) * 0.5f };
-        olc::vf2d rght_lower = { float( curFace.rghtCol.nScreenX ), (ScreenHeight() + rghtProjectionHeight) * 0.5f };
-        // clip horizontal rendering both by screen boundaries and clip coordinates
-        int nRenderStrt = std::max( {                 0, curFace.leftCol.nScreenX, nLeftClip } );
-        int nRenderStop = std::min( { ScreenWidth() - 1, curFace.rghtCol.nScreenX, nRghtClip } );
-        // convert to std::array for interfacing with DrawWarpedSprite()
-        std::array<olc::vf2d, 4> quadPoints = {
-            left_upper,
-            left_lower,
-            rght_lower,
-            rght_upper
-        };
+        nRenderStrt = std::max( {                 0, curFace.leftCol.nScreenX, nLeftClip } );
+        nRenderStop = std::min( { ScreenWidth() - 1, curFace.rghtCol.nScreenX, nRghtClip } );
+    }
 
-        float fMeanDistance = (curFace.leftCol.fDistFromPlayer_raw + curFace.rghtCol.fDistFromPlayer_raw) / 2.0f;
-        float fShadeFactor = 1.0f - std::min( 1.0f, fMeanDistance / fRenderMaxDist );
+    // warped sprite version
+    // Samples the texture per pixel with the inverse bilinear warp of the quad. Restricts rendering between screen
+    // columns as denoted by nLeftClip and nRghtClip
+    void RenderWallQuad_sprite( FaceInfo &curFace, int nLeftClip, int nRghtClip ) {
+        std::array<olc::vf2d, 4> quadPoints;
+        int nRenderStrt, nRenderStop;
+        GetWarpedQuad( curFace, nLeftClip, nRghtClip, quadPoints, nRenderStrt, nRenderStop );
         // render the quad
-        DrawWarpedSpriteClipped( this, bWireFrameMode ? brickTextureB : brickTexture, quadPoints, nRenderStrt, nRenderStop, fShadeFactor );
+        DrawWarpedSprite( bWireFrameMode ? brickTextureB : brickTexture, quadPoints, nRenderStrt, nRenderStop, GetFaceShade( curFace ), curFace.fLeftU, curFace.fRghtU );
     }
 
-    // Occlusion list stuff [ I could put this in it's own class definition ]
-    // ====================
+    // returns the distance shading of curFace as an 8 bit fraction (256 means: not shaded)
+    uint32_t GetFaceShade( FaceInfo &curFace ) {
+        float fMeanDistance = (curFace.leftCol.fDistFromPlayer_raw + curFace.rghtCol.fDistFromPlayer_raw) / 2.0f;
+        return uint32_t( 256.0f * (1.0f - std::min( 1.0f, fMeanDistance / fRenderMaxDist )));
+    }
 
-    typedef struct sOcclusionRec {
-        int left, rght;
-    } OcclusionRec;
-    typedef std::list<OcclusionRec> OccListType;
-    typedef OccListType::iterator   OccIterType;
+    // applies shade factor nShade (see GetFaceShade()) to the colour channels of p
+    olc::Pixel ShadePixel( olc::Pixel p, uint32_t nShade ) {
+        return olc::Pixel( uint8_t( (p.r * nShade) >> 8 ), uint8_t( (p.g * nShade) >> 8 ), uint8_t( (p.b * nShade) >> 8 ), p.a );
+    }
 
-    OccListType occList;
+    // column based sprite version
+    // Walls are vertical quads, so each screen column of a face maps onto a single column of the texture. The texture
+    // u is worked out once per screen column by interpolating u/z and 1/z (perspective correct), and the texture v is
+    // stepped in fixed point down the column. The rows are worked out in the same way as in RenderWallQuad_mono(), so
+    // this version renders directly into the draw target and clips per column as denoted by the clip arrays of rs
+    void RenderWallQuad_columns( RenderState &rs, FaceInfo &curFace, int nLeftClip, int nRghtClip ) {
+
+        // work out this face's left and right column points
+        olc::vf2d left_upper, left_lower, rght_upper, rght_lower;
+        GetColumnScreenPoints( curFace.leftCol, curFace.fHeight, left_upper, left_lower );
+        GetColumnScreenPoints( curFace.rghtCol, curFace.fHeight, rght_upper, rght_lower );
+        // clip horizontal rendering by the band of rs (which is within the screen boundaries) and clip coordinates
+        int nRenderStrt = std::max( { rs.nBandLeft, curFace.leftCol.nScreenX, nLeftClip } );
+        int nRenderStop = std::min( { rs.nBandRght, curFace.rghtCol.nScreenX, nRghtClip } );
+
+        olc::Sprite *pTexture = bWireFrameMode ? brickTextureB : brickTexture;
+        int nTexW = pTexture->width;
+        int nTexH = pTexture->height;
+        const olc::Pixel *pTexels = pTexture->GetData();
+
+        uint32_t nShade = GetFaceShade( curFace );
+
+        // u runs from fLeftU at the left column to fRghtU at the right column (0.0f to 1.0f unless the face is clipped
+        // by the near plane). Both u/z and 1/z are linear in screen x. They are worked out per column instead of
+        // stepped, so that a column's value doesn't depend on nRenderStrt
+        int   nFaceWidth = curFace.rghtCol.nScreenX - curFace.leftCol.nScreenX;
+        float fInvZLeft  = 1.0f / curFace.leftCol.fDistFromPlayer;
+        float fInvZRght  = 1.0f / curFace.rghtCol.fDistFromPlayer;
+        float fUZLeft    = curFace.fLeftU * fInvZLeft;
+        float fInvZStep  = (nFaceWidth == 0) ? 0.0f : (fInvZRght                  - fInvZLeft) / float( nFaceWidth );
+        float fUZStep    = (nFaceWidth == 0) ? 0.0f : (curFace.fRghtU * fInvZRght - fUZLeft  ) / float( nFaceWidth );
+
+        int64_t nUpper, nUpperStep, nLower, nLowerStep;
+        GetFixedPointEdge( curFace.leftCol.nScreenX, left_upper.y, curFace.rghtCol.nScreenX, rght_upper.y, nRenderStrt, nUpper, nUpperStep );
+        GetFixedPointEdge( curFace.leftCol.nScreenX, left_lower.y, curFace.rghtCol.nScreenX, rght_lower.y, nRenderStrt, nLower, nLowerStep );
+        int nPitch = GetDrawTarget()->width;
+        olc::Pixel *pPixels = GetDrawTarget()->GetData();
+        for (int x = nRenderStrt; x <= nRenderStop; x++) {
+            int nTop = int( std::max( nUpper >> FIXED_SHIFT, int64_t( rs.vClipTop[x] )));
+            int nBot = int( std::min( nLower >> FIXED_SHIFT, int64_t( rs.vClipBot[x] )));
+            if (nTop <= nBot && nLower > nUpper) {
+                // texel column for this screen column
+                float fOffset = float( x - curFace.leftCol.nScreenX );
+                float fInvZ   = fInvZLeft + fInvZStep * fOffset;
+                float fUZ     = fUZLeft   + fUZStep   * fOffset;
+                int nTexX = std::min( nTexW - 1, std::max( 0, int( fUZ / fInvZ * float( nTexW ))));
+                const olc::Pixel *pTexCol = pTexels + nTexX;
+                // texel row (fixed point) at row nTop, and its increment per row. The start row is divided out
+                // directly: for a face very close to the player the column is many times the screen height, and the
+                // rounding error of nVStep would add up over all the rows above the screen
+                int64_t nVStep = (int64_t( nTexH ) << (2 * FIXED_SHIFT)) / (nLower - nUpper);
+                int64_t nV     = std::max( int64_t( 0 ), ((int64_t( nTop ) << FIXED_SHIFT) - nUpper) * (int64_t( nTexH ) << FIXED_SHIFT) / (nLower - nUpper));
+
+                olc::Pixel *pDst = pPixels + nTop * nPitch + x;
+                for (int y = nTop; y <= nBot; y++, pDst += nPitch, nV += nVStep) {
+                    *pDst = ShadePixel( pTexCol[ std::min( nTexH - 1, int( nV >> FIXED_SHIFT )) * nTexW ], nShade );
+                }
+            }
+            nUpper += nUpperStep;
+            nLower += nLowerStep;
+        }
+    }
+
+    // Warped sprite sampling
+    // ======================
+
+    // Function WarpedSample() and the kernels that use it are based on the article by Nathan Reed -
+    // https://www.reedbeta.com/blog/quadrilateral-interpolation-part-2/
+    // Per pixel the quadratic of the inverse bilinear interpolation is solved to find the texture coordinates. There's
+    // a scalar kernel in double precision, and an AVX2 kernel that does 8 pixels at a time in float. DrawWarpedSprite()
+    // picks one of them at run time.
+
+    // holds the four corner points of a quad
+    typedef std::array<olc::vd2d, 4> QuadPointType;
+
+    // returns true if both the CPU and the OS support AVX2
+    bool CPUSupportsAVX2() {
+#if X86_SIMD_KERNELS && defined(_MSC_VER)
+        int vInfo[4];
+        __cpuid( vInfo, 0 );
+        if (vInfo[0] < 7) return false;
+        __cpuid( vInfo, 1 );
+        bool bOSXSave = (vInfo[2] & (1 << 27)) != 0;
+        bool bAVX     = (vInfo[2] & (1 << 28)) != 0;
+        if (!bOSXSave || !bAVX || (_xgetbv( 0 ) & 0x6) != 0x6) return false;
+        __cpuidex( vInfo, 7, 0 );
+        return (vInfo[1] & (1 << 5)) != 0;
+#elif X86_SIMD_KERNELS && defined(__GNUC__)
+        return __builtin_cpu_supports( "avx2" );
+#else
+        return false;
+#endif
+    }
+
+    // Works out the warped sample point uv for input denoted by q, b1, b2 and b3, where q is the pixel relative to the
+    // first corner point, and b1 - b3 are determined once per quad (see GetWarpSetup()).
+    // Returns false if the sample point is outside the [0.0, 1.0] ^2 range
+    bool WarpedSample( olc::vd2d q, olc::vd2d b1, olc::vd2d b2, olc::vd2d b3, olc::vd2d &uv ) {
+        // see the article by Nathan Reed, the "wedge product" appears to be some sort of cross product (?)
+        auto wedge_2d = [=]( olc::vd2d v, olc::vd2d w ) {
+            return v.x * w.y - v.y * w.x;
+        };
+        // Set up quadratic formula
+        double A = wedge_2d( b2, b3 );
+        double B = wedge_2d( b3, q  ) - wedge_2d( b1, b2 );
+        double C = wedge_2d( b1, q  );
+
+        // Solve for v
+        if (fabs( A ) < NEAR_ZERO) {
+            // Linear form
+            if (fabs( B ) < NEAR_ZERO) {
+                return false;
+            }
+            uv.y = -C / B;
+        } else {
+            // Quadratic form: Take positive root for CCW winding with V-up
+            double D = B * B - 4 * A * C;
+            if (D <= 0.0) {         // if discriminant <= 0, then the point is not inside the quad
+                return false;
+            }
+            uv.y = 0.5 * (-B + sqrt( D )) / A;
+        }
+        // Solve for u, using largest magnitude component
+        olc::vd2d denom = b1 + b3 * uv.y;
+        if (fabs( denom.x ) > fabs( denom.y )) {
+            if (fabs( denom.x ) < NEAR_ZERO) {
+                return false;
+            }
+            uv.x = (q.x - b2.x * uv.y) / denom.x;
+        } else {
+            if (fabs( denom.y ) < NEAR_ZERO) {
+                return false;
+            }
+            uv.x = (q.y - b2.y * uv.y) / denom.y;
+        }
+        // return whether sampling produced a valid pixel
+        return (uv.x >= 0.0 && uv.x <  1.0 &&
+                uv.y >  0.0 && uv.y <= 1.0);
+    }
+
+    // Note that the corner points are passed in order: ul, ll, lr, ur, but the WarpedSample() algorithm assumes the
+    // order ll, lr, ul, ur. This rearrangement is done here. Furthermore the values b1 - b3 are worked out, as well as
+    // the range of screen rows that the quad covers
+    void GetWarpSetup( const std::array<olc::vf2d, 4> &cornerPoints, QuadPointType &quad, olc::vd2d &b1, olc::vd2d &b2, olc::vd2d &b3, int &nStrtY, int &nStopY ) {
+        quad = { olc::vd2d( cornerPoints[1] ), olc::vd2d( cornerPoints[2] ), olc::vd2d( cornerPoints[0] ), olc::vd2d( cornerPoints[3] ) };
+        b1 = quad[1] - quad[0];
+        b2 = quad[2] - quad[0];
+        b3 = quad[0] - quad[1] - quad[2] + quad[3];
+
+        double fMinY = quad[0].y, fMaxY = quad[0].y;
+        for (int i = 1; i < 4; i++) {
+            fMinY = std::min( fMinY, quad[i].y );
+            fMaxY = std::max( fMaxY, quad[i].y );
+        }
+        nStrtY = std::max(                  0, int( floor( fMinY )));
+        nStopY = std::min( ScreenHeight() - 1, int( ceil(  fMaxY )));
+    }
+
+    // scalar kernel - renders pSprite warped into the quad denoted by cornerPoints, between screen columns nClipLeft
+    // and nClipRight, and applies shade factor nShade. The left and right side of the quad get texture u fLeftU resp.
+    // fRghtU
+    void DrawWarpedSprite_scalar( olc::Sprite *pSprite, const std::array<olc::vf2d, 4> &cornerPoints, int nClipLeft, int nClipRight, uint32_t nShade, float fLeftU, float fRghtU ) {
+        QuadPointType quad;
+        olc::vd2d b1, b2, b3;
+        int nStrtY, nStopY;
+        GetWarpSetup( cornerPoints, quad, b1, b2, b3, nStrtY, nStopY );
+
+        int nPitch = GetDrawTarget()->width;
+        olc::Pixel *pPixels = GetDrawTarget()->GetData();
+        for (int y = nStrtY; y <= nStopY; y++) {
+            olc::Pixel *pRow = pPixels + y * nPitch;
+            for (int x = nClipLeft; x <= nClipRight; x++) {
+                // render pixel if sampling produces valid pixel
+                olc::vd2d uv;
+                if (WarpedSample( olc::vd2d( x, y ) - quad[0], b1, b2, b3, uv )) {
+                    // Note that vertical texel coord is mirrored because the algorithm assumes positive y to go up
+                    pRow[x] = ShadePixel( pSprite->Sample( fLeftU + (fRghtU - fLeftU) * float( uv.x ), float( 1.0 - uv.y )), nShade );
+                }
+            }
+        }
+    }
+
+#if X86_SIMD_KERNELS
+    // AVX2 kernel - same as DrawWarpedSprite_scalar(), but evaluates 8 pixels of a row at a time in float. The pixels
+    // that are inside the quad (and within the clip range) form a mask, that is used both for gathering the texels
+    // and for storing the shaded pixels
+    TARGET_AVX2 void DrawWarpedSprite_avx2( olc::Sprite *pSprite, const std::array<olc::vf2d, 4> &cornerPoints, int nClipLeft, int nClipRight, uint32_t nShade, float fLeftU, float fRghtU ) {
+        QuadPointType quad;
+        olc::vd2d b1, b2, b3;
+        int nStrtY, nStopY;
+        GetWarpSetup( cornerPoints, quad, b1, b2, b3, nStrtY, nStopY );
+
+        // the coefficients of the quadratic that don't depend on the pixel
+        double A    = b2.x * b3.y - b2.y * b3.x;
+        double B12  = b1.x * b2.y - b1.y * b2.x;
+        bool bLinear = fabs( A ) < NEAR_ZERO;
+
+        const __m256  vZero    = _mm256_setzero_ps();
+        const __m256  vOne     = _mm256_set1_ps( 1.0f );
+        const __m256  vEps     = _mm256_set1_ps( float( NEAR_ZERO ));
+        const __m256  vAbsMask = _mm256_castsi256_ps( _mm256_set1_epi32( 0x7FFFFFFF ));
+        const __m256  vLanes   = _mm256_setr_ps( 0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f );
+        const __m256i vLanesI  = _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 );
+        const __m256  vB1x = _mm256_set1_ps( float( b1.x )), vB1y = _mm256_set1_ps( float( b1.y ));
+        const __m256  vB2x = _mm256_set1_ps( float( b2.x )), vB2y = _mm256_set1_ps( float( b2.y ));
+        const __m256  vB3x = _mm256_set1_ps( float( b3.x )), vB3y = _mm256_set1_ps( float( b3.y ));
+        const __m256  v4A      = _mm256_set1_ps( float( 4.0 * A ));
+        const __m256  vHalfInvA = _mm256_set1_ps( bLinear ? 0.0f : float( 0.5 / A ));
+
+        const int *pTexels = (const int *)pSprite->GetData();
+        const __m256  vTexW   = _mm256_set1_ps( float( pSprite->width  ));
+        const __m256  vLeftU  = _mm256_set1_ps( fLeftU );
+        const __m256  vRangeU = _mm256_set1_ps( fRghtU - fLeftU );
+        const __m256  vTexH   = _mm256_set1_ps( float( pSprite->height ));
+        const __m256i vTexWi  = _mm256_set1_epi32( pSprite->width );
+        const __m256i vMaxTx  = _mm256_set1_epi32( pSprite->width  - 1 );
+        const __m256i vMaxTy  = _mm256_set1_epi32( pSprite->height - 1 );
+        const __m256i vShade  = _mm256_set1_epi16( int16_t( nShade ));
+        const __m256i vMaskRB = _mm256_set1_epi32( 0x00FF00FF );
+        const __m256i vMaskG  = _mm256_set1_epi32( 0x0000FF00 );
+        const __m256i vMaskA  = _mm256_set1_epi32( int( 0xFF000000 ));
+
+        int nPitch = GetDrawTarget()->width;
+        int *pPixels = (int *)GetDrawTarget()->GetData();
+        for (int y = nStrtY; y <= nStopY; y++) {
+            // q.y and the parts of B and C that only depend on it
+            float fQy = float( double( y ) - quad[0].y );
+            const __m256 vQy = _mm256_set1_ps( fQy );
+            const __m256 vBy = _mm256_set1_ps( float( b3.x * fQy - B12 ));
+            const __m256 vCy = _mm256_set1_ps( float( b1.x * fQy ));
+            int *pRow = pPixels + y * nPitch;
+
+            for (int x = nClipLeft; x <= nClipRight; x += 8) {
+                __m256 vQx = _mm256_add_ps( _mm256_set1_ps( float( double( x ) - quad[0].x )), vLanes );
+                __m256 vB  = _mm256_fnmadd_ps( vB3y, vQx, vBy );
+                __m256 vC  = _mm256_fnmadd_ps( vB1y, vQx, vCy );
+
+                // solve for v
+                __m256 vV, vValid;
+                if (bLinear) {
+                    vValid = _mm256_cmp_ps( _mm256_and_ps( vB, vAbsMask ), vEps, _CMP_GE_OQ );
+                    vV     = _mm256_div_ps( _mm256_sub_ps( vZero, vC ), vB );
+                } else {
+                    __m256 vD = _mm256_fmsub_ps( vB, vB, _mm256_mul_ps( v4A, vC ));
+                    vValid = _mm256_cmp_ps( vD, vZero, _CMP_GT_OQ );
+                    vV     = _mm256_mul_ps( _mm256_sub_ps( _mm256_sqrt_ps( _mm256_max_ps( vD, vZero )), vB ), vHalfInvA );
+                }
+                // solve for u, using largest magnitude component
+                __m256 vDenomX = _mm256_fmadd_ps( vB3x, vV, vB1x );
+                __m256 vDenomY = _mm256_fmadd_ps( vB3y, vV, vB1y );
+                __m256 vUseX   = _mm256_cmp_ps( _mm256_and_ps( vDenomX, vAbsMask ), _mm256_and_ps( vDenomY, vAbsMask ), _CMP_GT_OQ );
+                __m256 vDenom  = _mm256_blendv_ps( vDenomY, vDenomX, vUseX );
+                __m256 vNumer  = _mm256_blendv_ps( _mm256_fnmadd_ps( vB2y, vV, vQy ), _mm256_fnmadd_ps( vB2x, vV, vQx ), vUseX );
+                vValid = _mm256_and_ps( vValid, _mm256_cmp_ps( _mm256_and_ps( vDenom, vAbsMask ), vEps, _CMP_GE_OQ ));
+                __m256 vU = _mm256_div_ps( vNumer, vDenom );
+
+                // inside the quad and within the clip range
+                vValid = _mm256_and_ps( vValid, _mm256_cmp_ps( vU, vZero, _CMP_GE_OQ ));
+                vValid = _mm256_and_ps( vValid, _mm256_cmp_ps( vU, vOne , _CMP_LT_OQ ));
+                vValid = _mm256_and_ps( vValid, _mm256_cmp_ps( vV, vZero, _CMP_GT_OQ ));
+                vValid = _mm256_and_ps( vValid, _mm256_cmp_ps( vV, vOne , _CMP_LE_OQ ));
+                __m256i vMask = _mm256_and_si256( _mm256_castps_si256( vValid ),
+                                                  _mm256_cmpgt_epi32( _mm256_set1_epi32( nClipRight + 1 - x ), vLanesI ));
+                if (_mm256_testz_si256( vMask, vMask )) continue;
+
+                // gather texels - vertical texel coord is mirrored, see DrawWarpedSprite_scalar()
+                __m256  vTexU = _mm256_fmadd_ps( vU, vRangeU, vLeftU );
+                __m256i vTx = _mm256_min_epi32( _mm256_cvttps_epi32( _mm256_mul_ps( vTexU, vTexW )), vMaxTx );
+                __m256i vTy = _mm256_min_epi32( _mm256_cvttps_epi32( _mm256_mul_ps( _mm256_sub_ps( vOne, vV ), vTexH )), vMaxTy );
+                __m256i vIndex = _mm256_add_epi32( _mm256_mullo_epi32( vTy, vTexWi ), vTx );
+                __m256i vTexel = _mm256_mask_i32gather_epi32( _mm256_setzero_si256(), pTexels, vIndex, vMask, 4 );
+
+                // shade the colour channels in the same way as ShadePixel() - r and b resp. g in 16 bit lanes
+                __m256i vRB = _mm256_srli_epi16( _mm256_mullo_epi16( _mm256_and_si256( vTexel, vMaskRB ), vShade ), 8 );
+                __m256i vG  = _mm256_and_si256( _mm256_mullo_epi16( _mm256_and_si256( _mm256_srli_epi32( vTexel, 8 ), vMaskRB ), vShade ), vMaskG );
+                __m256i vResult = _mm256_or_si256( _mm256_or_si256( vRB, vG ), _mm256_and_si256( vTexel, vMaskA ));
+
+                _mm256_maskstore_epi32( pRow + x, vMask, vResult );
+            }
+        }
+    }
+#endif
+
+    // renders pSprite warped into the quad denoted by cornerPoints (in the order ul, ll, lr, ur), between screen columns
+    // nClipLeft and nClipRight, and applies shade factor nShade. The texture u runs from fLeftU at the left side of the
+    // quad to fRghtU at its right side. Uses the AVX2 kernel if it's available
+    void DrawWarpedSprite( olc::Sprite *pSprite, const std::array<olc::vf2d, 4> &cornerPoints, int nClipLeft, int nClipRight, uint32_t nShade, float fLeftU, float fRghtU ) {
+#if X86_SIMD_KERNELS
+        if (bUseAVX2) {
+            DrawWarpedSprite_avx2( pSprite, cornerPoints, nClipLeft, nClipRight, nShade, fLeftU, fRghtU );
+            return;
+        }
+#endif
+        DrawWarpedSprite_scalar( pSprite, cornerPoints, nClipLeft, nClipRight, nShade, fLeftU, fRghtU );
+    }
+
+    // Occlusion list stuff [ I could put this in it's own class definition ]
+    // ====================
+
+    typedef struct sOcclusionRec {
+        int left, rght;
+    } OcclusionRec;
+    typedef std::list<OcclusionRec> OccListType;
+    typedef OccListType::iterator   OccIterType;
 
     // output occlusion list to screen (for debugging)
     void PrintOccList( OccListType &lst, const std::string &sMsg = "" ) {
@@ -894,6 +3622,14 @@ public:
     // processing more faces can be stopped)
     int SizeOccList( OccListType &lst ) { return (int)lst.size(); }
 
+    // returns true if the range [nLeft, nRght] is completely contained in one of the elements of the list
+    bool RangeOccluded( OccListType &lst, int nLeft, int nRght ) {
+        for (OccIterType iter = lst.begin(); iter != lst.end() && (*iter).left <= nLeft; iter++) {
+            if (nRght <= (*iter).rght) return true;
+        }
+        return false;
+    }
+
     // returns true if this occlusion rec should be (partially) rendered. If so, nClipLeft and nClipRght denote
     // clipping values
     // PRECONDITION: the list contains at least two elements, and the extreme values for these elements are
@@ -1011,186 +3747,2691 @@ public:
         return nClipLeft <= nClipRght;
     }
 
-    bool OnUserUpdate( float fElapsedTime ) override {
+    // Like InsertOccList() above, but instead of only the first non occluded part of rec, ALL non occluded parts of
+    // rec are put in vVisible (from left to right). Returns true if vVisible is not empty.
+    // The whole range of rec is merged into the list, unless bMerge is false (for faces that don't occlude everything
+    // behind them)
+    // PRECONDITION: see InsertOccList() above
+    bool InsertOccList( OccListType &lst, OcclusionRec &rec, std::vector<OcclusionRec> &vVisible, bool bMerge = true ) {
+        vVisible.clear();
+        if (rec.left > rec.rght) return false;
 
-        bTestMode = false;
+        // 1. skip the elements that are completely left of rec, and remember the last one that is adjacent to it
+        OccIterType iter = lst.begin();
+        while ((*iter).rght < rec.left - 1) iter++;
+        OccIterType iterMerge = iter;
+        if ((*iter).rght < rec.left) iter++;
+
+        // 2. collect the gaps between the elements that overlap rec
+        int nCol = rec.left;
+        for ( ; (*iter).left <= rec.rght; iter++) {
+            if ((*iter).left > nCol) vVisible.push_back( { nCol, (*iter).left - 1 } );
+            if ((*iter).rght >= rec.rght) break;
+            nCol = std::max( nCol, (*iter).rght + 1 );
+        }
+        if (iter == lst.end() || (*iter).left > rec.rght) {
+            // the loop ran into the first element to the right of rec, so the last gap extends to the end of rec
+            if (nCol <= rec.rght) vVisible.push_back( { nCol, rec.rght } );
+        }
+        if (vVisible.empty() || !bMerge) return !vVisible.empty();
 
-        // step 1 - user input
-        // ===================
+        // 3. MERGE rec into the list: either INSERT it as a new element, or EXTEND the first element that overlaps
+        //    (or is adjacent to) rec, and ERASE the following elements that are absorbed by it
+        if ((*iterMerge).left > rec.rght + 1) {
+            lst.insert( iterMerge, rec );
+        } else {
+            (*iterMerge).left = std::min( (*iterMerge).left, rec.left );
+            (*iterMerge).rght = std::max( (*iterMerge).rght, rec.rght );
+            OccIterType iterNext = std::next( iterMerge );
+            while (iterNext != lst.end() && (*iterNext).left - 1 <= (*iterMerge).rght) {
+                (*iterMerge).rght = std::max( (*iterMerge).rght, (*iterNext).rght );
+                iterNext = lst.erase( iterNext );
+            }
+        }
+        return true;
+    }
 
-        // factor to speed up or slow down
-        float fSpeedUp = 1.0f;
-        if (GetKey( olc::Key::SHIFT ).bHeld) fSpeedUp *= 4.00f;
-        if (GetKey( olc::Key::CTRL  ).bHeld) fSpeedUp *= 0.10f;
+    // Occlusion span buffer
+    // =====================
+
+    // The span buffer is an alternative for the occlusion list with the same semantics. The occluded intervals are
+    // kept sorted in a contiguous array that is allocated once, so there are no heap allocations per frame, and the
+    // insertion point is found with a binary search instead of by walking the list.
+    // Just like the list, the buffer is initialised with two boundary elements left and right outside the screen.
+    // Since the intervals are disjoint and non adjacent, there can never be more than ScreenWidth() / 2 + 3 of them.
+    typedef struct sOccSpanBuffer {
+        std::vector<OcclusionRec> vSpans;
+        int nSize = 0;
+    } OccSpanBuffer;
+
+    // output span buffer to screen (for debugging)
+    void PrintOccList( OccSpanBuffer &buf, const std::string &sMsg = "" ) {
+        if (sMsg.length() > 0) {
+            std::cout << sMsg << std::endl;
+        }
+        for (int i = 0; i < buf.nSize; i++) {
+            std::cout << "[ " << (buf.vSpans[i].left == INT_MIN ? "INT_MIN" : std::to_string( buf.vSpans[i].left ));
+            std::cout << ", " << (buf.vSpans[i].rght == INT_MAX ? "INT_MAX" : std::to_string( buf.vSpans[i].rght ));
+            std::cout << " ], ";
+        }
+        std::cout << std::endl;
+    }
 
-        // little lambda to keep derived var's sync'd with fPlayerA_deg
-        auto sync_angle_vars = [&]() {
-            fPlayerA_deg = Mod360_deg( fPlayerA_deg );
-            fPlayerA_rad = Deg2Rad(    fPlayerA_deg );
-            fPlayerSin   = sin(        fPlayerA_rad );
-            fPlayerCos   = cos(        fPlayerA_rad );
-        };
+    // Initialises the span buffer with the two extreme elements left and right outside screen boundaries
+    // The array is only (re)allocated if it is too small for the current screen width
+    void InitOccList( OccSpanBuffer &buf ) {
+        int nCapacity = ScreenWidth() / 2 + 3;
+        if ((int)buf.vSpans.size() < nCapacity) {
+            buf.vSpans.resize( nCapacity );
+        }
+        buf.vSpans[0] = {       INT_MIN,      -1 };   // non visible intervals on the left and right
+        buf.vSpans[1] = { ScreenWidth(), INT_MAX };   // of the screen
+        buf.nSize = 2;
+    }
 
-        // rotate, and keep player angle in [0, 360) range. This should be the only place in the code
-        // where fPlayerA_deg is altered - keep derived var's sync'd
-        if (GetKey( olc::D ).bHeld) { fPlayerA_deg += fSpeedUp * SPEED_ROTATE * fElapsedTime; sync_angle_vars(); }
-        if (GetKey( olc::A ).bHeld) { fPlayerA_deg -= fSpeedUp * SPEED_ROTATE * fElapsedTime; sync_angle_vars(); }
+    // if the size of the span buffer becomes 1, the screen is totally occluded
+    int SizeOccList( OccSpanBuffer &buf ) { return buf.nSize; }
 
-        // temporary placeholders for (possible) new player location
-        float fNewX = fPlayerX;
-        float fNewY = fPlayerY;
+    // returns the index of the first interval in the buffer that has its right value >= nCol
+    // PRECONDITION: the last element has right value INT_MAX, so the result is always a valid index
+    int FindSpanIndex( OccSpanBuffer &buf, int nCol ) {
+        int lo = 0, hi = buf.nSize - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (buf.vSpans[mid].rght < nCol) lo = mid + 1; else hi = mid;
+        }
+        return lo;
+    }
 
-        float fCDMargin = 0.25f;   // collision detection margin (in cells)
-        // variables to aid in collision detection check
-        float fCheckX;
-        float fCheckY;
+    // returns true if the range [nLeft, nRght] is completely contained in one of the intervals of the buffer
+    bool RangeOccluded( OccSpanBuffer &buf, int nLeft, int nRght ) {
+        OcclusionRec &span = buf.vSpans[ FindSpanIndex( buf, nLeft ) ];
+        return span.left <= nLeft && nRght <= span.rght;
+    }
 
-        // walk forward - collision detection checked
-        if (GetKey( olc::W ).bHeld) {
-            fNewX += fPlayerCos * fSpeedUp * SPEED_MOVE * fElapsedTime;
-            fNewY += fPlayerSin * fSpeedUp * SPEED_MOVE * fElapsedTime;
-            fCheckX = fNewX + fPlayerCos * fCDMargin;
-            fCheckY = fNewY + fPlayerSin * fCDMargin;
+    // returns true if this occlusion rec should be (partially) rendered. If so, nClipLeft and nClipRght denote
+    // clipping values. Like the list version, the clip values denote the first non occluded part of rec, and the whole
+    // range of rec is merged into the buffer.
+    // PRECONDITION: InitOccList() was called, and SizeOccList() > 1
+    bool InsertOccList( OccSpanBuffer &buf, OcclusionRec &rec, int &nClipLeft, int &nClipRght ) {
+        std::vector<OcclusionRec> &spans = buf.vSpans;
+
+        // an empty (or flipped) record occludes nothing
+        if (rec.left > rec.rght) {
+            nClipLeft = -1;
+            nClipRght = -2;
+            return false;
         }
-        // walk backwards - collision detection checked
-        if (GetKey( olc::S ).bHeld) {
-            fNewX -= fPlayerCos * fSpeedUp * SPEED_MOVE * fElapsedTime;
-            fNewY -= fPlayerSin * fSpeedUp * SPEED_MOVE * fElapsedTime;
-            fCheckX = fNewX - fPlayerCos * fCDMargin;
-            fCheckY = fNewY - fPlayerSin * fCDMargin;
+
+        // 1. find first interval that overlaps with or is adjacent to rec, or lies to the right of it
+        int i = FindSpanIndex( buf, rec.left - 1 );
+
+        if (spans[i].left > rec.rght + 1) {
+            // 2a. rec lies in the gap before interval i: INSERT it by shifting the tail of the array one position
+            std::copy_backward( spans.begin() + i, spans.begin() + buf.nSize, spans.begin() + buf.nSize + 1 );
+            spans[i] = rec;
+            buf.nSize += 1;
+            nClipLeft = rec.left;
+            nClipRght = rec.rght;
+            return true;
         }
-        // strafe left - collision detection checked
-        if (GetKey( olc::Q ).bHeld) {
-            fNewX += fPlayerSin * fSpeedUp * SPEED_STRAFE * fElapsedTime;
-            fNewY -= fPlayerCos * fSpeedUp * SPEED_STRAFE * fElapsedTime;
-            fCheckX = fNewX + fPlayerSin * fCDMargin;
-            fCheckY = fNewY - fPlayerCos * fCDMargin;
+
+        if (spans[i].left <= rec.left && rec.rght <= spans[i].rght) {
+            // 2b. rec is completely within interval i, so it's fully occluded
+            nClipLeft = -1;
+            nClipRght = -2;
+            return false;
         }
-        // strafe right - collision detection checked
-        if (GetKey( olc::E ).bHeld) {
-            fNewX -= fPlayerSin * fSpeedUp * SPEED_STRAFE * fElapsedTime;
-            fNewY += fPlayerCos * fSpeedUp * SPEED_STRAFE * fElapsedTime;
-            fCheckX = fNewX - fPlayerSin * fCDMargin;
-            fCheckY = fNewY + fPlayerCos * fCDMargin;
+
+        // 2c. rec overlaps (or is adjacent to) intervals i through j: find j, the last interval with its left value
+        //     not beyond the right value of rec
+        int j = i;
+        while (j + 1 < buf.nSize && spans[j + 1].left <= rec.rght + 1) j++;
+
+        // 3. the first non occluded part of rec is either before interval i, or right after it
+        if (spans[i].left > rec.left) {
+            nClipLeft = rec.left;
+            nClipRght = spans[i].left - 1;
+        } else {
+            nClipLeft = spans[i].rght + 1;
+            nClipRght = (j > i) ? spans[i + 1].left - 1 : rec.rght;
         }
-        // collision detection - check if out of bounds or inside occupied tile
-        if (fCheckX >= 0 && fCheckX < nMapX &&
-            fCheckY >= 0 && fCheckY < nMapY &&
-            sMap[ int( fCheckY ) * nMapX + int( fCheckX ) ] != '#') {
-            fPlayerX = fNewX;
-            fPlayerY = fNewY;
+        nClipRght = std::min( nClipRght, rec.rght );
+
+        // 4. MERGE rec and intervals i through j into interval i, and ERASE the others by shifting the tail
+        spans[i].left = std::min( spans[i].left, rec.left );
+        spans[i].rght = std::max( spans[j].rght, rec.rght );
+        if (j > i) {
+            std::copy( spans.begin() + j + 1, spans.begin() + buf.nSize, spans.begin() + i + 1 );
+            buf.nSize -= (j - i);
         }
-        // toggle raster flags
-        if (GetKey( olc::Key::V ).bPressed) bVerRasterMode = !bVerRasterMode;
-        if (GetKey( olc::Key::H ).bPressed) bHorRasterMode = !bHorRasterMode;
-        // toggle textured / monochrome rendering flag
-        if (GetKey( olc::Key::R ).bPressed) nTextureMode = (nTextureMode + 1) % 3;
-        // toggle wire frame (icw monochrome) rendering flag
-        if (GetKey( olc::Key::B ).bPressed) bWireFrameMode = !bWireFrameMode;
-        // toggle map flag
-        if (GetKey( olc::Key::M ).bPressed) bMapMode = !bMapMode;
-        // toggle info on screen flag
-        if (GetKey( olc::Key::I ).bPressed) bInfoMode = !bInfoMode;
-        // manipulate map scale
-        if (GetKey( olc::NP_ADD ).bHeld) fMapScale += 1.0f * fElapsedTime;
-        if (GetKey( olc::NP_SUB ).bHeld) fMapScale -= 1.0f * fElapsedTime;
+        return nClipLeft <= nClipRght;
+    }
 
-        // step 2 - game logic
-        // ===================
+    // Like InsertOccList() above, but instead of only the first non occluded part of rec, ALL non occluded parts of
+    // rec are put in vVisible (from left to right). Returns true if vVisible is not empty.
+    // If bMerge is false, rec is not merged into the buffer
+    // PRECONDITION: InitOccList() was called, and SizeOccList() > 1
+    bool InsertOccList( OccSpanBuffer &buf, OcclusionRec &rec, std::vector<OcclusionRec> &vVisible, bool bMerge = true ) {
+        std::vector<OcclusionRec> &spans = buf.vSpans;
+        vVisible.clear();
+        if (rec.left > rec.rght) return false;
+
+        // 1. find first interval that overlaps with or is adjacent to rec, or lies to the right of it
+        int i = FindSpanIndex( buf, rec.left - 1 );
+
+        // 2. collect the gaps between the intervals that overlap rec, and find j, the last interval with its left
+        //    value not beyond the right value of rec (+ 1 for adjacency)
+        int nCol = rec.left;
+        int j = i;
+        for (int k = (spans[i].rght < rec.left) ? i + 1 : i; spans[k].left <= rec.rght; k++) {
+            if (spans[k].left > nCol) vVisible.push_back( { nCol, spans[k].left - 1 } );
+            if (spans[k].rght >= rec.rght) { nCol = INT_MAX; break; }
+            nCol = spans[k].rght + 1;
+        }
+        if (nCol <= rec.rght) vVisible.push_back( { nCol, rec.rght } );
+        if (vVisible.empty() || !bMerge) return !vVisible.empty();
+
+        if (spans[i].left > rec.rght + 1) {
+            // 3a. rec lies in the gap before interval i: INSERT it by shifting the tail of the array one position
+            std::copy_backward( spans.begin() + i, spans.begin() + buf.nSize, spans.begin() + buf.nSize + 1 );
+            spans[i] = rec;
+            buf.nSize += 1;
+        } else {
+            // 3b. MERGE rec and intervals i through j into interval i, and ERASE the others by shifting the tail
+            while (j + 1 < buf.nSize && spans[j + 1].left <= rec.rght + 1) j++;
+            spans[i].left = std::min( spans[i].left, rec.left );
+            spans[i].rght = std::max( spans[j].rght, rec.rght );
+            if (j > i) {
+                std::copy( spans.begin() + j + 1, spans.begin() + buf.nSize, spans.begin() + i + 1 );
+                buf.nSize -= (j - i);
+            }
+        }
+        return true;
+    }
 
-        // step 3a - render logic
-        // ======================
+    // Occlusion bitmask
+    // =================
+
+    // The bitmask is another alternative for the occlusion list with the same semantics. Each screen column has one
+    // bit, that is set if the column is occluded. Inserting a range sets the bits word by word, and the first non
+    // occluded column is found by skipping full words (several words at a time with SSE2, or with AVX2 if the CPU
+    // supports it) and counting the trailing zeros of the first word that is not full.
+    // NOTE: the bitmask is not faster than the list. The faces in the fly through are wide (on average 630 of 1400
+    // columns) and few of them are needed to fill the screen, so the list stays short, while the bitmask touches every
+    // word of a face. With --bench-occlusion the bitmask takes about 1.5x as long per insert as the list, and the
+    // AVX2 kernel doesn't measurably beat the SSE2 one at 22 words per screen row.
+    // There's always at least one padding bit beyond the last screen column. The padding bits are set, so they act
+    // like the right boundary element of the list, and every search for a set bit is guaranteed to succeed.
+    typedef struct sOccBitmask {
+        std::vector<uint64_t> vWords;
+        int nWords = 0;    // nr of 64 bit words in use
+        int nCols  = 0;    // nr of screen columns
+        int nFull  = 0;    // nr of words that have all bits set - if this equals nWords, the screen is fully occluded
+    } OccBitmask;
+
+    // returns the index of the lowest set bit of n
+    // PRECONDITION: n != 0
+    int CountTrailingZeros( uint64_t n ) {
+#if defined(_MSC_VER)
+        unsigned long nIndex;
+        _BitScanForward64( &nIndex, n );
+        return int( nIndex );
+#else
+        return __builtin_ctzll( n );
+#endif
+    }
 
-        // collect all tiles that are visible (i.e. who have at least one
-        // face column within the players FoV) in the global tiles to render list
-        vTilesToRender.clear();
-        GetVisibleTiles( vTilesToRender );
+    // returns the nr of set bits in n
+    int CountSetBits( uint64_t n ) {
+#if defined(_MSC_VER)
+        return int( __popcnt64( n ));
+#else
+        return __builtin_popcountll( n );
+#endif
+    }
 
-        // from the visible tiles list, analyse which of the faces are potentially
-        // visible for the player. This faces to render list is sorted from close by to far away
-        vFacesToRender.clear();
-        GetVisibleFaces( vTilesToRender, vFacesToRender );
+#if X86_SIMD_KERNELS
+    // returns the first index >= w of the words that differ from nSkip, comparing two words at a time - or the index
+    // where fewer than two words are left before nWords. Equal 64 bit words have equal 32 bit halves, so SSE2 suffices
+    TARGET_SSE2 int SkipWords_sse( const uint64_t *pWords, int w, int nWords, uint64_t nSkip ) {
+        __m128i vSkip = _mm_set1_epi64x( (long long)nSkip );
+        while (w + 2 <= nWords &&
+               _mm_movemask_epi8( _mm_cmpeq_epi32( _mm_loadu_si128( (const __m128i *)(pWords + w) ), vSkip )) == 0xFFFF) {
+            w += 2;
+        }
+        return w;
+    }
 
-        // test output
-        if (GetKey( olc::Key::T ).bPressed) { bTestMode = true; }
-        if (bTestMode) {
-            PrintTilesList( vTilesToRender );
-            PrintFacesList( vFacesToRender );
+    // same, four words at a time
+    TARGET_AVX2 int SkipWords_avx2( const uint64_t *pWords, int w, int nWords, uint64_t nSkip ) {
+        __m256i vSkip = _mm256_set1_epi64x( (long long)nSkip );
+        while (w + 4 <= nWords &&
+               _mm256_movemask_epi8( _mm256_cmpeq_epi64( _mm256_loadu_si256( (const __m256i *)(pWords + w) ), vSkip )) == -1) {
+            w += 4;
+        }
+        return w;
+    }
+#endif
+
+    // returns the first column >= nFrom whose bit equals bSet, or nWords * 64 if there's no such column
+    int FindFirstBit( OccBitmask &buf, int nFrom, bool bSet ) {
+        const uint64_t *pWords = buf.vWords.data();
+        uint64_t nFlip = bSet ? 0 : ~uint64_t( 0 );    // xor-ing with this turns the bits that are searched for into 1's
+
+        int w = nFrom >> 6;
+        uint64_t nWord = (pWords[w] ^ nFlip) & (~uint64_t( 0 ) << (nFrom & 63));
+        while (nWord == 0) {
+            w += 1;
+            // skip the words that don't contain any of the bits searched for - these are equal to nFlip
+#if X86_SIMD_KERNELS
+            w = bUseAVX2 ? SkipWords_avx2( pWords, w, buf.nWords, nFlip ) : SkipWords_sse( pWords, w, buf.nWords, nFlip );
+#endif
+            if (w >= buf.nWords) return buf.nWords * 64;
+            nWord = pWords[w] ^ nFlip;
         }
+        return w * 64 + CountTrailingZeros( nWord );
+    }
 
-        // step 3b - render
-        // ================
+    // sets the bits for columns [nLeft, nRght] and keeps the nr of full words up to date
+    // PRECONDITION: 0 <= nLeft <= nRght < nCols
+    void SetBits( OccBitmask &buf, int nLeft, int nRght ) {
+        int wLeft = nLeft >> 6;
+        int wRght = nRght >> 6;
+        for (int w = wLeft; w <= wRght; w++) {
+            uint64_t nMask = ~uint64_t( 0 );
+            if (w == wLeft) nMask &= ~uint64_t( 0 ) << (nLeft & 63);
+            if (w == wRght) nMask &= ~uint64_t( 0 ) >> (63 - (nRght & 63));
+            if (buf.vWords[w] != ~uint64_t( 0 )) {
+                buf.vWords[w] |= nMask;
+                if (buf.vWords[w] == ~uint64_t( 0 )) buf.nFull += 1;
+            }
+        }
+    }
 
-        SetDrawTarget( nLayerBG );
-        DrawDecal( { 0.0f, 0.0f }, pDecalBG );
+    // output bitmask to screen (for debugging) - in the same format as the list
+    void PrintOccList( OccBitmask &buf, const std::string &sMsg = "" ) {
+        if (sMsg.length() > 0) {
+            std::cout << sMsg << std::endl;
+        }
+        std::cout << "[ INT_MIN, ";
+        int nCol = FindFirstBit( buf, 0, false );
+        while (nCol < buf.nCols) {
+            std::cout << nCol - 1 << " ], ";
+            nCol = FindFirstBit( buf, nCol, true );
+            std::cout << "[ " << nCol << ", ";
+            nCol = FindFirstBit( buf, nCol, false );
+        }
+        std::cout << "INT_MAX ], " << std::endl;
+    }
 
-        SetDrawTarget( nLayerScene );
-        Clear( olc::BLANK );  // Use blank to keep the background layer visible
+    // Initialises the bitmask with all screen columns free, and the padding bits set
+    void InitOccList( OccBitmask &buf ) {
+        buf.nCols  = ScreenWidth();
+        buf.nWords = buf.nCols / 64 + 1;
+        buf.vWords.assign( buf.nWords, 0 );
+        buf.vWords[ buf.nWords - 1 ] = ~uint64_t( 0 ) << (buf.nCols & 63);
+        // if the screen width is a multiple of 64, the last word consists of padding bits only
+        buf.nFull  = (buf.nCols & 63) == 0 ? 1 : 0;
+    }
 
-        // iterate over visible faces list - use the occlusion list approach to determine whether
-        // faces are (partly) occluded, and draw them as quads
+    // returns the nr of elements the occlusion list would have for the same occluded columns. Like for the list, a
+    // size of 1 means that the screen is totally occluded
+    int SizeOccList( OccBitmask &buf ) {
+        if (buf.nFull == buf.nWords) return 1;
+        // count the runs of set bits. The left boundary element is the run before column 0, the right boundary
+        // element is in the padding bits
+        int nResult = 1;
+        uint64_t nPrevBit = 1;
+        for (int w = 0; w < buf.nWords; w++) {
+            uint64_t nWord = buf.vWords[w];
+            nResult += CountSetBits( nWord & ~((nWord << 1) | nPrevBit) );
+            nPrevBit = nWord >> 63;
+        }
+        return nResult;
+    }
+
+    // returns true if the range [nLeft, nRght] is completely occluded
+    bool RangeOccluded( OccBitmask &buf, int nLeft, int nRght ) {
+        nLeft = std::max( nLeft, 0 );
+        nRght = std::min( nRght, buf.nCols - 1 );
+        return nLeft > nRght || FindFirstBit( buf, nLeft, false ) > nRght;
+    }
+
+    // returns true if this occlusion rec should be (partially) rendered. If so, nClipLeft and nClipRght denote
+    // clipping values - the first run of non occluded columns within rec. The whole range of rec is set as occluded.
+    // PRECONDITION: InitOccList() was called
+    bool InsertOccList( OccBitmask &buf, OcclusionRec &rec, int &nClipLeft, int &nClipRght ) {
+        // the parts of rec outside the screen are occluded by definition
+        int nLeft = std::max( rec.left, 0 );
+        int nRght = std::min( rec.rght, buf.nCols - 1 );
+        nClipLeft = (nLeft > nRght) ? INT_MAX : FindFirstBit( buf, nLeft, false );
+        if (nClipLeft > nRght) {
+            nClipLeft = -1;
+            nClipRght = -2;
+            return false;
+        }
+        nClipRght = std::min( nRght, FindFirstBit( buf, nClipLeft, true ) - 1 );
+        SetBits( buf, nLeft, nRght );
+        return true;
+    }
+
+    // Like InsertOccList() above, but instead of only the first non occluded part of rec, ALL non occluded parts of
+    // rec are put in vVisible (from left to right). Returns true if vVisible is not empty.
+    // If bMerge is false, the bits for rec are not set
+    // PRECONDITION: InitOccList() was called
+    bool InsertOccList( OccBitmask &buf, OcclusionRec &rec, std::vector<OcclusionRec> &vVisible, bool bMerge = true ) {
+        vVisible.clear();
+        int nLeft = std::max( rec.left, 0 );
+        int nRght = std::min( rec.rght, buf.nCols - 1 );
+        if (nLeft > nRght) return false;
+
+        // alternately search for the start of the next run of free columns and for its end
+        int nCol = FindFirstBit( buf, nLeft, false );
+        while (nCol <= nRght) {
+            int nEnd = FindFirstBit( buf, nCol, true );
+            vVisible.push_back( { nCol, std::min( nRght, nEnd - 1 ) } );
+            nCol = (nEnd > nRght) ? nEnd : FindFirstBit( buf, nEnd, false );
+        }
+        if (vVisible.empty() || !bMerge) return !vVisible.empty();
+
+        SetBits( buf, nLeft, nRght );
+        return true;
+    }
+
+    // returns true if all of the screen columns are occluded - one overload per occlusion structure
+    bool FullyOccluded( OccListType   &lst ) { return SizeOccList( lst ) <= 1; }
+    bool FullyOccluded( OccSpanBuffer &buf ) { return SizeOccList( buf ) <= 1; }
+    bool FullyOccluded( OccBitmask    &buf ) { return buf.nFull == buf.nWords; }
+
+    // Vertical clip arrays
+    // ====================
+
+    // The occlusion structures only know whether a screen column is completely occluded or not. Faces that are lower
+    // than a full cell only occlude a part of the columns they cover, so they are not merged into the occlusion
+    // structure. Instead, like in Doom, the range of rows that is still free is kept per screen column: vClipTop holds
+    // the first free row and vClipBot the last free row. Faces that are rendered later are clipped to this range.
+    // When a column has no free rows left, it's merged into the occlusion structure after all.
+    // The clip arrays are part of the render state.
+    // NOTE: vClipTop would be narrowed by geometry that hangs from the ceiling, which the map doesn't have (yet)
+
+    void InitClipArrays( RenderState &rs ) {
+        rs.vClipTop.assign( ScreenWidth(), 0 );
+        rs.vClipBot.assign( ScreenWidth(), int16_t( ScreenHeight() - 1 ));
+    }
+
+    // narrows the clip ranges of the screen columns [nLeft, nRght] by the rows that curFace covers in them. The
+    // columns that have no free rows left are appended to rs.vClosedSpans
+    void UpdateClipArrays( RenderState &rs, FaceInfo &curFace, int nLeft, int nRght ) {
+        olc::vf2d left_upper, left_lower, rght_upper, rght_lower;
+        GetColumnScreenPoints( curFace.leftCol, curFace.fHeight, left_upper, left_lower );
+        GetColumnScreenPoints( curFace.rghtCol, curFace.fHeight, rght_upper, rght_lower );
+
+        nLeft = std::max( { nLeft,                 0, curFace.leftCol.nScreenX } );
+        nRght = std::min( { nRght, ScreenWidth() - 1, curFace.rghtCol.nScreenX } );
+        // work out the rows the face is rendered in, in the same way as RenderWallQuad_mono() does
+        int64_t nUpper, nUpperStep, nLower, nLowerStep;
+        GetFixedPointEdge( curFace.leftCol.nScreenX, left_upper.y, curFace.rghtCol.nScreenX, rght_upper.y, nLeft, nUpper, nUpperStep );
+        GetFixedPointEdge( curFace.leftCol.nScreenX, left_lower.y, curFace.rghtCol.nScreenX, rght_lower.y, nLeft, nLower, nLowerStep );
+        for (int x = nLeft; x <= nRght; x++, nUpper += nUpperStep, nLower += nLowerStep) {
+            int y_upper = int( std::max( nUpper >> FIXED_SHIFT, int64_t( rs.vClipTop[x] )));
+            int y_lower = int( std::min( nLower >> FIXED_SHIFT, int64_t( rs.vClipBot[x] )));
+            if (y_upper > y_lower) continue;
+
+            // all faces stand on the floor, so everything below the upper side of the face is either the face itself
+            // or floor in front of it - geometry behind the face can only show above it
+            rs.vClipBot[x] = int16_t( y_upper - 1 );
+            if (rs.vClipTop[x] > rs.vClipBot[x]) {
+                if (!rs.vClosedSpans.empty() && rs.vClosedSpans.back().rght == x - 1) {
+                    rs.vClosedSpans.back().rght = x;
+                } else {
+                    rs.vClosedSpans.push_back( { x, x } );
+                }
+            }
+        }
+    }
+
+    // Render state
+    // ============
+
+    // The warped sprite and decal renderers can't clip per screen column, so in these modes the quads are collected during
+    // the (front to back) processing of the faces, and rendered back to front afterwards. This way faces that are
+    // lower than a full cell are drawn over the faces behind them.
+    typedef struct sRenderCommand {
+        FaceInfo face;
+        int nLeftClip, nRghtClip;
+    } RenderCommand;
+
+    // In portal visibility mode the faces behind a portal are only rendered within the screen columns of the portal
+    typedef struct sColumnWindow {
+        int  nLeft, nRght;
+        bool bOpenLeft, bOpenRght;     // the boundary is a portal end in open space, so the faces continue beyond it
+    } ColumnWindow;
+
+    // In job mode the visible spans of the faces that can be clipped per column are not rendered right away. Instead
+    // the clip ranges of their columns are copied, and they are cut into quad jobs of at most JOB_COLUMNS columns
+    // (see RenderQuadJobs())
+    typedef struct sQuadSpan {
+        FaceInfo face;
+        int nLeftClip, nRghtClip;      // the visible span of the face
+        int nFirstCol;                 // the first column of the span that is rendered
+        int nClipIndex;                // index of the clip range of column nFirstCol in vSpanClipTop and vSpanClipBot
+    } QuadSpan;
+
+    typedef struct sQuadJob {
+        int nSpan;                     // index in vQuadSpans
+        int nLeft, nRght;              // the columns of the span that are rendered by this job
+    } QuadJob;
+
+    // Everything that changes while the faces of a frame are processed. Normally a single render state covers the
+    // whole screen, but in band mode every band of screen columns has a render state of its own (see RenderBands())
+    struct sRenderState {
+        int nBandLeft = 0;                              // the range of screen columns that is rendered into
+        int nBandRght = 0;
+        OccListType   occList;                          // occlusion structures - only the one that is selected with
+        OccSpanBuffer occSpans;                         // nOcclusionMode is used
+        OccBitmask    occBits;
+        std::vector<int16_t> vClipTop, vClipBot;        // vertical clip range per screen column
+        std::vector<OcclusionRec> vVisibleSpans;        // non occluded parts of the current face - kept to prevent allocations
+        std::vector<OcclusionRec> vClosedSpans;         // columns that were fully occluded by the current face
+        std::vector<RenderCommand> vDeferredQuads;      // see RenderDeferredQuads()
+        std::vector<int> vRenderedFaces;                // band mode: indices in vFacesToRender of the rendered faces
+        bool bQueueJobs = false;                        // job mode: queue the visible spans instead of rendering them
+        std::vector<QuadSpan> vQuadSpans;               // job mode: see QueueQuadJobs()
+        std::vector<QuadJob>  vQuadJobs;
+        std::vector<int16_t>  vSpanClipTop, vSpanClipBot;
+        double fOcclusion = 0.0;                        // time spent in the occlusion structure resp. rendering quads
+        double fRaster    = 0.0;
+        int nFacesRendered = 0;
+    };
+
+    RenderState mainState;    // render state for single threaded rendering - covers the whole screen
+
+    // Occlusion backend selection
+    // ===========================
 
-        if (bTestMode) PrintOccList( occList, "Before InitOccList()" );
+    // these functions pass the call on to the occlusion structure that is selected with nOcclusionMode
 
-        InitOccList( occList );
+    // initialises the occlusion structure and the clip arrays of render state rs. If rs covers only a band of the
+    // screen, the columns outside the band (and its margins) are occluded up front
+    void InitOcclusion( RenderState &rs ) {
+        switch (nOcclusionMode) {
+            case OCC_LIST   : InitOccList( rs.occList  ); break;
+            case OCC_SPANS  : InitOccList( rs.occSpans ); break;
+            case OCC_BITMASK: InitOccList( rs.occBits  ); break;
+        }
+        InitClipArrays( rs );
+
+        OcclusionRec outsideLeft = {                            0, rs.nBandLeft - BAND_MARGIN - 1 };
+        OcclusionRec outsideRght = { rs.nBandRght + BAND_MARGIN + 1,             ScreenWidth() - 1 };
+        if (outsideLeft.left <= outsideLeft.rght) InsertOcclusion( rs, outsideLeft, rs.vVisibleSpans );
+        if (outsideRght.left <= outsideRght.rght) InsertOcclusion( rs, outsideRght, rs.vVisibleSpans );
+
+        rs.vDeferredQuads.clear();
+        rs.vRenderedFaces.clear();
+        rs.vQuadSpans.clear();
+        rs.vQuadJobs.clear();
+        rs.vSpanClipTop.clear();
+        rs.vSpanClipBot.clear();
+        rs.fOcclusion = 0.0;
+        rs.fRaster    = 0.0;
+        rs.nFacesRendered = 0;
+    }
+
+    bool InsertOcclusion( RenderState &rs, OcclusionRec &rec, std::vector<OcclusionRec> &vVisible, bool bMerge = true ) {
+        switch (nOcclusionMode) {
+            case OCC_LIST   : return InsertOccList( rs.occList , rec, vVisible, bMerge );
+            case OCC_SPANS  : return InsertOccList( rs.occSpans, rec, vVisible, bMerge );
+            case OCC_BITMASK: return InsertOccList( rs.occBits , rec, vVisible, bMerge );
+        }
+        return false;
+    }
+
+    int SizeOcclusion( RenderState &rs ) {
+        switch (nOcclusionMode) {
+            case OCC_LIST   : return SizeOccList( rs.occList  );
+            case OCC_SPANS  : return SizeOccList( rs.occSpans );
+            case OCC_BITMASK: return SizeOccList( rs.occBits  );
+        }
+        return 0;
+    }
+
+    bool ScreenOccluded( RenderState &rs ) {
+        switch (nOcclusionMode) {
+            case OCC_LIST   : return FullyOccluded( rs.occList  );
+            case OCC_SPANS  : return FullyOccluded( rs.occSpans );
+            case OCC_BITMASK: return FullyOccluded( rs.occBits  );
+        }
+        return true;
+    }
+
+    bool ColumnsOccluded( RenderState &rs, int nLeft, int nRght ) {
+        switch (nOcclusionMode) {
+            case OCC_LIST   : return RangeOccluded( rs.occList , nLeft, nRght );
+            case OCC_SPANS  : return RangeOccluded( rs.occSpans, nLeft, nRght );
+            case OCC_BITMASK: return RangeOccluded( rs.occBits , nLeft, nRght );
+        }
+        return false;
+    }
 
-        if (bTestMode) PrintOccList( occList, "After InitOccList()" );
+    void PrintOcclusion( RenderState &rs, const std::string &sMsg ) {
+        switch (nOcclusionMode) {
+            case OCC_LIST   : PrintOccList( rs.occList , sMsg ); break;
+            case OCC_SPANS  : PrintOccList( rs.occSpans, sMsg ); break;
+            case OCC_BITMASK: PrintOccList( rs.occBits , sMsg ); break;
+        }
+    }
 
-        nFacesRendered = 0;
-        for (int i = 0; i < (int)vFacesToRender.size() && (int)SizeOccList( occList ) > 1; i++) {
-            FaceInfo &curFace = vFacesToRender[i];
+    // renders the deferred quads of render state rs back to front, restricted to the columns of rs
+    void RenderDeferredQuads( RenderState &rs ) {
+        for (int i = (int)rs.vDeferredQuads.size() - 1; i >= 0; i--) {
+            RenderCommand &cmd = rs.vDeferredQuads[i];
+            int nLeftClip = std::max( cmd.nLeftClip, rs.nBandLeft );
+            int nRghtClip = std::min( cmd.nRghtClip, rs.nBandRght );
+            if (nLeftClip > nRghtClip) continue;
+
+            switch (nTextureMode) {
+                case SPRITE: RenderWallQuad_sprite( cmd.face, nLeftClip, nRghtClip ); break;
+                case DECAL : RenderWallQuad_decal(  cmd.face, nLeftClip, nRghtClip ); break;
+            }
+        }
+        rs.vDeferredQuads.clear();
+    }
 
-            OcclusionRec occRec = { curFace.leftCol.nScreenX, curFace.rghtCol.nScreenX };
-            int nClipLt, nClipRt;
+    // uses the selected occlusion structure of rs to determine whether curFace is (partly) occluded, and if not renders
+    // the visible parts of it as quads - one per non occluded span. Returns whether (a part of) the face was rendered
+    // If pWindow is given, only the columns within it are processed (see Portal visibility)
+    bool RenderFaceOccluded( RenderState &rs, FaceInfo &curFace, const ColumnWindow *pWindow = nullptr ) {
 
-            if (bTestMode) PrintOccList( occList, "Before InsertOccList()" );
-            if (bTestMode) std::cout << "Occ.record contains - left: " << occRec.left << ", right: " << occRec.rght << std::endl;
+        int nWinLeft = (pWindow == nullptr) ? INT_MIN : pWindow->nLeft;
+        int nWinRght = (pWindow == nullptr) ? INT_MAX : pWindow->nRght;
+        OcclusionRec occRec = { std::max( curFace.leftCol.nScreenX, nWinLeft ), std::min( curFace.rghtCol.nScreenX, nWinRght ) };
+        // a face of full cell height occludes everything behind it. Lower faces only narrow the vertical clip ranges
+        bool bSolid = curFace.fHeight >= 1.0f;
 
-            bool bInsertResult = InsertOccList( occList, occRec, nClipLt, nClipRt );
+        if (bTestMode) PrintOcclusion( rs, "Before InsertOccList()" );
+        if (bTestMode) std::cout << "Occ.record contains - left: " << occRec.left << ", right: " << occRec.rght << std::endl;
 
-            if (bTestMode) PrintOccList( occList, "After InsertOccList()" );
-            if (bTestMode) std::cout << "Call returned: " << (bInsertResult ? "TRUE ," : "FALSE,") << "clip values - left: " << nClipLt << ", right: " << nClipRt << std::endl;
+        BenchClock::time_point tStart = BenchClock::now();
+        bool bInsertResult = InsertOcclusion( rs, occRec, rs.vVisibleSpans, bSolid );
+        rs.fOcclusion += MicrosSince( tStart );
 
-            if (bInsertResult) {
+        if (bTestMode) PrintOcclusion( rs, "After InsertOccList()" );
+        if (bTestMode) {
+            std::cout << "Call returned: " << (bInsertResult ? "TRUE ," : "FALSE,") << "visible spans: ";
+            for (auto &span : rs.vVisibleSpans) std::cout << "[ " << span.left << ", " << span.rght << " ], ";
+            std::cout << std::endl;
+        }
 
-                // (at least a part of this) face is visible (not occluded) so render that part
-                switch (nTextureMode) {
-                    case MONO  : RenderWallQuad_mono(   curFace, nClipLt, nClipRt ); break;
-                    case SPRITE: RenderWallQuad_sprite( curFace, nClipLt, nClipRt ); break;
-                    case DECAL : RenderWallQuad_decal(  curFace, nClipLt, nClipRt ); break;
+        if (bInsertResult) {
+
+            // (at least a part of this) face is visible (not occluded) so render those parts. A wall segment is rendered
+            // (or queued) per tile face, so the queued quads don't depend on the player state
+            // At an open boundary of the window the face continues in the neighbouring window, so the span mustn't get
+            // a wire frame edge there. In that case the span is rendered by narrowing the band of rs to it, and the
+            // clip range is widened. Both windows contain the column of the boundary, so the span may start one column
+            // further
+            tStart = BenchClock::now();
+            int nBandLeft = rs.nBandLeft, nBandRght = rs.nBandRght;
+            for (auto &span : rs.vVisibleSpans) {
+                bool bOpenLeft = (pWindow != nullptr && pWindow->bOpenLeft && span.left <= nWinLeft + 1);
+                bool bOpenRght = (pWindow != nullptr && pWindow->bOpenRght && span.rght >= nWinRght - 1);
+                int nSpanLeft = bOpenLeft ? INT_MIN : span.left;
+                int nSpanRght = bOpenRght ? INT_MAX : span.rght;
+                rs.nBandLeft = std::max( nBandLeft, span.left );
+                rs.nBandRght = std::min( nBandRght, span.rght );
+                ForEachFacePiece( curFace, nSpanLeft, nSpanRght, rs.nBandLeft, rs.nBandRght, [&]( FaceInfo &piece, int nLeft, int nRght ) {
+                    if (rs.bQueueJobs && (nTextureMode == MONO || (nTextureMode == SPRITE && nSamplerMode == SMP_COLUMNS))) {
+                        QueueQuadJobs( rs, piece, nLeft, nRght );
+                    } else if (nTextureMode == MONO) {
+                        RenderWallQuad_mono( rs, piece, nLeft, nRght );
+                    } else if (nTextureMode == SPRITE && nSamplerMode == SMP_COLUMNS) {
+                        RenderWallQuad_columns( rs, piece, nLeft, nRght );
+                    } else {
+                        rs.vDeferredQuads.push_back( { piece, std::max( nLeft, rs.nBandLeft ), std::min( nRght, rs.nBandRght ) } );
+                    }
+                } );
+            }
+            rs.nBandLeft = nBandLeft;
+            rs.nBandRght = nBandRght;
+            rs.fRaster += MicrosSince( tStart );
+
+            if (!bSolid) {
+                // narrow the clip ranges, and merge the columns that got fully occluded into the occlusion structure
+                tStart = BenchClock::now();
+                rs.vClosedSpans.clear();
+                for (auto &span : rs.vVisibleSpans) {
+                    ForEachFacePiece( curFace, span.left, span.rght, span.left, span.rght, [&]( FaceInfo &piece, int nLeft, int nRght ) {
+                        UpdateClipArrays( rs, piece, nLeft, nRght );
+                    } );
+                }
+                for (auto &span : rs.vClosedSpans) {
+                    InsertOcclusion( rs, span, rs.vVisibleSpans );
                 }
-                nFacesRendered += 1;
+                rs.fOcclusion += MicrosSince( tStart );
             }
+            rs.nFacesRendered += 1;
         }
+        return bInsertResult;
+    }
 
-        SetDrawTarget( nLayerHUD );
-        Clear( olc::BLANK );
+    // Band rendering
+    // ==============
+
+    // In band mode the screen is split into vertical bands of screen columns, that are rendered in parallel by the
+    // worker pool. Every band has a render state of its own, and processes the complete sorted faces list. Since the
+    // columns outside the band are occluded up front, a band is done as soon as its own columns are occluded.
+    // A screen column is only affected by the faces that cover it, so every column gets the same pixels as in single
+    // threaded rendering. The render state of a band keeps track of BAND_MARGIN columns on either side of the band
+    // (without rendering them), so that visible spans that cross the band boundary are clipped in the same way as well.
+    // NOTE: band mode needs the sorted faces list, and the decals are rendered by the GPU, so frontier visibility mode
+    //       and DECAL texture mode are always single threaded
+    WorkerPool workerPool;
+    std::vector<RenderState> vBandStates;
+    std::vector<uint8_t> vFaceRendered;    // per face in vFacesToRender: rendered by any of the bands
+
+    // per worker statistics of the last parallel rendering in this frame - empty if the frame was single threaded
+    std::vector<WorkerPool::WorkerStats> vWorkerStats;
+    double fWorkerMicros = 0.0;            // wall clock time of that parallel rendering
+
+    bool BandModeActive() {
+        return nRenderThreads > 1 && nParallelMode == PAR_BANDS && nVisibilityMode == VIS_SORTED && nTextureMode != DECAL && !bTestMode;
+    }
 
-        // render optional horizontal and/or vertical raster lines (for testing)
-        RenderRaster( bHorRasterMode, bVerRasterMode );
+    // (re)starts the worker pool if the nr of render threads was changed
+    void PrepareWorkerPool() {
+        if (workerPool.Size() != nRenderThreads) {
+            workerPool.Start( nRenderThreads );
+        }
+    }
 
-        if (bMapMode) {
-            // render minimap (for debugging) and player in it
-            olc::vi2d position = { 50, 50 };
-            RenderMiniMap( position, fMapScale );
+    // copies the statistics of the last batch of the worker pool, for reporting
+    void CollectWorkerStats() {
+        vWorkerStats.clear();
+        for (int w = 0; w < workerPool.GetStatsCount(); w++) {
+            vWorkerStats.push_back( workerPool.GetStats( w ));
         }
+        fWorkerMicros = workerPool.GetBatchMicros();
+    }
 
-        if (bInfoMode) {
-            // render player values for debugging
-            RenderPlayerInfo( { ScreenWidth() / 2 -  75, 10 } );
-            // render characteristics on rendering algorithm
-            RenderDebugInfo(  { ScreenWidth()     - 200, 10 } );
+    void RenderBands() {
+        PrepareWorkerPool();
+        CacheSegmentCorners( vFacesToRender );
+        int nBands = std::min( ScreenWidth(), nRenderThreads * BANDS_PER_THREAD );
+        vBandStates.resize( nBands );
+        for (int b = 0; b < nBands; b++) {
+            vBandStates[b].nBandLeft = ScreenWidth() *  b      / nBands;
+            vBandStates[b].nBandRght = ScreenWidth() * (b + 1) / nBands - 1;
         }
 
+        workerPool.Run( nBands, [&]( int b, int ) {
+            RenderState &rs = vBandStates[b];
+            InitOcclusion( rs );
+            for (int i = 0; i < (int)vFacesToRender.size() && !ScreenOccluded( rs ); i++) {
+                if (RenderFaceOccluded( rs, vFacesToRender[i] )) {
+                    rs.vRenderedFaces.push_back( i );
+                }
+            }
+            BenchClock::time_point tStart = BenchClock::now();
+            RenderDeferredQuads( rs );
+            rs.fRaster += MicrosSince( tStart );
+        } );
+
+        // a face can be rendered by more than one band, so count the distinct faces
+        vFaceRendered.assign( vFacesToRender.size(), 0 );
+        for (auto &rs : vBandStates) {
+            curTimings.fOcclusion += rs.fOcclusion;
+            curTimings.fRaster    += rs.fRaster;
+            for (int i : rs.vRenderedFaces) vFaceRendered[i] = 1;
+        }
+        nFacesRendered = (int)std::count( vFaceRendered.begin(), vFaceRendered.end(), 1 );
+        CollectWorkerStats();
+    }
+
+    // Quad jobs
+    // =========
+
+    // In job mode the faces are processed single threaded, so the occlusion structure and the clip arrays are only
+    // kept once. The visible spans that can be clipped per column (MONO texture mode, and SPRITE texture mode with the
+    // columns sampler) are queued instead of rendered, together with a copy of the clip ranges of their columns at that
+    // moment. Each span is cut into jobs of at most JOB_COLUMNS columns, and after all faces are processed the jobs are
+    // rendered by the worker pool. A nearby face covers many more columns (and rows) than a distant one, so the cost
+    // of the jobs differs a lot - the work stealing of the pool keeps all workers busy.
+    // Different spans never write the same pixels (each one is clipped to the rows that were still free), so the jobs
+    // can be rendered in any order and the output is identical to single threaded rendering.
+    // NOTE: unlike band mode, job mode works for frontier visibility mode as well. The quads of the warped sampler are
+    //       deferred and rendered single threaded as before
+    std::vector<RenderState> vWorkerStates;    // per worker: the clip ranges and band of the job it is rendering
+
+    bool JobModeActive() {
+        return nRenderThreads > 1 && nParallelMode == PAR_JOBS && nTextureMode != DECAL && !bTestMode;
+    }
+
+    // queues the span [nLeftClip, nRghtClip] of curFace, and cuts it into quad jobs
+    void QueueQuadJobs( RenderState &rs, FaceInfo &curFace, int nLeftClip, int nRghtClip ) {
+        // the columns that are actually rendered - see RenderWallQuad_mono()
+        int nLeft = std::max( {                 0, curFace.leftCol.nScreenX, nLeftClip, rs.nBandLeft } );
+        int nRght = std::min( { ScreenWidth() - 1, curFace.rghtCol.nScreenX, nRghtClip, rs.nBandRght } );
+        if (nLeft > nRght) return;
+
+        int nSpan = (int)rs.vQuadSpans.size();
+        rs.vQuadSpans.push_back( { curFace, nLeftClip, nRghtClip, nLeft, (int)rs.vSpanClipTop.size() } );
+        rs.vSpanClipTop.insert( rs.vSpanClipTop.end(), rs.vClipTop.begin() + nLeft, rs.vClipTop.begin() + nRght + 1 );
+        rs.vSpanClipBot.insert( rs.vSpanClipBot.end(), rs.vClipBot.begin() + nLeft, rs.vClipBot.begin() + nRght + 1 );
+        for (int x = nLeft; x <= nRght; x += JOB_COLUMNS) {
+            rs.vQuadJobs.push_back( { nSpan, x, std::min( nRght, x + JOB_COLUMNS - 1 ) } );
+        }
+    }
+
+    // renders the queued quad jobs of rs with the worker pool. The time spent in the jobs is added to the raster time
+    void RenderQuadJobs( RenderState &rs ) {
+        PrepareWorkerPool();
+        vWorkerStates.resize( workerPool.Size() );
+        for (auto &ws : vWorkerStates) {
+            if ((int)ws.vClipTop.size() != ScreenWidth()) InitClipArrays( ws );
+        }
+
+        workerPool.Run( (int)rs.vQuadJobs.size(), [&]( int j, int w ) {
+            QuadJob  &job  = rs.vQuadJobs[j];
+            QuadSpan &span = rs.vQuadSpans[ job.nSpan ];
+            RenderState &ws = vWorkerStates[w];
+            // restrict the worker's render state to the columns of the job, and restore their clip ranges
+            ws.nBandLeft = job.nLeft;
+            ws.nBandRght = job.nRght;
+            std::copy_n( rs.vSpanClipTop.begin() + span.nClipIndex + (job.nLeft - span.nFirstCol), job.nRght - job.nLeft + 1, ws.vClipTop.begin() + job.nLeft );
+            std::copy_n( rs.vSpanClipBot.begin() + span.nClipIndex + (job.nLeft - span.nFirstCol), job.nRght - job.nLeft + 1, ws.vClipBot.begin() + job.nLeft );
+
+            if (nTextureMode == MONO) {
+                RenderWallQuad_mono(    ws, span.face, span.nLeftClip, span.nRghtClip );
+            } else {
+                RenderWallQuad_columns( ws, span.face, span.nLeftClip, span.nRghtClip );
+            }
+        } );
+
+        CollectWorkerStats();
+        for (auto &stats : vWorkerStats) {
+            rs.fRaster += stats.fBusy;
+        }
+    }
+
+    // Front to back grid traversal
+    // ============================
+
+    // An entry for the priority queue of the front to back traversal is either an empty cell that must be expanded
+    // (nFace == UNKNWN), or a face of a non empty cell that must be rendered
+    typedef struct sTraversalEntry {
+        float fSqrDist;            // squared distance from player to the nearest point of the cell or face (= sort key)
+        int   nTileX, nTileY;
+        int   nFace;
+    } TraversalEntry;
+
+    std::vector<TraversalEntry> vTraversalHeap;    // kept as class variable to prevent allocations per frame
+    std::vector<int> vCellStamp;                   // a cell is visited in this frame if its stamp equals nTraversalStamp
+    int nTraversalStamp = 0;
+    int nCellsVisited   = 0;
+
+    // returns the squared distance from the player to the nearest point of the axis aligned rectangle (x0, y0)-(x1, y1)
+    // NOTE: works for horizontal or vertical line segments as well
+    float GetSqrDistance_PlayerToRect( float x0, float y0, float x1, float y1 ) {
+        float dx = std::max( { x0 - fPlayerX, 0.0f, fPlayerX - x1 } );
+        float dy = std::max( { y0 - fPlayerY, 0.0f, fPlayerY - y1 } );
+        return dx * dx + dy * dy;
+    }
+
+    // returns true if the cell at (nTileX, nTileY) overlaps the FoV triangle tri (see GetFoVTriangle())
+    bool CellInFoVTriangle( olc::vf2d tri[3], int nTileX, int nTileY ) {
+        float fMinX, fMaxX;
+        return GetSlabExtent( tri, float( nTileY ), float( nTileY + 1 ), fMinX, fMaxX ) &&
+               fMaxX >= float( nTileX ) && fMinX <= float( nTileX + 1 );
+    }
+
+    // returns true if the screen columns that the cell at (nTileX, nTileY) projects onto are all occluded
+    // Cells that are (partly) beside or behind the player are never considered occluded
+    bool CellOccluded( RenderState &rs, int nTileX, int nTileY ) {
+        // as long as only the two boundary elements are in the list, nothing on screen is occluded
+        if (SizeOcclusion( rs ) <= 2) return false;
+
+        int nMinCol = INT_MAX;
+        int nMaxCol = INT_MIN;
+        for (int f = EAST; f <= NORTH; f++) {
+            olc::vf2d corner = GetColumnCoordinates( nTileX, nTileY, f, true );
+            // distance of the corner along the looking direction of the player
+            float fDepth = (corner.x - fPlayerX) * fPlayerCos + (corner.y - fPlayerY) * fPlayerSin;
+            if (fDepth < 0.1f) return false;
+
+            int nCol = GetColumnProjection( GetAngle_PlayerToLocation( corner ));
+            nMinCol = std::min( nMinCol, nCol );
+            nMaxCol = std::max( nMaxCol, nCol );
+        }
+        return ColumnsOccluded( rs, nMinCol, nMaxCol );
+    }
+
+    // Renders the scene by walking the grid outward from the player's cell, through empty (or lower than full height) cells
+    // that overlap the FoV.
+    // The entries are processed in order of distance, using a priority queue. When an empty cell is expanded, the
+    // faces of its non empty neighbours that are directed towards it are queued, so faces come out of the queue front
+    // to back and are fed directly into the occlusion list - no sorting of a faces list is needed.
+    // Cells whose projection is already fully occluded are not expanded, and the traversal stops as soon as the
+    // screen is fully occluded, so geometry behind nearby walls is never visited.
+    // The faces that are met are appended to vFaces, and the nr of cells that are expanded is added to nCells
+    void RenderFrontToBack( RenderState &rs, std::vector<FaceInfo> &vFaces, int &nCells ) {
+        if ((int)vCellStamp.size() != nMapX * nMapY) {
+            vCellStamp.assign( nMapX * nMapY, 0 );
+        }
+        nTraversalStamp += 1;
+        vTraversalHeap.clear();
+
+        // min heap on distance. For equal distances, expand cells before rendering faces
+        auto heap_order = []( const TraversalEntry &a, const TraversalEntry &b ) {
+            if (a.fSqrDist != b.fSqrDist) return a.fSqrDist > b.fSqrDist;
+            return a.nFace < b.nFace;
+        };
+        auto push_entry = [&]( float fSqrDist, int nTileX, int nTileY, int nFace ) {
+            vTraversalHeap.push_back( { fSqrDist, nTileX, nTileY, nFace } );
+            std::push_heap( vTraversalHeap.begin(), vTraversalHeap.end(), heap_order );
+        };
+
+        // the traversal starts at the cell of the player
+        int nPlayerTileX = int( fPlayerX );
+        int nPlayerTileY = int( fPlayerY );
+        if (!InBetween( nPlayerTileX, 0, nMapX - 1 ) || !InBetween( nPlayerTileY, 0, nMapY - 1 ) ||
+            sMap[ nPlayerTileY * nMapX + nPlayerTileX ] != '.') {
+            return;
+        }
+        vCellStamp[ nPlayerTileY * nMapX + nPlayerTileX ] = nTraversalStamp;
+        push_entry( 0.0f, nPlayerTileX, nPlayerTileY, UNKNWN );
+
+        olc::vf2d tri[3];
+        GetFoVTriangle( tri );
+
+        while (!vTraversalHeap.empty() && !ScreenOccluded( rs )) {
+            std::pop_heap( vTraversalHeap.begin(), vTraversalHeap.end(), heap_order );
+            TraversalEntry cur = vTraversalHeap.back();
+            vTraversalHeap.pop_back();
+
+            if (cur.nFace != UNKNWN) {
+                // a face - render it if it's visible
+                if (FaceVisible( cur.nTileX, cur.nTileY, cur.nFace )) {
+                    FaceInfo curFace;
+                    BuildFaceInfo( cur.nTileX, cur.nTileY, cur.nFace, curFace );
+                    if (curFace.bVisible) {
+                        vFaces.push_back( curFace );
+                        RenderFaceOccluded( rs, curFace );
+                    }
+                }
+            } else if (cur.fSqrDist == 0.0f || !CellOccluded( rs, cur.nTileX, cur.nTileY )) {
+                // an empty cell that is not occluded yet - expand it
+                nCells += 1;
+                for (int f = EAST; f <= NORTH; f++) {
+                    int nx = cur.nTileX + (f == EAST  ? 1 : (f == WEST  ? -1 : 0));
+                    int ny = cur.nTileY + (f == SOUTH ? 1 : (f == NORTH ? -1 : 0));
+                    if (!InBetween( nx, 0, nMapX - 1 ) || !InBetween( ny, 0, nMapY - 1 )) continue;
+
+                    if (sMap[ ny * nMapX + nx ] != '.') {
+                        // the face of the neighbour that is directed towards the current cell is the opposite one
+                        int nFace = (f + 2) % 4;
+                        olc::vf2d p1 = GetColumnCoordinates( nx, ny, nFace, true  );
+                        olc::vf2d p2 = GetColumnCoordinates( nx, ny, nFace, false );
+                        push_entry( GetSqrDistance_PlayerToRect( std::min( p1.x, p2.x ), std::min( p1.y, p2.y ),
+                                                                 std::max( p1.x, p2.x ), std::max( p1.y, p2.y )), nx, ny, nFace );
+                    }
+                    // the view extends over cells that are lower than full height, so these are expanded as well
+                    if (GetCellHeight( nx, ny ) < 1.0f && vCellStamp[ ny * nMapX + nx ] != nTraversalStamp) {
+                        // a cell is queued at most once per frame, and only if it overlaps the FoV
+                        vCellStamp[ ny * nMapX + nx ] = nTraversalStamp;
+                        if (CellInFoVTriangle( tri, nx, ny )) {
+                            push_entry( GetSqrDistance_PlayerToRect( float( nx ), float( ny ), float( nx + 1 ), float( ny + 1 )), nx, ny, UNKNWN );
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // BSP visibility
+    // ==============
+
+    // Ordering the faces on their mean distance is a heuristic, that can go wrong for long or diagonally adjacent
+    // faces. In BSP mode the order comes from a BSP tree over the wall segments instead, which is exact for any player
+    // position. All faces lie on grid lines, so the splitters are grid lines as well: a node splits the plane on the
+    // line x = nSplit or y = nSplit. The segments that lie on the splitter are kept in the node, and the ones that
+    // cross it are split at a tile boundary, so every fragment of a segment is a run of its tile faces.
+    // Rendering the side of the player first, then the fragments on the splitter, and then the other side, yields the
+    // faces front to back. Subtrees that don't overlap the FoV triangle, or whose screen columns are already occluded,
+    // are skipped, and the traversal stops as soon as the screen is fully occluded.
+    // The tree only depends on the map, so it's compiled when the map is set up. For large maps it can be saved to and
+    // loaded from file (see --bsp-file).
+    typedef struct sBspFragment {
+        int nSegment;            // wall segment (see BuildWallSegments())
+        int nFirst, nLength;     // run of tile faces within the segment
+    } BspFragment;
+
+    typedef struct sBspNode {
+        int nAxis;               // 0: the splitter is the line x = nSplit, 1: the line y = nSplit
+        int nSplit;
+        int nLow, nHigh;         // child nodes at the side of the lower resp. higher coordinates, -1 if empty
+        int nFirstFrag, nFrags;  // the fragments that lie on the splitter: [nFirstFrag, nFirstFrag + nFrags) of vFrags
+        int nMinX, nMinY;        // bounding box of the tiles of all fragments in the subtree
+        int nMaxX, nMaxY;
+    } BspNode;
+
+    typedef struct sBspTree {
+        std::vector<BspNode>     vNodes;
+        std::vector<BspFragment> vFrags;
+        int nRoot = -1;
+    } BspTree;
+
+    BspTree bspTree;
+    std::string sBspFile;        // if not empty, the BSP tree is loaded from (or saved to) this file
+
+    // works out the grid line that fragment frag lies on (nAxis and nCoord as in BspNode)
+    void GetBspFragmentLine( const BspFragment &frag, int &nAxis, int &nCoord ) {
+        const FaceTable &ft = faceTable;
+        int f = ft.vSegFirst[frag.nSegment];
+        switch (ft.vSide[f]) {
+            case EAST : nAxis = 0; nCoord = ft.vTileX[f] + 1; break;
+            case WEST : nAxis = 0; nCoord = ft.vTileX[f];     break;
+            case SOUTH: nAxis = 1; nCoord = ft.vTileY[f] + 1; break;
+            case NORTH:
+            default   : nAxis = 1; nCoord = ft.vTileY[f];     break;   // (a face has no other sides)
+        }
+    }
+
+    // returns the tile of the face at position nPos of the wall segment of frag
+    olc::vi2d GetBspFragmentTile( const BspFragment &frag, int nPos ) {
+        const FaceTable &ft = faceTable;
+        int f = ft.vSegFirst[frag.nSegment];
+        return olc::vi2d( ft.vTileX[f], ft.vTileY[f] ) + GetFaceTileStep( ft.vSide[f] ) * nPos;
+    }
+
+    // classifies frag against the splitter line nAxis = nSplit: returns -1 if it's completely at the low side, +1 if
+    // it's completely at the high side and 0 if it lies on the splitter. If it crosses the splitter 2 is returned, and
+    // the parts at the low and high side are put in lowPart and highPart
+    int ClassifyBspFragment( const BspFragment &frag, int nAxis, int nSplit, BspFragment &lowPart, BspFragment &highPart ) {
+        int nFragAxis, nCoord;
+        GetBspFragmentLine( frag, nFragAxis, nCoord );
+        if (nFragAxis == nAxis) {
+            return (nCoord < nSplit) ? -1 : ((nCoord > nSplit) ? 1 : 0);
+        }
+        // the fragment is perpendicular to the splitter - a tile is at the low side if its coordinate is below nSplit
+        int nEnd  = frag.nFirst + frag.nLength;
+        int nOrg  = (nAxis == 0) ? GetBspFragmentTile( frag, 0 ).x : GetBspFragmentTile( frag, 0 ).y;
+        int nStep = (nAxis == 0) ? GetFaceTileStep( faceTable.vSide[ faceTable.vSegFirst[frag.nSegment] ] ).x
+                                 : GetFaceTileStep( faceTable.vSide[ faceTable.vSegFirst[frag.nSegment] ] ).y;
+        // positions before nCut are at the low side if the tiles step up, at the high side if they step down
+        int nCut = Clamp( (nStep > 0) ? nSplit - nOrg : nOrg - nSplit + 1, frag.nFirst, nEnd );
+        if (nCut == frag.nFirst) return (nStep > 0) ?  1 : -1;
+        if (nCut == nEnd       ) return (nStep > 0) ? -1 :  1;
+        BspFragment &firstPart = (nStep > 0) ? lowPart : highPart;
+        BspFragment &otherPart = (nStep > 0) ? highPart : lowPart;
+        firstPart = { frag.nSegment, frag.nFirst, nCut - frag.nFirst };
+        otherPart = { frag.nSegment, nCut, nEnd - nCut };
+        return 2;
+    }
+
+    // builds the subtree for the fragments in vFrags and returns the index of its root node (-1 if vFrags is empty)
+    // The splitter is chosen among (at most BSP_MAX_CANDIDATES of) the lines the fragments lie on, as the one with
+    // the least splits and the best balance between both sides
+    int BuildBspNode( std::vector<BspFragment> &vFrags ) {
+        if (vFrags.empty()) return -1;
+
+        // the candidate splitters, as (axis, coordinate) pairs
+        std::vector<std::pair<int, int>> vCandidates;
+        for (auto &frag : vFrags) {
+            int nAxis, nCoord;
+            GetBspFragmentLine( frag, nAxis, nCoord );
+            vCandidates.push_back( { nAxis, nCoord } );
+        }
+        std::sort( vCandidates.begin(), vCandidates.end());
+        vCandidates.erase( std::unique( vCandidates.begin(), vCandidates.end()), vCandidates.end());
+        int nStride = ((int)vCandidates.size() + BSP_MAX_CANDIDATES - 1) / BSP_MAX_CANDIDATES;
+
+        int nBestAxis = 0, nBestSplit = 0, nBestCost = INT_MAX;
+        BspFragment lowPart, highPart;
+        for (int c = 0; c < (int)vCandidates.size(); c += nStride) {
+            int nLow = 0, nHigh = 0, nSplits = 0;
+            for (auto &frag : vFrags) {
+                switch (ClassifyBspFragment( frag, vCandidates[c].first, vCandidates[c].second, lowPart, highPart )) {
+                    case -1: nLow  += 1; break;
+                    case  1: nHigh += 1; break;
+                    case  2: nSplits += 1; nLow += 1; nHigh += 1; break;
+                }
+            }
+            int nCost = nSplits * BSP_SPLIT_COST + abs( nLow - nHigh );
+            if (nCost < nBestCost) {
+                nBestCost  = nCost;
+                nBestAxis  = vCandidates[c].first;
+                nBestSplit = vCandidates[c].second;
+            }
+        }
+
+        // distribute the fragments over the node and both sides
+        std::vector<BspFragment> vLowFrags, vHighFrags;
+        BspNode node;
+        node.nAxis      = nBestAxis;
+        node.nSplit     = nBestSplit;
+        node.nFirstFrag = (int)bspTree.vFrags.size();
+        for (auto &frag : vFrags) {
+            switch (ClassifyBspFragment( frag, nBestAxis, nBestSplit, lowPart, highPart )) {
+                case -1: vLowFrags.push_back( frag );         break;
+                case  1: vHighFrags.push_back( frag );        break;
+                case  0: bspTree.vFrags.push_back( frag );    break;
+                case  2: vLowFrags.push_back( lowPart ); vHighFrags.push_back( highPart ); break;
+            }
+        }
+        node.nFrags = (int)bspTree.vFrags.size() - node.nFirstFrag;
+        node.nMinX = node.nMinY = INT_MAX;
+        node.nMaxX = node.nMaxY = INT_MIN;
+        for (int k = node.nFirstFrag; k < node.nFirstFrag + node.nFrags; k++) {
+            BspFragment &frag = bspTree.vFrags[k];
+            for (int nPos : { frag.nFirst, frag.nFirst + frag.nLength - 1 }) {
+                olc::vi2d tile = GetBspFragmentTile( frag, nPos );
+                node.nMinX = std::min( node.nMinX, tile.x ); node.nMaxX = std::max( node.nMaxX, tile.x );
+                node.nMinY = std::min( node.nMinY, tile.y ); node.nMaxY = std::max( node.nMaxY, tile.y );
+            }
+        }
+        int nNode = (int)bspTree.vNodes.size();
+        bspTree.vNodes.push_back( node );
+        vFrags.clear();
+
+        // the children are built after the node is added, so don't hold a reference to it while building them
+        int nLowChild  = BuildBspNode( vLowFrags  );
+        int nHighChild = BuildBspNode( vHighFrags );
+        BspNode &curNode = bspTree.vNodes[nNode];
+        curNode.nLow  = nLowChild;
+        curNode.nHigh = nHighChild;
+        for (int nChild : { nLowChild, nHighChild }) {
+            if (nChild < 0) continue;
+            BspNode &child = bspTree.vNodes[nChild];
+            curNode.nMinX = std::min( curNode.nMinX, child.nMinX ); curNode.nMaxX = std::max( curNode.nMaxX, child.nMaxX );
+            curNode.nMinY = std::min( curNode.nMinY, child.nMinY ); curNode.nMaxY = std::max( curNode.nMaxY, child.nMaxY );
+        }
+        return nNode;
+    }
+
+    // compiles the BSP tree over all wall segments of faceTable
+    void CompileBspTree() {
+        bspTree = BspTree();
+        std::vector<BspFragment> vFrags;
+        for (int s = 0; s < (int)faceTable.vSegFirst.size(); s++) {
+            vFrags.push_back( { s, 0, faceTable.vSegLength[s] } );
+        }
+        bspTree.nRoot = BuildBspNode( vFrags );
+    }
+
+    // returns a hash (32 bit FNV-1a) of the map layout, to check whether a BSP file belongs to the current map
+    uint32_t GetMapHash() {
+        uint32_t nHash = 2166136261u;
+        for (char c : sMap) {
+            nHash = (nHash ^ uint8_t( c )) * 16777619u;
+        }
+        return nHash;
+    }
+
+    // writes bspTree to file sFileName. The file is binary: a header (magic, version, map size and hash, nr of wall
+    // segments, nodes and fragments, root node), followed by the nodes and fragments, all as 32 bit ints
+    bool SaveBspTree( const std::string &sFileName ) {
+        std::ofstream bspFile( sFileName, std::ios::binary );
+        if (!bspFile.is_open()) {
+            std::cout << "ERROR: SaveBspTree() --> can't open file for writing: " << sFileName << std::endl;
+            return false;
+        }
+        auto write_int = [&]( int nValue ) {
+            int32_t n = int32_t( nValue );
+            bspFile.write( (char *)&n, sizeof( n ));
+        };
+        write_int( BSP_FILE_MAGIC );
+        write_int( BSP_FILE_VERSION );
+        write_int( nMapX );
+        write_int( nMapY );
+        write_int( int( GetMapHash()));
+        write_int( (int)faceTable.vSegFirst.size() );
+        write_int( (int)bspTree.vNodes.size() );
+        write_int( (int)bspTree.vFrags.size() );
+        write_int( bspTree.nRoot );
+        for (auto &node : bspTree.vNodes) {
+            for (int nValue : { node.nAxis, node.nSplit, node.nLow, node.nHigh, node.nFirstFrag, node.nFrags,
+                                node.nMinX, node.nMinY, node.nMaxX, node.nMaxY }) {
+                write_int( nValue );
+            }
+        }
+        for (auto &frag : bspTree.vFrags) {
+            write_int( frag.nSegment );
+            write_int( frag.nFirst );
+            write_int( frag.nLength );
+        }
+        return bspFile.good();
+    }
+
+    // reads bspTree from file sFileName (see SaveBspTree()). Returns false if the file can't be read, or if it
+    // doesn't belong to the current map
+    bool LoadBspTree( const std::string &sFileName ) {
+        std::ifstream bspFile( sFileName, std::ios::binary );
+        if (!bspFile.is_open()) return false;
+
+        auto read_int = [&]() {
+            int32_t n = 0;
+            bspFile.read( (char *)&n, sizeof( n ));
+            return int( n );
+        };
+        int nMagic   = read_int();
+        int nVersion = read_int();
+        int nSizeX   = read_int();
+        int nSizeY   = read_int();
+        uint32_t nHash = uint32_t( read_int());
+        int nSegments  = read_int();
+        if (!bspFile.good() || nMagic != BSP_FILE_MAGIC || nVersion != BSP_FILE_VERSION) {
+            std::cout << "WARNING: LoadBspTree() --> not a BSP file of this version: " << sFileName << std::endl;
+            return false;
+        }
+        if (nSizeX != nMapX || nSizeY != nMapY || nHash != GetMapHash() || nSegments != (int)faceTable.vSegFirst.size()) {
+            std::cout << "WARNING: LoadBspTree() --> BSP file doesn't belong to the current map: " << sFileName << std::endl;
+            return false;
+        }
+        BspTree tree;
+        int nNodes = read_int();
+        int nFrags = read_int();
+        tree.nRoot = read_int();
+        if (!bspFile.good() || nNodes < 0 || nFrags < 0 || nFrags > (int)faceTable.vSide.size() || nNodes > nFrags) {
+            std::cout << "WARNING: LoadBspTree() --> invalid header in BSP file: " << sFileName << std::endl;
+            return false;
+        }
+        tree.vNodes.resize( nNodes );
+        for (auto &node : tree.vNodes) {
+            for (int *pValue : { &node.nAxis, &node.nSplit, &node.nLow, &node.nHigh, &node.nFirstFrag, &node.nFrags,
+                                 &node.nMinX, &node.nMinY, &node.nMaxX, &node.nMaxY }) {
+                *pValue = read_int();
+            }
+        }
+        tree.vFrags.resize( nFrags );
+        for (auto &frag : tree.vFrags) {
+            frag.nSegment = read_int();
+            frag.nFirst   = read_int();
+            frag.nLength  = read_int();
+        }
+        // check the indices, so that a damaged file can't make the traversal go out of bounds
+        bool bValid = bspFile.good() && InBetween( tree.nRoot, -1, nNodes - 1 ) && (nNodes == 0) == (tree.nRoot < 0);
+        for (int i = 0; i < nNodes && bValid; i++) {
+            BspNode &node = tree.vNodes[i];
+            bValid = InBetween( node.nAxis, 0, 1 ) &&
+                     (node.nLow  < 0 || InBetween( node.nLow,  i + 1, nNodes - 1 )) &&
+                     (node.nHigh < 0 || InBetween( node.nHigh, i + 1, nNodes - 1 )) &&
+                     node.nFirstFrag >= 0 && node.nFrags >= 0 && node.nFirstFrag + node.nFrags <= nFrags &&
+                     InBetween( node.nMinX, 0, nMapX - 1 ) && InBetween( node.nMaxX, node.nMinX, nMapX - 1 ) &&
+                     InBetween( node.nMinY, 0, nMapY - 1 ) && InBetween( node.nMaxY, node.nMinY, nMapY - 1 );
+        }
+        for (int k = 0; k < nFrags && bValid; k++) {
+            BspFragment &frag = tree.vFrags[k];
+            bValid = InBetween( frag.nSegment, 0, nSegments - 1 ) && frag.nFirst >= 0 && frag.nLength > 0 &&
+                     frag.nFirst + frag.nLength <= faceTable.vSegLength[frag.nSegment];
+        }
+        if (!bValid) {
+            std::cout << "WARNING: LoadBspTree() --> invalid contents of BSP file: " << sFileName << std::endl;
+            return false;
+        }
+        bspTree = tree;
+        return true;
+    }
+
+    // sets up bspTree for the current map - called by BuildFaceTable(). If sBspFile is set, the tree is loaded from
+    // that file, or, if that fails, compiled and written to it
+    void InitBspTree() {
+        if (sBspFile.empty()) {
+            CompileBspTree();
+        } else if (LoadBspTree( sBspFile )) {
+            std::cout << "BSP tree: " << bspTree.vNodes.size() << " nodes, " << bspTree.vFrags.size() << " fragments loaded from " << sBspFile << std::endl;
+        } else {
+            BenchClock::time_point tStart = BenchClock::now();
+            CompileBspTree();
+            double fMicros = MicrosSince( tStart );
+            if (SaveBspTree( sBspFile )) {
+                std::cout << "BSP tree: " << bspTree.vNodes.size() << " nodes, " << bspTree.vFrags.size() << " fragments compiled in "
+                          << int( fMicros ) << " us, written to " << sBspFile << std::endl;
+            }
+        }
+    }
+
+    // returns true if the screen columns that the tiles (nMinX, nMinY) - (nMaxX, nMaxY) project onto are all occluded
+    // Like CellOccluded(), but the corners are projected with the selected projection (see GetCornerColInfo())
+    bool TileRectOccluded( RenderState &rs, int nMinX, int nMinY, int nMaxX, int nMaxY ) {
+        if (SizeOcclusion( rs ) <= 2) return false;
+
+        int nMinCol = INT_MAX;
+        int nMaxCol = INT_MIN;
+        olc::vi2d vCorners[4] = { { nMinX, nMinY }, { nMaxX + 1, nMinY }, { nMinX, nMaxY + 1 }, { nMaxX + 1, nMaxY + 1 } };
+        for (auto &corner : vCorners) {
+            if (GetCameraDepth( olc::vf2d( corner )) < NEAR_PLANE_Z) return false;
+
+            int nCol = GetCornerColInfo( corner ).nScreenX;
+            nMinCol = std::min( nMinCol, nCol );
+            nMaxCol = std::max( nMaxCol, nCol );
+        }
+        return ColumnsOccluded( rs, nMinCol, nMaxCol );
+    }
+
+    // renders the visible faces of fragment frag, and appends them to vFaces. Only the tile faces of the tiles that
+    // overlap the FoV triangle tri are taken, so the same faces are found as by GetVisibleTiles() and GetVisibleFaces()
+    // If pWindow is given, the faces are only rendered within its screen columns (see Portal visibility)
+    void RenderBspFragment( RenderState &rs, olc::vf2d tri[3], int nSideMask, const BspFragment &frag, std::vector<FaceInfo> &vFaces,
+                            const ColumnWindow *pWindow = nullptr ) {
+        int f = faceTable.vSegFirst[frag.nSegment];
+        if (!FaceTableVisible( f, nSideMask )) return;
+
+        // little lambda to render a run of tile faces
+        auto render_run = [&]( int nPos, int nTiles ) {
+            olc::vi2d tile = GetBspFragmentTile( frag, nPos );
+            FaceInfo curFace;
+            BuildFaceInfo( tile.x, tile.y, faceTable.vSide[f], curFace, nTiles );
+            if (curFace.bVisible && (pWindow == nullptr ||
+                                     (curFace.leftCol.nScreenX <= pWindow->nRght && curFace.rghtCol.nScreenX >= pWindow->nLeft))) {
+                vFaces.push_back( curFace );
+                RenderFaceOccluded( rs, curFace, pWindow );
+            }
+        };
+
+        int nLeft = -1, nRght = -1;
+        for (int nPos = frag.nFirst; nPos < frag.nFirst + frag.nLength; nPos++) {
+            olc::vi2d tile = GetBspFragmentTile( frag, nPos );
+            if (!TileInFoVTriangle( tri, tile.x, tile.y )) continue;
+            if (bMergeFaces) {
+                if (nLeft < 0) nLeft = nPos;
+                nRght = nPos;
+            } else {
+                render_run( nPos, 1 );
+            }
+        }
+        if (nLeft >= 0) render_run( nLeft, nRght - nLeft + 1 );
+    }
+
+    // renders the subtree of node nNode front to back, see RenderBspFrontToBack()
+    void RenderBspNode( RenderState &rs, olc::vf2d tri[3], int nSideMask, int nNode, std::vector<FaceInfo> &vFaces, int &nNodes ) {
+        if (nNode < 0 || ScreenOccluded( rs )) return;
+
+        const BspNode &node = bspTree.vNodes[nNode];
+        float fMinX, fMaxX;
+        if (!GetSlabExtent( tri, float( node.nMinY ), float( node.nMaxY + 1 ), fMinX, fMaxX ) ||
+            fMaxX < float( node.nMinX ) || fMinX > float( node.nMaxX + 1 )) return;
+        if (TileRectOccluded( rs, node.nMinX, node.nMinY, node.nMaxX, node.nMaxY )) return;
+        nNodes += 1;
+
+        // the side of the splitter that contains the player is in front of the splitter, the other side behind it
+        float fPlayerCoord = (node.nAxis == 0) ? fPlayerX : fPlayerY;
+        bool bLowInFront = fPlayerCoord < float( node.nSplit );
+        RenderBspNode( rs, tri, nSideMask, bLowInFront ? node.nLow : node.nHigh, vFaces, nNodes );
+        for (int k = node.nFirstFrag; k < node.nFirstFrag + node.nFrags && !ScreenOccluded( rs ); k++) {
+            RenderBspFragment( rs, tri, nSideMask, bspTree.vFrags[k], vFaces );
+        }
+        RenderBspNode( rs, tri, nSideMask, bLowInFront ? node.nHigh : node.nLow, vFaces, nNodes );
+    }
+
+    // Renders the scene by walking bspTree front to back (see BSP visibility). The faces that are met are appended to
+    // vFaces, and the nr of nodes that are visited is added to nNodes
+    void RenderBspFrontToBack( RenderState &rs, std::vector<FaceInfo> &vFaces, int &nNodes ) {
+        olc::vf2d tri[3];
+        GetFoVTriangle( tri );
+        RenderBspNode( rs, tri, GetFoVSideMask(), bspTree.nRoot, vFaces, nNodes );
+    }
+
+    // Potentially visible sets
+    // ========================
+
+    // For a static map it can be worked out up front which faces can be seen from anywhere inside an empty cell: the
+    // potentially visible set (PVS) of the cell. When it's in use (--pvs, or toggle with the U key), GetVisibleTiles()
+    // and GetVisibleFaces() only consider the faces in the PVS of the player's cell, instead of all faces in the FoV
+    // triangle. The faces that are left out are hidden behind full height walls, so the rendered scene is the same.
+    // A face is in the PVS of a cell if there's a line segment from a point in the cell to a point on the face (at its
+    // front side) that doesn't pass through the inside of full height walls. Walls of partial height don't block the
+    // view. Touching the walls is allowed, so the test is conservative. If such a segment exists, there also is one
+    // through two of: the corners of the cell, the end points of the face, and the wall corners that a segment can pass
+    // (see GetPvsWallVertices()), so only the segments through these pairs of points need to be tried.
+    // The set of a cell is stored in the smallest of three encodings, identified by a leading byte: a bitset (one bit
+    // per face of faceTable), a list of the gaps between the indices of the faces in the set, or a list of the lengths
+    // of the alternating runs of faces outside and inside the set. The gaps and run lengths are stored as variable
+    // length ints (7 bits per byte). In open areas the sets are dense and the bitset is smallest, in mazes the sets are
+    // sparse and the lists are much smaller. Computing the sets takes a while for large maps, so they can be saved to
+    // and loaded from a sidecar file (see --pvs-file).
+    typedef struct sPvsData {
+        std::vector<int>     vCellFirst;     // per map cell, plus a sentinel: start of its encoded set in vBytes
+        std::vector<uint8_t> vBytes;         // (the set of a non empty cell is empty)
+    } PvsData;
+
+    PvsData pvsData;
+    std::string sPvsFile;                    // if not empty, the PVS are loaded from (or saved to) this file
+    int nPvsCells = -1;                      // the cells whose PVS are unpacked into vPvsMask and vPvsTiles, see PlayerCellPVS()
+    std::vector<uint8_t> vPvsMask;           // per face of faceTable: 1 if it's in the PVS of cells nPvsCells
+    std::vector<int>     vPvsTiles;          // the tiles that have faces in the PVS of cells nPvsCells, in map order
+    std::vector<olc::vi2d> vPvsVertices;     // work space of ComputePVS(), see GetPvsWallVertices()
+    std::vector<int>       vPvsRowFirst;     // per row of grid points, plus a sentinel: index of its first vertex in vPvsVertices
+
+    // returns true if world location (fX, fY) is inside the full height walls, i.e. if all the cells it touches are
+    // full height walls. The area outside the map counts as wall
+    bool PvsPointInWalls( double fX, double fY ) {
+        const double fEps = 1e-9;
+        int nX = int( floor( fX )), nY = int( floor( fY ));
+        int nX0 = (fX - nX < fEps) ? nX - 1 : nX, nX1 = (fX - nX > 1.0 - fEps) ? nX + 1 : nX;
+        int nY0 = (fY - nY < fEps) ? nY - 1 : nY, nY1 = (fY - nY > 1.0 - fEps) ? nY + 1 : nY;
+        for (int y = nY0; y <= nY1; y++) {
+            for (int x = nX0; x <= nX1; x++) {
+                if (InBetween( x, 0, nMapX - 1 ) && InBetween( y, 0, nMapY - 1 ) && sMap[ y * nMapX + x ] != '#') return false;
+            }
+        }
+        return true;
+    }
+
+    // returns true if the line segment from (fX0, fY0) to (fX1, fY1) doesn't pass through the inside of full height walls
+    // The segment is walked from grid line to grid line, and the middle of every piece in between is tested
+    bool PvsSegmentFree( double fX0, double fY0, double fX1, double fY1 ) {
+        double fDX = fX1 - fX0, fDY = fY1 - fY0;
+        // the parameter of the next vertical resp. horizontal grid line that is crossed, and the step between them
+        double fStepX = (fDX != 0.0) ? 1.0 / fabs( fDX ) : DBL_MAX;
+        double fStepY = (fDY != 0.0) ? 1.0 / fabs( fDY ) : DBL_MAX;
+        double fNextX = (fDX > 0.0) ? (floor( fX0 ) + 1.0 - fX0) * fStepX : ((fDX < 0.0) ? (fX0 - ceil( fX0 ) + 1.0) * fStepX : DBL_MAX);
+        double fNextY = (fDY > 0.0) ? (floor( fY0 ) + 1.0 - fY0) * fStepY : ((fDY < 0.0) ? (fY0 - ceil( fY0 ) + 1.0) * fStepY : DBL_MAX);
+        double t = 0.0;
+        while (t < 1.0) {
+            double tNext = std::min( { fNextX, fNextY, 1.0 } );
+            if (tNext - t > 1e-12) {
+                double tMid = (t + tNext) / 2.0;
+                if (PvsPointInWalls( fX0 + fDX * tMid, fY0 + fDY * tMid )) return false;
+            }
+            if (fNextX == tNext) fNextX += fStepX;
+            if (fNextY == tNext) fNextY += fStepY;
+            t = tNext;
+        }
+        return true;
+    }
+
+    // collects in vPvsVertices the grid points that a free line segment can pass through while touching a wall: the
+    // corners where one of the four cells around it is a full height wall, and the ones where two diagonal cells are
+    // The vertices are in map order, and per row of grid points the index of the first one is put in vPvsRowFirst
+    void GetPvsWallVertices() {
+        auto is_wall = [&]( int x, int y ) {
+            return !InBetween( x, 0, nMapX - 1 ) || !InBetween( y, 0, nMapY - 1 ) || sMap[ y * nMapX + x ] == '#';
+        };
+        vPvsVertices.clear();
+        vPvsRowFirst.clear();
+        for (int y = 0; y <= nMapY; y++) {
+            vPvsRowFirst.push_back( (int)vPvsVertices.size() );
+            for (int x = 0; x <= nMapX; x++) {
+                bool bNW = is_wall( x - 1, y - 1 ), bNE = is_wall( x, y - 1 ), bSW = is_wall( x - 1, y ), bSE = is_wall( x, y );
+                int nWalls = bNW + bNE + bSW + bSE;
+                if (nWalls == 1 || (nWalls == 2 && bNW == bSE)) vPvsVertices.push_back( olc::vi2d( x, y ));
+            }
+        }
+        vPvsRowFirst.push_back( (int)vPvsVertices.size() );
+    }
+
+    // returns the convex hull of the grid points in vPoints, counter clockwise in map coordinates (monotone chain)
+    std::vector<olc::vi2d> GetConvexHull( std::vector<olc::vi2d> vPoints ) {
+        std::sort( vPoints.begin(), vPoints.end(), []( const olc::vi2d &a, const olc::vi2d &b ) {
+            return a.x < b.x || (a.x == b.x && a.y < b.y);
+        } );
+        auto cross = []( olc::vi2d o, olc::vi2d a, olc::vi2d b ) {
+            return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+        };
+        std::vector<olc::vi2d> vHull( 2 * vPoints.size());
+        int k = 0;
+        for (int i = 0; i < (int)vPoints.size(); i++) {
+            while (k >= 2 && cross( vHull[k - 2], vHull[k - 1], vPoints[i] ) <= 0) k--;
+            vHull[k++] = vPoints[i];
+        }
+        for (int i = (int)vPoints.size() - 2, t = k + 1; i >= 0; i--) {
+            while (k >= t && cross( vHull[k - 2], vHull[k - 1], vPoints[i] ) <= 0) k--;
+            vHull[k++] = vPoints[i];
+        }
+        vHull.resize( k - 1 );
+        return vHull;
+    }
+
+    // returns true if some point inside the empty cell at (nCellX, nCellY) can see some point of the target: the
+    // rectangle (fX0, fY0) - (fX1, fY1), which is either a cell or a face of faceTable (a rectangle without width). If
+    // it's face nFace, the point in the cell must be at the front side of it
+    bool PvsTargetVisible( int nCellX, int nCellY, double fX0, double fY0, double fX1, double fY1, int nFace = -1 ) {
+        const FaceTable &ft = faceTable;
+        // positive at the front side of the face, see FaceTableVisible()
+        auto front_of = [&]( double fX, double fY ) {
+            if (nFace < 0) return 1.0;
+            return (ft.vRghtX[nFace] - ft.vLeftX[nFace]) * (fY - ft.vLeftY[nFace]) - (ft.vRghtY[nFace] - ft.vLeftY[nFace]) * (fX - ft.vLeftX[nFace]);
+        };
+        if (std::max( { front_of( nCellX, nCellY ), front_of( nCellX + 1, nCellY ), front_of( nCellX, nCellY + 1 ), front_of( nCellX + 1, nCellY + 1 ) } ) <= 0.0) {
+            return false;
+        }
+        // most visible targets are found by the segment between the middle of the cell and the middle of the target
+        double fMidX = nCellX + 0.5, fMidY = nCellY + 0.5;
+        if (front_of( fMidX, fMidY ) > 0.0 && PvsSegmentFree( fMidX, fMidY, (fX0 + fX1) / 2.0, (fY0 + fY1) / 2.0 )) return true;
+
+        // otherwise try the segments through all pairs of points that a segment can be pushed against. The segments lie
+        // within the convex hull of the cell and the target, so only the wall vertices in there are needed
+        std::vector<olc::vi2d> vPoints = {
+            { nCellX, nCellY }, { nCellX + 1, nCellY }, { nCellX, nCellY + 1 }, { nCellX + 1, nCellY + 1 },
+            { int( fX0 ), int( fY0 ) }, { int( fX1 ), int( fY1 ) }
+        };
+        if (fX0 != fX1 && fY0 != fY1) {
+            vPoints.push_back( { int( fX1 ), int( fY0 ) } );
+            vPoints.push_back( { int( fX0 ), int( fY1 ) } );
+        }
+        std::vector<olc::vi2d> vHull = GetConvexHull( vPoints );
+        auto in_hull = [&]( olc::vi2d v ) {
+            for (int i = 0; i < (int)vHull.size(); i++) {
+                olc::vi2d a = vHull[i], b = vHull[ (i + 1) % vHull.size() ];
+                if ((b.x - a.x) * (v.y - a.y) - (b.y - a.y) * (v.x - a.x) < 0) return false;
+            }
+            return true;
+        };
+        int nMinX = std::min( nCellX, int( fX0 )), nMaxX = std::max( nCellX + 1, int( fX1 ));
+        int nMinY = std::min( nCellY, int( fY0 )), nMaxY = std::max( nCellY + 1, int( fY1 ));
+        for (int i = vPvsRowFirst[nMinY]; i < vPvsRowFirst[nMaxY + 1]; i++) {
+            olc::vi2d v = vPvsVertices[i];
+            if (InBetween( v.x, nMinX, nMaxX ) && in_hull( v )) vPoints.push_back( v );
+        }
+
+        // little lambda to work out the part [t0, t1] of line org + t * dir that is inside rectangle (x0, y0) - (x1, y1)
+        auto clip_line = []( double vOrg[2], double vDir[2], double vLow[2], double vHigh[2], double &t0, double &t1 ) {
+            t0 = -DBL_MAX;
+            t1 =  DBL_MAX;
+            for (int a = 0; a < 2; a++) {
+                if (vDir[a] == 0.0) {
+                    if (vOrg[a] < vLow[a] - 1e-9 || vOrg[a] > vHigh[a] + 1e-9) return false;
+                } else {
+                    double ta = (vLow[a] - 1e-9 - vOrg[a]) / vDir[a], tb = (vHigh[a] + 1e-9 - vOrg[a]) / vDir[a];
+                    t0 = std::max( t0, std::min( ta, tb ));
+                    t1 = std::min( t1, std::max( ta, tb ));
+                }
+            }
+            return t0 <= t1;
+        };
+        double vCellLow[2]   = { double( nCellX ), double( nCellY ) }, vCellHigh[2]   = { nCellX + 1.0, nCellY + 1.0 };
+        double vTargetLow[2] = { fX0, fY0 },                           vTargetHigh[2] = { fX1, fY1 };
+        for (int i = 0; i < (int)vPoints.size(); i++) {
+            for (int j = i + 1; j < (int)vPoints.size(); j++) {
+                double vOrg[2] = { double( vPoints[i].x ), double( vPoints[i].y ) };
+                double vDir[2] = { double( vPoints[j].x - vPoints[i].x ), double( vPoints[j].y - vPoints[i].y ) };
+                if (vDir[0] == 0.0 && vDir[1] == 0.0) continue;
+                // the parts of the line inside the cell and inside the target, and the nearest points p and q of both
+                double tc0, tc1, tt0, tt1, tp, tq;
+                if (!clip_line( vOrg, vDir, vCellLow, vCellHigh, tc0, tc1 ) || !clip_line( vOrg, vDir, vTargetLow, vTargetHigh, tt0, tt1 )) continue;
+                if (tc1 < tt0) {
+                    tp = tc1; tq = tt0;
+                } else if (tt1 < tc0) {
+                    tp = tc0; tq = tt1;
+                } else {
+                    tp = tq = std::max( tc0, tt0 );    // the target touches the cell
+                }
+                double fPX = vOrg[0] + vDir[0] * tp, fPY = vOrg[1] + vDir[1] * tp;
+                if (front_of( fPX, fPY ) <= 1e-9) continue;
+                if (PvsSegmentFree( fPX, fPY, vOrg[0] + vDir[0] * tq, vOrg[1] + vDir[1] * tq )) return true;
+            }
+        }
+        return false;
+    }
+
+    // appends nValue >= 0 to vBytes as a variable length int: 7 bits per byte (the lowest first), the high bit is set
+    // if more bytes follow
+    void PutPvsVarInt( int nValue, std::vector<uint8_t> &vBytes ) {
+        while (nValue >= 0x80) {
+            vBytes.push_back( uint8_t( (nValue & 0x7f) | 0x80 ));
+            nValue >>= 7;
+        }
+        vBytes.push_back( uint8_t( nValue ));
+    }
+
+    // reads a variable length int (see PutPvsVarInt()) from vBytes at index i (which is advanced), up to index nEnd.
+    // Returns -1 if it's damaged
+    int GetPvsVarInt( int &i, int nEnd ) {
+        int nValue = 0;
+        for (int nShift = 0; i < nEnd && nShift < 28; nShift += 7) {
+            uint8_t nByte = pvsData.vBytes[i++];
+            nValue |= int( nByte & 0x7f ) << nShift;
+            if (!(nByte & 0x80)) return nValue;
+        }
+        return -1;
+    }
+
+    // appends the set in vBits (one byte per face) to vBytes, in the smallest encoding: PVS_RAW followed by a bitset of
+    // 8 faces per byte (the lowest bit first), PVS_LIST followed by the gap before each face in the set, or PVS_RUNS
+    // followed by the lengths of the alternating runs of faces outside and inside the set (the last run outside the set
+    // is left out)
+    void PackPvsBits( const std::vector<uint8_t> &vBits, std::vector<uint8_t> &vBytes ) {
+        std::vector<uint8_t> vRaw( 1, PVS_RAW ), vList( 1, PVS_LIST ), vRuns( 1, PVS_RUNS );
+        for (int b = 0; b < ((int)vBits.size() + 7) / 8; b++) {
+            uint8_t nByte = 0;
+            for (int k = 0; k < 8 && b * 8 + k < (int)vBits.size(); k++) {
+                if (vBits[ b * 8 + k ]) nByte |= uint8_t( 1 << k );
+            }
+            vRaw.push_back( nByte );
+        }
+        int nNext = 0;    // index of the face after the previous one in the set
+        for (int f = 0; f < (int)vBits.size(); f++) {
+            if (!vBits[f]) continue;
+            PutPvsVarInt( f - nNext, vList );
+            nNext = f + 1;
+        }
+        for (int f = 0; f < (int)vBits.size(); ) {
+            int nOut = f;
+            while (nOut < (int)vBits.size() && !vBits[nOut]) nOut++;
+            if (nOut == (int)vBits.size()) break;
+            int nIn = nOut;
+            while (nIn < (int)vBits.size() && vBits[nIn]) nIn++;
+            PutPvsVarInt( nOut - f, vRuns );
+            PutPvsVarInt( nIn - nOut, vRuns );
+            f = nIn;
+        }
+        const std::vector<uint8_t> *pBest = &vRaw;
+        if (vList.size() < pBest->size()) pBest = &vList;
+        if (vRuns.size() < pBest->size()) pBest = &vRuns;
+        vBytes.insert( vBytes.end(), pBest->begin(), pBest->end());
+    }
+
+    // unpacks the set of cell nCell and adds it to vPvsMask. Returns false if the encoded set is damaged
+    bool UnpackPvsBits( int nCell ) {
+        int nFaces = (int)faceTable.vSide.size();
+        int nFirst = pvsData.vCellFirst[nCell], nEnd = pvsData.vCellFirst[nCell + 1];
+        if (nFirst == nEnd) return false;
+        int i = nFirst + 1;
+        switch (pvsData.vBytes[nFirst]) {
+            case PVS_RAW:
+                if (nEnd - i != (nFaces + 7) / 8) return false;
+                for (int nBit = 0; i < nEnd; i++) {
+                    uint8_t nByte = pvsData.vBytes[i];
+                    for (int k = 0; k < 8; k++, nBit++) {
+                        if (!(nByte & (1 << k))) continue;
+                        if (nBit >= nFaces) return false;
+                        vPvsMask[nBit] = 1;
+                    }
+                }
+                return true;
+            case PVS_LIST:
+                for (int nFace = 0; i < nEnd; nFace++) {
+                    int nGap = GetPvsVarInt( i, nEnd );
+                    if (nGap < 0 || nGap >= nFaces - nFace) return false;
+                    nFace += nGap;
+                    vPvsMask[nFace] = 1;
+                }
+                return true;
+            case PVS_RUNS:
+                for (int nFace = 0; i < nEnd; ) {
+                    int nOut = GetPvsVarInt( i, nEnd );
+                    int nIn  = GetPvsVarInt( i, nEnd );
+                    if (nOut < 0 || nIn <= 0 || nIn > nFaces - nFace - nOut) return false;
+                    nFace += nOut;
+                    std::fill( vPvsMask.begin() + nFace, vPvsMask.begin() + nFace + nIn, 1 );
+                    nFace += nIn;
+                }
+                return true;
+        }
+        return false;
+    }
+
+    // works out the PVS of all empty cells of the map into pvsData
+    // The cells that can be seen from a cell are connected (every cell that a free segment passes is visible as well),
+    // so they're found by a flood fill from the cell. Only the faces that are directed towards a visible cell (or its
+    // neighbours along the face) are tested
+    void ComputePVS() {
+        const FaceTable &ft = faceTable;
+        int nFaces = (int)ft.vSide.size();
+        int nCells = nMapX * nMapY;
+        pvsData = PvsData();
+        GetPvsWallVertices();
+        std::vector<uint8_t> vBits( nFaces );
+        std::vector<int> vCellSeen( nCells, -1 ), vCellVisible( nCells, -1 ), vQueue;
+        auto is_visible = [&]( olc::vi2d cell, int nFrom ) {
+            return InBetween( cell.x, 0, nMapX - 1 ) && InBetween( cell.y, 0, nMapY - 1 ) && vCellVisible[ cell.y * nMapX + cell.x ] == nFrom;
+        };
+        for (int nCell = 0; nCell < nCells; nCell++) {
+            pvsData.vCellFirst.push_back( (int)pvsData.vBytes.size() );
+            if (sMap[nCell] != '.') continue;
+            int nCellX = nCell % nMapX, nCellY = nCell / nMapX;
+
+            // flood fill over the cells that are not full height walls (8 connected)
+            vQueue.assign( 1, nCell );
+            vCellSeen[nCell] = vCellVisible[nCell] = nCell;
+            for (int q = 0; q < (int)vQueue.size(); q++) {
+                int x = vQueue[q] % nMapX, y = vQueue[q] / nMapX;
+                for (int ny = std::max( 0, y - 1 ); ny <= std::min( nMapY - 1, y + 1 ); ny++) {
+                    for (int nx = std::max( 0, x - 1 ); nx <= std::min( nMapX - 1, x + 1 ); nx++) {
+                        int n = ny * nMapX + nx;
+                        if (vCellSeen[n] == nCell || sMap[n] == '#') continue;
+                        vCellSeen[n] = nCell;
+                        if (PvsTargetVisible( nCellX, nCellY, nx, ny, nx + 1, ny + 1 )) {
+                            vCellVisible[n] = nCell;
+                            vQueue.push_back( n );
+                        }
+                    }
+                }
+            }
+
+            for (int f = 0; f < nFaces; f++) {
+                // the cell in front of the face
+                int nSide = ft.vSide[f];
+                olc::vi2d front( ft.vTileX[f] + (nSide == EAST  ? 1 : (nSide == WEST  ? -1 : 0)),
+                                 ft.vTileY[f] + (nSide == SOUTH ? 1 : (nSide == NORTH ? -1 : 0)));
+                olc::vi2d step = GetFaceTileStep( nSide );
+                bool bCandidate = is_visible( front, nCell ) || is_visible( front - step, nCell ) || is_visible( front + step, nCell );
+                vBits[f] = (bCandidate && PvsTargetVisible( nCellX, nCellY, std::min( ft.vLeftX[f], ft.vRghtX[f] ), std::min( ft.vLeftY[f], ft.vRghtY[f] ),
+                                                            std::max( ft.vLeftX[f], ft.vRghtX[f] ), std::max( ft.vLeftY[f], ft.vRghtY[f] ), f )) ? 1 : 0;
+            }
+            PackPvsBits( vBits, pvsData.vBytes );
+        }
+        pvsData.vCellFirst.push_back( (int)pvsData.vBytes.size() );
+    }
+
+    // writes pvsData to file sFileName. The file is binary: a header (magic, version, map size and hash, nr of faces,
+    // nr of bytes), followed by the start of the encoded set per cell (as 32 bit ints) and the bytes of the sets
+    bool SavePVS( const std::string &sFileName ) {
+        std::ofstream pvsFile( sFileName, std::ios::binary );
+        if (!pvsFile.is_open()) {
+            std::cout << "ERROR: SavePVS() --> can't open file for writing: " << sFileName << std::endl;
+            return false;
+        }
+        auto write_int = [&]( int nValue ) {
+            int32_t n = int32_t( nValue );
+            pvsFile.write( (char *)&n, sizeof( n ));
+        };
+        write_int( PVS_FILE_MAGIC );
+        write_int( PVS_FILE_VERSION );
+        write_int( nMapX );
+        write_int( nMapY );
+        write_int( int( GetMapHash()));
+        write_int( (int)faceTable.vSide.size() );
+        write_int( (int)pvsData.vBytes.size() );
+        for (int nFirst : pvsData.vCellFirst) {
+            write_int( nFirst );
+        }
+        pvsFile.write( (char *)pvsData.vBytes.data(), pvsData.vBytes.size() );
+        return pvsFile.good();
+    }
+
+    // reads pvsData from file sFileName (see SavePVS()). Returns false if the file can't be read, or if it doesn't
+    // belong to the current map
+    bool LoadPVS( const std::string &sFileName ) {
+        std::ifstream pvsFile( sFileName, std::ios::binary );
+        if (!pvsFile.is_open()) return false;
+
+        auto read_int = [&]() {
+            int32_t n = 0;
+            pvsFile.read( (char *)&n, sizeof( n ));
+            return int( n );
+        };
+        int nMagic   = read_int();
+        int nVersion = read_int();
+        int nSizeX   = read_int();
+        int nSizeY   = read_int();
+        uint32_t nHash = uint32_t( read_int());
+        int nFaces     = read_int();
+        int nBytes     = read_int();
+        if (!pvsFile.good() || nMagic != PVS_FILE_MAGIC || nVersion != PVS_FILE_VERSION) {
+            std::cout << "WARNING: LoadPVS() --> not a PVS file of this version: " << sFileName << std::endl;
+            return false;
+        }
+        if (nSizeX != nMapX || nSizeY != nMapY || nHash != GetMapHash() || nFaces != (int)faceTable.vSide.size()) {
+            std::cout << "WARNING: LoadPVS() --> PVS file doesn't belong to the current map: " << sFileName << std::endl;
+            return false;
+        }
+        // an encoded set is never larger than the bitset plus the leading byte
+        int nCells = nMapX * nMapY;
+        int nSetBytes = (nFaces + 7) / 8 + 1;
+        if (nBytes < 0 || nBytes > nCells * nSetBytes) {
+            std::cout << "WARNING: LoadPVS() --> invalid header in PVS file: " << sFileName << std::endl;
+            return false;
+        }
+        PvsData data;
+        data.vCellFirst.resize( nCells + 1 );
+        for (auto &nFirst : data.vCellFirst) {
+            nFirst = read_int();
+        }
+        data.vBytes.resize( nBytes );
+        pvsFile.read( (char *)data.vBytes.data(), nBytes );
+        // check the set starts, so that a damaged file can't make the unpacking go out of bounds (the contents of the
+        // sets are checked while they're unpacked)
+        bool bValid = pvsFile.good() && data.vCellFirst[0] == 0 && data.vCellFirst[nCells] == nBytes;
+        for (int c = 0; c < nCells && bValid; c++) {
+            int nSize = data.vCellFirst[c + 1] - data.vCellFirst[c];
+            bValid = InBetween( nSize, 0, nSetBytes );
+        }
+        if (!bValid) {
+            std::cout << "WARNING: LoadPVS() --> invalid contents of PVS file: " << sFileName << std::endl;
+            return false;
+        }
+        pvsData = data;
+        return true;
+    }
+
+    // sets up pvsData for the current map - called by BuildFaceTable() if PVS culling is on, and when it's switched on.
+    // If sPvsFile is set, the PVS are loaded from that file, or, if that fails, computed and written to it
+    void InitPVS() {
+        nPvsCells = -1;
+        if (!sPvsFile.empty() && LoadPVS( sPvsFile )) {
+            std::cout << "PVS: " << pvsData.vBytes.size() << " bytes loaded from " << sPvsFile << std::endl;
+            return;
+        }
+        BenchClock::time_point tStart = BenchClock::now();
+        ComputePVS();
+        double fMicros = MicrosSince( tStart );
+
+        // report the average size of the sets
+        int nCells = 0;
+        long long nInPVS = 0;
+        for (int c = 0; c < nMapX * nMapY; c++) {
+            vPvsMask.assign( faceTable.vSide.size(), 0 );
+            if (sMap[c] != '.' || !UnpackPvsBits( c )) continue;
+            nCells += 1;
+            for (uint8_t nBit : vPvsMask) nInPVS += nBit;
+        }
+        nPvsCells = -1;
+        int nFaces = (int)faceTable.vSide.size();
+        std::cout << "PVS: computed for " << nCells << " cells in " << int( fMicros / 1000.0 ) << " ms, on average "
+                  << float( nInPVS ) / float( std::max( 1, nCells )) << " of " << nFaces << " faces per cell, stored in "
+                  << pvsData.vBytes.size() << " bytes (as bitsets " << nCells * ((nFaces + 7) / 8) << ")" << std::endl;
+        if (!sPvsFile.empty() && SavePVS( sPvsFile )) {
+            std::cout << "PVS: written to " << sPvsFile << std::endl;
+        }
+    }
+
+    // returns true if the PVS of the player's cell is to be used in this frame. If so, it's unpacked into vPvsMask and
+    // vPvsTiles (if that wasn't done already)
+    // A player that is exactly on a grid line touches the cells at both sides of it (and at a grid point all four cells
+    // around it), and the union of their PVS is used. If one of these cells isn't empty the PVS is not used: a player on
+    // the surface of a full height wall sees along it, and the faces of the wall are at its back or edge on, so what's
+    // behind the wall isn't hidden
+    bool PlayerCellPVS() {
+        if (!bUsePVS || (int)pvsData.vCellFirst.size() != nMapX * nMapY + 1) return false;
+        int nCellX = int( floor( fPlayerX ));
+        int nCellY = int( floor( fPlayerY ));
+        bool bOnGridX = (fPlayerX == float( nCellX ));
+        bool bOnGridY = (fPlayerY == float( nCellY ));
+        for (int y = nCellY - (bOnGridY ? 1 : 0); y <= nCellY; y++) {
+            for (int x = nCellX - (bOnGridX ? 1 : 0); x <= nCellX; x++) {
+                if (!InBetween( x, 0, nMapX - 1 ) || !InBetween( y, 0, nMapY - 1 ) || sMap[ y * nMapX + x ] != '.') return false;
+            }
+        }
+        // the touched cells are identified by the cell of the player and the grid lines it is on
+        int nCells = (nCellY * nMapX + nCellX) * 4 + (bOnGridX ? 1 : 0) + (bOnGridY ? 2 : 0);
+        if (nCells != nPvsCells) {
+            vPvsMask.assign( faceTable.vSide.size(), 0 );
+            for (int y = nCellY - (bOnGridY ? 1 : 0); y <= nCellY; y++) {
+                for (int x = nCellX - (bOnGridX ? 1 : 0); x <= nCellX; x++) {
+                    if (!UnpackPvsBits( y * nMapX + x )) {
+                        std::cout << "WARNING: PlayerCellPVS() --> damaged PVS for cell: " << x << ", " << y << std::endl;
+                        bUsePVS = false;
+                        return false;
+                    }
+                }
+            }
+            // the faces of faceTable are in map order, so the tiles come out in map order as well
+            const FaceTable &ft = faceTable;
+            vPvsTiles.clear();
+            for (int f = 0; f < (int)ft.vSide.size(); f++) {
+                int nTile = ft.vTileY[f] * nMapX + ft.vTileX[f];
+                if (vPvsMask[f] && (vPvsTiles.empty() || vPvsTiles.back() != nTile)) vPvsTiles.push_back( nTile );
+            }
+            nPvsCells = nCells;
+        }
+        return true;
+    }
+
+    // Accuracy test and microbenchmark of the PVS. For nPoses random player poses in empty cells the visible tiles and
+    // faces are collected with and without the PVS, and both faces lists are processed by the occlusion structure. The
+    // nr of candidate tiles and faces and the time taken are reported, and the faces that are rendered without the PVS
+    // but are missing from it are counted (this must be 0). One in four poses is inside a cell, the others are on a
+    // vertical or horizontal boundary of it, or on its corner
+    void BenchPVS( int nPoses ) {
+        InitMap();
+        InitProjection();
+        mainState.nBandLeft = 0;
+        mainState.nBandRght = ScreenWidth() - 1;
+        mainState.bQueueJobs = true;
+        bMergeFaces = false;
+        if (!bUsePVS) {
+            bUsePVS = true;
+            InitPVS();
+        }
+
+        std::vector<std::pair<int, int>> vEmptyCells;
+        for (int c = 0; c < nMapX * nMapY; c++) {
+            if (sMap[c] == '.') vEmptyCells.push_back( { c % nMapX, c / nMapX } );
+        }
+        srand( 1 );
+        long long nTiles[2] = { 0, 0 }, nFaces[2] = { 0, 0 }, nRendered = 0, nMissed = 0, nNoPVS = 0;
+        double fMicros[2] = { 0.0, 0.0 };
+        std::vector<std::pair<int, int>> vRenderedFaces;
+        for (int p = 0; p < nPoses; p++) {
+            auto &cell = vEmptyCells[ rand() % vEmptyCells.size() ];
+            fPlayerX     = cell.first  + 0.2f + 0.6f * float( rand() % 1000 ) / 1000.0f;
+            fPlayerY     = cell.second + 0.2f + 0.6f * float( rand() % 1000 ) / 1000.0f;
+            if (p % 4 == 1 || p % 4 == 3) fPlayerX = float( cell.first  );
+            if (p % 4 == 2 || p % 4 == 3) fPlayerY = float( cell.second );
+            fPlayerA_deg = float( rand() % 3600 ) / 10.0f;
+            fPlayerA_rad = Deg2Rad( fPlayerA_deg );
+            fPlayerSin   = sin(     fPlayerA_rad );
+            fPlayerCos   = cos(     fPlayerA_rad );
+
+            // the first run without, the second one with the PVS
+            for (int r = 0; r < 2; r++) {
+                // the PVS of a cell is only unpacked when the player enters it, so that's not timed
+                bUsePVS = (r == 1);
+                bool bPVS = PlayerCellPVS();
+                vTilesToRender.clear();
+                vFacesToRender.clear();
+                ResetCornerCache();
+                BenchClock::time_point tStart = BenchClock::now();
+                GetVisibleTiles( vTilesToRender );
+                GetVisibleFaces( vTilesToRender, vFacesToRender );
+                fMicros[r] += MicrosSince( tStart );
+                nTiles[r] += vTilesToRender.size();
+                nFaces[r] += vFacesToRender.size();
+
+                if (r == 0) {
+                    SortVisibleFaces( vFacesToRender );
+                    InitOcclusion( mainState );
+                    vRenderedFaces.clear();
+                    for (int i = 0; i < (int)vFacesToRender.size() && !ScreenOccluded( mainState ); i++) {
+                        FaceInfo &face = vFacesToRender[i];
+                        if (RenderFaceOccluded( mainState, face )) vRenderedFaces.push_back( { face.TileID.y * nMapX + face.TileID.x, face.nSide } );
+                    }
+                } else if (!bPVS) {
+                    nNoPVS += 1;
+                } else {
+                    nRendered += vRenderedFaces.size();
+                    for (auto &face : vRenderedFaces) {
+                        int f = faceTable.vTileFirst[face.first];
+                        while (faceTable.vSide[f] != face.second) f++;
+                        if (!vPvsMask[f]) nMissed += 1;
+                    }
+                }
+            }
+        }
+        std::cout << "PVS microbenchmark - " << nPoses << " poses" << std::endl;
+        std::string vNames[2] = { "without PVS", "with PVS" };
+        for (int r = 0; r < 2; r++) {
+            std::cout << "  " << StringAlignedL( vNames[r], 12 ) << ": " << StringAlignedR( float( nTiles[r] ) / nPoses, 10 ) << " tiles, "
+                      << StringAlignedR( float( nFaces[r] ) / nPoses, 10 ) << " faces per pose, "
+                      << StringAlignedR( float( fMicros[r] / nPoses ), 10 ) << " us per pose (tiles and faces)" << std::endl;
+        }
+        std::cout << "  accuracy: rendered faces missing from the PVS: " << nMissed << " of " << nRendered
+                  << " - " << (nMissed == 0 ? "PASSED" : "FAILED") << " (PVS not used at " << nNoPVS << " poses touching a wall)" << std::endl;
+    }
+
+    // Portal visibility
+    // =================
+
+    // In portal mode the open area of the map (all cells that are lower than full height) is decomposed into sectors:
+    // rectangles of cells of the same height, so every sector is convex. Two sectors that share a part of their
+    // boundary are connected by a portal there. A sector owns the faces that are directed into it, and since it's
+    // convex none of these faces can hide another one, so they can be rendered in any order.
+    // Rendering starts with the sector of the player and a window of all screen columns. The faces of a sector are
+    // rendered within the window, then every portal that faces the player is projected, and the sector at the other
+    // side is rendered recursively with the window narrowed to the columns of the portal. A screen column is only
+    // affected by the sectors its ray passes through, so the faces come out front to back per column, and the
+    // occlusion structure takes care of the clipping as usual. The recursion stops as soon as the window is occluded,
+    // so the cost depends on the nr of sectors that can be seen rather than on the nr of tiles in the FoV.
+    // The sectors only depend on the map, so they're built when the map is set up.
+    typedef struct sSector {
+        int nMinX, nMinY;            // the cells of the sector
+        int nMaxX, nMaxY;
+        int nFirstFrag, nFrags;      // the faces that are directed into the sector: [nFirstFrag, nFirstFrag + nFrags) of vFrags
+        int nFirstPortal, nPortals;  // its portals: [nFirstPortal, nFirstPortal + nPortals) of vPortals
+    } Sector;
+
+    typedef struct sPortal {
+        int nAxis;                   // 0: the portal lies on the line x = nCoord, 1: on the line y = nCoord
+        int nCoord;
+        int nFrom, nTo;              // the grid points along that line where the portal starts and ends
+        int nSector;                 // the sector at the other side
+        bool bOpenFrom, bOpenTo;     // the grid point at that end doesn't touch full height walls
+    } Portal;
+
+    typedef struct sSectorMap {
+        std::vector<Sector>      vSectors;
+        std::vector<Portal>      vPortals;
+        std::vector<BspFragment> vFrags;       // runs of tile faces of the wall segments, as in the BSP tree
+        std::vector<int>         vCellSector;  // per map cell: the sector it belongs to, -1 for full height walls
+    } SectorMap;
+
+    SectorMap sectorMap;
+    std::vector<uint8_t> vSectorOnPath;        // per sector: 1 if it's on the current path of portals, see RenderSector()
+
+    // decomposes the open area of the map into sectors, and works out their faces and portals (see Portal visibility)
+    void BuildSectors() {
+        SectorMap &sm = sectorMap;
+        sm = SectorMap();
+        sm.vCellSector.assign( nMapX * nMapY, -1 );
+
+        // grow a rectangle from each cell that isn't covered yet: first to the right, then downward as long as the
+        // complete row of the rectangle can be added
+        auto cell_free = [&]( int x, int y, char c ) {
+            return x < nMapX && y < nMapY && sMap[ y * nMapX + x ] == c && sm.vCellSector[ y * nMapX + x ] < 0;
+        };
+        for (int y = 0; y < nMapY; y++) {
+            for (int x = 0; x < nMapX; x++) {
+                char c = sMap[ y * nMapX + x ];
+                if (GetCellHeight( x, y ) >= 1.0f || sm.vCellSector[ y * nMapX + x ] >= 0) continue;
+
+                int nMaxX = x, nMaxY = y;
+                while (cell_free( nMaxX + 1, y, c )) nMaxX += 1;
+                bool bRowFree = true;
+                while (bRowFree) {
+                    for (int cx = x; cx <= nMaxX && bRowFree; cx++) {
+                        bRowFree = cell_free( cx, nMaxY + 1, c );
+                    }
+                    if (bRowFree) nMaxY += 1;
+                }
+                int nSector = (int)sm.vSectors.size();
+                sm.vSectors.push_back( { x, y, nMaxX, nMaxY, 0, 0, 0, 0 } );
+                for (int cy = y; cy <= nMaxY; cy++) {
+                    for (int cx = x; cx <= nMaxX; cx++) {
+                        sm.vCellSector[ cy * nMapX + cx ] = nSector;
+                    }
+                }
+            }
+        }
+        auto cell_sector = [&]( int x, int y ) {
+            return (InBetween( x, 0, nMapX - 1 ) && InBetween( y, 0, nMapY - 1 )) ? sm.vCellSector[ y * nMapX + x ] : -1;
+        };
+
+        // the faces of a sector are the runs of the wall segments whose front cells lie in it
+        std::vector<std::vector<BspFragment>> vSectorFrags( sm.vSectors.size() );
+        for (int s = 0; s < (int)faceTable.vSegFirst.size(); s++) {
+            int nSide = faceTable.vSide[ faceTable.vSegFirst[s] ];
+            BspFragment frag = { s, 0, faceTable.vSegLength[s] };
+            int nRunSector = -1, nRunFirst = 0;
+            for (int nPos = 0; nPos <= frag.nLength; nPos++) {
+                int nSector = -1;
+                if (nPos < frag.nLength) {
+                    olc::vi2d tile = GetBspFragmentTile( frag, nPos );
+                    nSector = cell_sector( tile.x + (nSide == EAST  ? 1 : (nSide == WEST  ? -1 : 0)),
+                                           tile.y + (nSide == SOUTH ? 1 : (nSide == NORTH ? -1 : 0)));
+                }
+                if (nSector != nRunSector || nPos == frag.nLength) {
+                    if (nRunSector >= 0) vSectorFrags[nRunSector].push_back( { s, nRunFirst, nPos - nRunFirst } );
+                    nRunSector = nSector;
+                    nRunFirst  = nPos;
+                }
+            }
+        }
+
+        // the portals of a sector are the runs of its boundary where the cells at the other side belong to one sector
+        auto point_open = [&]( int x, int y ) {
+            for (int cy = y - 1; cy <= y; cy++) {
+                for (int cx = x - 1; cx <= x; cx++) {
+                    if (!InBetween( cx, 0, nMapX - 1 ) || !InBetween( cy, 0, nMapY - 1 ) || GetCellHeight( cx, cy ) >= 1.0f) return false;
+                }
+            }
+            return true;
+        };
+        for (int i = 0; i < (int)sm.vSectors.size(); i++) {
+            Sector &sector = sm.vSectors[i];
+            sector.nFirstFrag = (int)sm.vFrags.size();
+            sector.nFrags     = (int)vSectorFrags[i].size();
+            sm.vFrags.insert( sm.vFrags.end(), vSectorFrags[i].begin(), vSectorFrags[i].end() );
+
+            sector.nFirstPortal = (int)sm.vPortals.size();
+            // the four sides as (axis, coordinate of the boundary line, coordinate of the cells at the other side)
+            int vSides[4][3] = { { 0, sector.nMaxX + 1, sector.nMaxX + 1 }, { 0, sector.nMinX, sector.nMinX - 1 },
+                                 { 1, sector.nMaxY + 1, sector.nMaxY + 1 }, { 1, sector.nMinY, sector.nMinY - 1 } };
+            for (auto &side : vSides) {
+                int nAxis = side[0];
+                int nFrom = (nAxis == 0) ? sector.nMinY : sector.nMinX;
+                int nTo   = (nAxis == 0) ? sector.nMaxY : sector.nMaxX;
+                int nRunSector = -1, nRunFirst = nFrom;
+                for (int k = nFrom; k <= nTo + 1; k++) {
+                    int nSector = -1;
+                    if (k <= nTo) nSector = (nAxis == 0) ? cell_sector( side[2], k ) : cell_sector( k, side[2] );
+                    if (nSector != nRunSector || k > nTo) {
+                        if (nRunSector >= 0) {
+                            bool bOpenFrom = (nAxis == 0) ? point_open( side[1], nRunFirst ) : point_open( nRunFirst, side[1] );
+                            bool bOpenTo   = (nAxis == 0) ? point_open( side[1], k         ) : point_open( k,         side[1] );
+                            sm.vPortals.push_back( { nAxis, side[1], nRunFirst, k, nRunSector, bOpenFrom, bOpenTo } );
+                        }
+                        nRunSector = nSector;
+                        nRunFirst  = k;
+                    }
+                }
+            }
+            sector.nPortals = (int)sm.vPortals.size() - sector.nFirstPortal;
+        }
+        vSectorOnPath.assign( sm.vSectors.size(), 0 );
+    }
+
+    // narrows window win to the screen columns that portal p of sector s projects onto. Returns false if the portal
+    // can't be seen: if the player is behind it, or if nothing of the window is left
+    bool NarrowPortalWindow( const Sector &s, const Portal &p, ColumnWindow &win ) {
+        // the player must be at the side of sector s (or on the portal line, when it's at the boundary of its own sector)
+        float fPlayerCoord = (p.nAxis == 0) ? fPlayerX : fPlayerY;
+        int   nSectorMin   = (p.nAxis == 0) ? s.nMinX  : s.nMinY;
+        bool  bLowSide     = (nSectorMin < p.nCoord);
+        if (bLowSide ? fPlayerCoord > float( p.nCoord ) : fPlayerCoord < float( p.nCoord )) return false;
+
+        // a portal that the player (nearly) stands in covers all that can be seen at its other side, so it doesn't
+        // narrow the window. This also keeps the projected points away from the player
+        float fAlong = (p.nAxis == 0) ? fPlayerY : fPlayerX;
+        if (abs( fPlayerCoord - float( p.nCoord )) < NEAR_PLANE_Z &&
+            fAlong > float( p.nFrom ) - NEAR_PLANE_Z && fAlong < float( p.nTo ) + NEAR_PLANE_Z) {
+            return win.nLeft <= win.nRght;
+        }
+
+        // clip the portal against the plane at depth PINHOLE_MIN_Z. What is left is projected
+        olc::vi2d cornerA = (p.nAxis == 0) ? olc::vi2d( p.nCoord, p.nFrom ) : olc::vi2d( p.nFrom, p.nCoord );
+        olc::vi2d cornerB = (p.nAxis == 0) ? olc::vi2d( p.nCoord, p.nTo   ) : olc::vi2d( p.nTo,   p.nCoord );
+        olc::vf2d a = olc::vf2d( cornerA ), b = olc::vf2d( cornerB );
+        float fDepthA = GetCameraDepth( a );
+        float fDepthB = GetCameraDepth( b );
+        if (fDepthA < PINHOLE_MIN_Z && fDepthB < PINHOLE_MIN_Z) return false;
+        if (fDepthA < PINHOLE_MIN_Z) a = a + (b - a) * ((PINHOLE_MIN_Z - fDepthA) / (fDepthB - fDepthA));
+        if (fDepthB < PINHOLE_MIN_Z) b = b + (a - b) * ((PINHOLE_MIN_Z - fDepthB) / (fDepthA - fDepthB));
+
+        // the end points that aren't clipped are grid corners, which are likely to be cached already
+        auto get_column = [&]( olc::vi2d corner, olc::vf2d pos, float fDepth ) {
+            if (fDepth >= PINHOLE_MIN_Z) return GetCornerColInfo( corner ).nScreenX;
+            ColInfo col;
+            BuildColInfo( pos, col );
+            return col.nScreenX;
+        };
+        int nColA = get_column( cornerA, a, fDepthA );
+        int nColB = get_column( cornerB, b, fDepthB );
+        // an end point that is clipped or closer than the near plane doesn't narrow the window: the faces near the
+        // player are clipped at a depth that depends on their distance (see ClipFaceToNearPlane()), so they can be seen
+        // beyond its column. The portal is taken to extend to the screen boundary at that side instead
+        bool bNearA = (fDepthA < NEAR_PLANE_Z), bNearB = (fDepthB < NEAR_PLANE_Z);
+        bool bOpenA = p.bOpenFrom && !bNearA;
+        bool bOpenB = p.bOpenTo   && !bNearB;
+        if (nColA > nColB) {
+            std::swap( nColA, nColB );
+            std::swap( bOpenA, bOpenB );
+            std::swap( bNearA, bNearB );
+        }
+        if (bNearA) nColA = INT_MIN;
+        if (bNearB) nColB = INT_MAX;
+        if (nColA > win.nLeft) {
+            win.nLeft     = nColA;
+            win.bOpenLeft = bOpenA;
+        }
+        if (nColB < win.nRght) {
+            win.nRght     = nColB;
+            win.bOpenRght = bOpenB;
+        }
+        return win.nLeft <= win.nRght;
+    }
+
+    // renders sector nSector within window win, and recursively the sectors that can be seen through its portals,
+    // see RenderPortalsFrontToBack()
+    void RenderSector( RenderState &rs, olc::vf2d tri[3], int nSideMask, int nSector, const ColumnWindow &win, std::vector<FaceInfo> &vFaces, int &nSectors ) {
+        if (ColumnsOccluded( rs, win.nLeft, win.nRght )) return;
+        nSectors += 1;
+
+        const Sector &sector = sectorMap.vSectors[nSector];
+        for (int k = sector.nFirstFrag; k < sector.nFirstFrag + sector.nFrags; k++) {
+            RenderBspFragment( rs, tri, nSideMask, sectorMap.vFrags[k], vFaces, &win );
+        }
+        // a sector is entered at most once per path, so that the rounding of the windows can't make the recursion
+        // go round in circles
+        vSectorOnPath[nSector] = 1;
+        for (int k = sector.nFirstPortal; k < sector.nFirstPortal + sector.nPortals && !ScreenOccluded( rs ); k++) {
+            const Portal &portal = sectorMap.vPortals[k];
+            ColumnWindow portalWin = win;
+            if (!vSectorOnPath[portal.nSector] && NarrowPortalWindow( sector, portal, portalWin )) {
+                RenderSector( rs, tri, nSideMask, portal.nSector, portalWin, vFaces, nSectors );
+            }
+        }
+        vSectorOnPath[nSector] = 0;
+    }
+
+    // Renders the scene by recursing through the portals of sectorMap, starting in the sector of the player (see
+    // Portal visibility). The faces that are met are appended to vFaces, and the nr of sectors that are rendered is
+    // added to nSectors
+    void RenderPortalsFrontToBack( RenderState &rs, std::vector<FaceInfo> &vFaces, int &nSectors ) {
+        int nPlayerTileX = int( fPlayerX );
+        int nPlayerTileY = int( fPlayerY );
+        if (!InBetween( nPlayerTileX, 0, nMapX - 1 ) || !InBetween( nPlayerTileY, 0, nMapY - 1 )) return;
+        int nSector = sectorMap.vCellSector[ nPlayerTileY * nMapX + nPlayerTileX ];
+        if (nSector < 0) return;
+
+        olc::vf2d tri[3];
+        GetFoVTriangle( tri );
+        ColumnWindow screenWin = { 0, ScreenWidth() - 1, false, false };
+        RenderSector( rs, tri, GetFoVSideMask(), nSector, screenWin, vFaces, nSectors );
+    }
+
+    // Accuracy test and microbenchmark of portal visibility. For nPoses random player poses the scene is processed by
+    // the occlusion structure with sorted and with portal visibility, and the tile faces that get a visible span in
+    // sorted mode but not in portal mode are counted. At a column where two faces meet either one may get it, so a
+    // face of a single column can be missing - but there must be no missing faces that are wider than that. Every
+    // other pose hugs a full height wall at a distance between 0.001 and 0.1, where the faces and portals that are
+    // close to the player are clipped
+    void BenchPortals( int nPoses ) {
+        InitMap();
+        InitProjection();
+        mainState.nBandLeft = 0;
+        mainState.nBandRght = ScreenWidth() - 1;
+        mainState.bQueueJobs = true;
+        bMergeFaces = false;
+        bUsePVS = false;
+
+        // the empty cells, and the sides of them that border a full height wall
+        std::vector<std::pair<int, int>> vEmptyCells, vWallSides;
+        for (int c = 0; c < nMapX * nMapY; c++) {
+            if (sMap[c] != '.') continue;
+            int x = c % nMapX, y = c / nMapX;
+            vEmptyCells.push_back( { x, y } );
+            olc::vi2d vNeighbours[4] = { { x + 1, y }, { x, y + 1 }, { x - 1, y }, { x, y - 1 } };    // EAST, SOUTH, WEST, NORTH
+            for (int nSide = 0; nSide < 4; nSide++) {
+                olc::vi2d n = vNeighbours[nSide];
+                if (!InBetween( n.x, 0, nMapX - 1 ) || !InBetween( n.y, 0, nMapY - 1 ) || sMap[ n.y * nMapX + n.x ] == '#') {
+                    vWallSides.push_back( { c, nSide } );
+                }
+            }
+        }
+        srand( 1 );
+        long long nFaces[2] = { 0, 0 }, nRendered = 0, nMissed = 0, nMissedWide = 0, nMissedClose = 0;
+        double fMicros[2] = { 0.0, 0.0 };
+        // per run the rendered tile faces, as (tile, side) and the nr of columns of their visible spans
+        std::vector<std::pair<std::pair<int, int>, int>> vRenderedFaces[2];
+        for (int p = 0; p < nPoses; p++) {
+            if (p % 2 == 0) {
+                auto &cell = vEmptyCells[ rand() % vEmptyCells.size() ];
+                fPlayerX = cell.first  + 0.2f + 0.6f * float( rand() % 1000 ) / 1000.0f;
+                fPlayerY = cell.second + 0.2f + 0.6f * float( rand() % 1000 ) / 1000.0f;
+            } else {
+                // along a wall side of a cell, at a distance of 0.1, 0.01 or 0.001 from it
+                auto &side = vWallSides[ rand() % vWallSides.size() ];
+                int nCellX = side.first % nMapX, nCellY = side.first / nMapX;
+                float fAlong = 0.1f + 0.8f * float( rand() % 1000 ) / 1000.0f;
+                float fDist  = powf( 10.0f, -1.0f - float( rand() % 3 ));
+                switch (side.second) {
+                    case EAST : fPlayerX = nCellX + 1.0f - fDist; fPlayerY = nCellY + fAlong;        break;
+                    case SOUTH: fPlayerX = nCellX + fAlong;        fPlayerY = nCellY + 1.0f - fDist; break;
+                    case WEST : fPlayerX = nCellX + fDist;         fPlayerY = nCellY + fAlong;        break;
+                    default   : fPlayerX = nCellX + fAlong;        fPlayerY = nCellY + fDist;         break;
+                }
+            }
+            fPlayerA_deg = float( rand() % 3600 ) / 10.0f;
+            fPlayerA_rad = Deg2Rad( fPlayerA_deg );
+            fPlayerSin   = sin(     fPlayerA_rad );
+            fPlayerCos   = cos(     fPlayerA_rad );
+
+            // the first run with sorted, the second one with portal visibility
+            for (int r = 0; r < 2; r++) {
+                vTilesToRender.clear();
+                vFacesToRender.clear();
+                ResetCornerCache();
+                BenchClock::time_point tStart = BenchClock::now();
+                InitOcclusion( mainState );
+                if (r == 0) {
+                    GetVisibleTiles( vTilesToRender );
+                    GetVisibleFaces( vTilesToRender, vFacesToRender );
+                    SortVisibleFaces( vFacesToRender );
+                    for (int i = 0; i < (int)vFacesToRender.size() && !ScreenOccluded( mainState ); i++) {
+                        RenderFaceOccluded( mainState, vFacesToRender[i] );
+                    }
+                } else {
+                    int nSectors = 0;
+                    RenderPortalsFrontToBack( mainState, vFacesToRender, nSectors );
+                }
+                fMicros[r] += MicrosSince( tStart );
+                nFaces[r] += vFacesToRender.size();
+
+                // the tile faces that got a visible span (see QueueQuadJobs()), sorted and with the columns summed up
+                auto &vRendered = vRenderedFaces[r];
+                vRendered.clear();
+                for (auto &span : mainState.vQuadSpans) {
+                    int nRght = std::min( { ScreenWidth() - 1, span.face.rghtCol.nScreenX, span.nRghtClip, mainState.nBandRght } );
+                    vRendered.push_back( { { span.face.TileID.y * nMapX + span.face.TileID.x, span.face.nSide }, nRght - span.nFirstCol + 1 } );
+                }
+                std::sort( vRendered.begin(), vRendered.end());
+                int nUnique = 0;
+                for (int i = 0; i < (int)vRendered.size(); i++) {
+                    if (nUnique > 0 && vRendered[nUnique - 1].first == vRendered[i].first) {
+                        vRendered[nUnique - 1].second += vRendered[i].second;
+                    } else {
+                        vRendered[nUnique++] = vRendered[i];
+                    }
+                }
+                vRendered.resize( nUnique );
+            }
+            nRendered += vRenderedFaces[0].size();
+            for (auto &face : vRenderedFaces[0]) {
+                auto it = std::lower_bound( vRenderedFaces[1].begin(), vRenderedFaces[1].end(), std::make_pair( face.first, 0 ));
+                if (it == vRenderedFaces[1].end() || it->first != face.first) {
+                    nMissed += 1;
+                    if (face.second > 1) nMissedWide  += 1;
+                    if (p % 2 == 1     ) nMissedClose += 1;
+                }
+            }
+        }
+        std::cout << "Portal visibility microbenchmark - " << nPoses << " poses" << std::endl;
+        std::string vNames[2] = { "sorted", "portals" };
+        for (int r = 0; r < 2; r++) {
+            std::cout << "  " << StringAlignedL( vNames[r], 8 ) << ": " << StringAlignedR( float( nFaces[r] ) / nPoses, 10 ) << " faces per pose, "
+                      << StringAlignedR( float( fMicros[r] / nPoses ), 10 ) << " us per pose (visibility and occlusion)" << std::endl;
+        }
+        std::cout << "  accuracy: faces rendered in sorted mode that are missing in portal mode: " << nMissed << " of " << nRendered
+                  << " (" << nMissedClose << " at poses close to a wall), wider than a single column: " << nMissedWide
+                  << " - " << (nMissedWide == 0 ? "PASSED" : "FAILED") << std::endl;
+    }
+
+    // Pipelined frame execution
+    // =========================
+
+    // In pipelined mode the visibility stage of a frame - determining the visible tiles and faces, sorting them and
+    // processing them against the occlusion structure - runs on a background thread, while the main thread rasterizes
+    // the previous frame. The visibility stage doesn't render anything: the visible spans are queued as quad jobs (or
+    // deferred quads), so the rasterization only needs the queued spans.
+    // The results of the visibility stage are double buffered: the background thread builds the next visible set in
+    // vTilesNext, vFacesNext and nextState, and at the start of a frame these are swapped with vTilesToRender,
+    // vFacesToRender and mainState. The background thread reads the player state (and the modes) while it runs, so
+    // OnUserUpdate() waits for it before processing the user input. As a result the scene lags one frame behind the
+    // player state, but the frame time is the max. of both stages instead of the sum.
+    // NOTE: in pipelined mode the tiles, faces, sort and occlusion timings are those of the background thread
+    std::vector<TileInfo> vTilesNext;
+    std::vector<FaceInfo> vFacesNext;
+    RenderState  nextState;
+    StageTimings nextTimings;
+    int  nCellsVisitedNext = 0;
+    bool bNextValid        = false;    // the next visible set is available
+    // declared after the buffers it writes, so that it's destroyed (and its thread joined) before them
+    BackgroundTask visibilityTask;
+
+    bool PipelineModeActive() {
+        return nFrameExecMode == EXE_PIPELINED && !bTestMode;
+    }
+
+    // the modes the visible set depends on - if one of them changes, a next visible set that was built in the
+    // background is stale
+    std::vector<int> VisibleSetModes() {
+        return { nTextureMode, nVisibilityMode, nOcclusionMode, nSamplerMode, nRenderThreads, nParallelMode,
+                 nProjectionMode, nOrderMode, bVerRasterMode, bHorRasterMode, bWireFrameMode, bMergeFaces, bUsePVS };
+    }
+
+    // runs the visibility stage for the current player state, into the next visible set
+    void BuildNextVisibleSet() {
+        nextTimings = StageTimings();
+        BenchClock::time_point tStageStart = BenchClock::now();
+
+        vTilesNext.clear();
+        vFacesNext.clear();
+        nCellsVisitedNext = 0;
+        ResetCornerCache();
+        nextState.bQueueJobs = true;
+        InitOcclusion( nextState );
+        if (nVisibilityMode == VIS_FRONTIER) {
+            RenderFrontToBack( nextState, vFacesNext, nCellsVisitedNext );
+            nextTimings.fFaces = MicrosSince( tStageStart ) - nextState.fOcclusion - nextState.fRaster;
+        } else if (nVisibilityMode == VIS_BSP) {
+            RenderBspFrontToBack( nextState, vFacesNext, nCellsVisitedNext );
+            nextTimings.fFaces = MicrosSince( tStageStart ) - nextState.fOcclusion - nextState.fRaster;
+        } else if (nVisibilityMode == VIS_PORTALS) {
+            RenderPortalsFrontToBack( nextState, vFacesNext, nCellsVisitedNext );
+            nextTimings.fFaces = MicrosSince( tStageStart ) - nextState.fOcclusion - nextState.fRaster;
+        } else {
+            GetVisibleTiles( vTilesNext );
+            nextTimings.fTiles = MicrosSince( tStageStart );
+
+            tStageStart = BenchClock::now();
+            GetVisibleFaces( vTilesNext, vFacesNext );
+            nextTimings.fFaces = MicrosSince( tStageStart );
+
+            if (LazyOrderActive()) {
+                // the faces are ordered as far as they're needed, the ordering time is collected by lazyOrder
+                InitLazyOrder( vFacesNext );
+                FaceInfo *pFace;
+                while (!ScreenOccluded( nextState ) && (pFace = NextLazyFace()) != nullptr) {
+                    RenderFaceOccluded( nextState, *pFace );
+                }
+                nextTimings.fSort = lazyOrder.fMicros;
+            } else {
+                tStageStart = BenchClock::now();
+                SortVisibleFaces( vFacesNext );
+                nextTimings.fSort = MicrosSince( tStageStart );
+
+                for (int i = 0; i < (int)vFacesNext.size() && !ScreenOccluded( nextState ); i++) {
+                    RenderFaceOccluded( nextState, vFacesNext[i] );
+                }
+            }
+        }
+        // queueing the visible spans is part of the visibility stage
+        nextTimings.fOcclusion = nextState.fOcclusion + nextState.fRaster;
+        nextState.fRaster = 0.0;
+        bNextValid = true;
+    }
+
+    // makes the next visible set the current one
+    void SwapVisibleSets() {
+        std::swap( vTilesToRender, vTilesNext );
+        std::swap( vFacesToRender, vFacesNext );
+        std::swap( mainState     , nextState  );
+        std::swap( nCellsVisited , nCellsVisitedNext );
+        curTimings.fTiles     = nextTimings.fTiles;
+        curTimings.fFaces     = nextTimings.fFaces;
+        curTimings.fSort      = nextTimings.fSort;
+        curTimings.fOcclusion = nextTimings.fOcclusion;
+        bNextValid = false;
+    }
+
+    bool OnUserUpdate( float fElapsedTime ) override {
+
+        // in pipelined mode the visibility stage of this frame may still be running - it uses the player state and
+        // the modes that are altered below
+        BenchClock::time_point tWaitStart = BenchClock::now();
+        visibilityTask.Wait();
+        double fWaitMicros = MicrosSince( tWaitStart );
+
+        bTestMode = false;
+
+        // step 1 - user input
+        // ===================
+
+        // factor to speed up or slow down
+        float fSpeedUp = 1.0f;
+        if (GetKey( olc::Key::SHIFT ).bHeld) fSpeedUp *= 4.00f;
+        if (GetKey( olc::Key::CTRL  ).bHeld) fSpeedUp *= 0.10f;
+
+        // little lambda to keep derived var's sync'd with fPlayerA_deg
+        auto sync_angle_vars = [&]() {
+            fPlayerA_deg = Mod360_deg( fPlayerA_deg );
+            fPlayerA_rad = Deg2Rad(    fPlayerA_deg );
+            fPlayerSin   = sin(        fPlayerA_rad );
+            fPlayerCos   = cos(        fPlayerA_rad );
+        };
+
+        // rotate, and keep player angle in [0, 360) range. This should be the only place in the code
+        // where fPlayerA_deg is altered (apart from the scripted fly through) - keep derived var's sync'd
+        if (GetKey( olc::D ).bHeld) { fPlayerA_deg += fSpeedUp * SPEED_ROTATE * fElapsedTime; sync_angle_vars(); }
+        if (GetKey( olc::A ).bHeld) { fPlayerA_deg -= fSpeedUp * SPEED_ROTATE * fElapsedTime; sync_angle_vars(); }
+
+        // temporary placeholders for (possible) new player location
+        float fNewX = fPlayerX;
+        float fNewY = fPlayerY;
+
+        float fCDMargin = 0.25f;   // collision detection margin (in cells)
+        // variables to aid in collision detection check
+        float fCheckX = fNewX;
+        float fCheckY = fNewY;
+
+        // walk forward - collision detection checked
+        if (GetKey( olc::W ).bHeld) {
+            fNewX += fPlayerCos * fSpeedUp * SPEED_MOVE * fElapsedTime;
+            fNewY += fPlayerSin * fSpeedUp * SPEED_MOVE * fElapsedTime;
+            fCheckX = fNewX + fPlayerCos * fCDMargin;
+            fCheckY = fNewY + fPlayerSin * fCDMargin;
+        }
+        // walk backwards - collision detection checked
+        if (GetKey( olc::S ).bHeld) {
+            fNewX -= fPlayerCos * fSpeedUp * SPEED_MOVE * fElapsedTime;
+            fNewY -= fPlayerSin * fSpeedUp * SPEED_MOVE * fElapsedTime;
+            fCheckX = fNewX - fPlayerCos * fCDMargin;
+            fCheckY = fNewY - fPlayerSin * fCDMargin;
+        }
+        // strafe left - collision detection checked
+        if (GetKey( olc::Q ).bHeld) {
+            fNewX += fPlayerSin * fSpeedUp * SPEED_STRAFE * fElapsedTime;
+            fNewY -= fPlayerCos * fSpeedUp * SPEED_STRAFE * fElapsedTime;
+            fCheckX = fNewX + fPlayerSin * fCDMargin;
+            fCheckY = fNewY - fPlayerCos * fCDMargin;
+        }
+        // strafe right - collision detection checked
+        if (GetKey( olc::E ).bHeld) {
+            fNewX -= fPlayerSin * fSpeedUp * SPEED_STRAFE * fElapsedTime;
+            fNewY += fPlayerCos * fSpeedUp * SPEED_STRAFE * fElapsedTime;
+            fCheckX = fNewX - fPlayerSin * fCDMargin;
+            fCheckY = fNewY + fPlayerCos * fCDMargin;
+        }
+        // collision detection - check if out of bounds or inside occupied tile. The check location is ahead in the
+        // direction of movement, so moving at a sharp angle to a wall would get the player arbitrarily close to it.
+        // That's why the new location must keep a minimal distance from the walls in all directions as well (unless the
+        // player starts out closer, e.g. through the --pos option, which would get it stuck)
+        if (fCheckX >= 0 && fCheckX < nMapX &&
+            fCheckY >= 0 && fCheckY < nMapY &&
+            sMap[ int( fCheckY ) * nMapX + int( fCheckX ) ] != '#' &&
+            (KeepsDistanceFromWalls( fNewX, fNewY, COLLISION_MIN_DIST ) || !KeepsDistanceFromWalls( fPlayerX, fPlayerY, COLLISION_MIN_DIST ))) {
+            fPlayerX = fNewX;
+            fPlayerY = fNewY;
+        }
+        // the benchmark runs and the toggles below may change the modes the next visible set was built for
+        std::vector<int> vModesBefore = VisibleSetModes();
+
+        // in benchmark mode the scripted fly through overrides the user input
+        if (bBenchMode) {
+            nTextureMode = vBenchModes[ nBenchRun ];
+            GetFlyThroughPose( float( nBenchFrame ) / float( nBenchFramesPerRun ), fPlayerX, fPlayerY, fPlayerA_deg );
+            sync_angle_vars();
+        }
+
+        // toggle raster flags
+        if (GetKey( olc::Key::V ).bPressed) bVerRasterMode = !bVerRasterMode;
+        if (GetKey( olc::Key::H ).bPressed) bHorRasterMode = !bHorRasterMode;
+        // toggle textured / monochrome rendering flag
+        if (GetKey( olc::Key::R ).bPressed) nTextureMode = (nTextureMode + 1) % 3;
+        // toggle visibility mode
+        if (GetKey( olc::Key::F ).bPressed) nVisibilityMode = (nVisibilityMode + 1) % 4;
+        // toggle occlusion structure
+        if (GetKey( olc::Key::O ).bPressed) nOcclusionMode = (nOcclusionMode + 1) % 3;
+        // toggle texture sampler
+        if (GetKey( olc::Key::X ).bPressed) nSamplerMode = (nSamplerMode + 1) % 2;
+        // toggle between single threaded and parallel rendering with a thread per core
+        if (GetKey( olc::Key::P ).bPressed) nRenderThreads = (nRenderThreads > 1) ? 1 : std::max( 2, (int)std::thread::hardware_concurrency());
+        // toggle between band and job parallel rendering
+        if (GetKey( olc::Key::J ).bPressed) nParallelMode = (nParallelMode + 1) % 2;
+        // toggle between serial and pipelined frame execution
+        if (GetKey( olc::Key::L ).bPressed) nFrameExecMode = (nFrameExecMode + 1) % 2;
+        // toggle wire frame (icw monochrome) rendering flag
+        if (GetKey( olc::Key::B ).bPressed) bWireFrameMode = !bWireFrameMode;
+        // toggle merging faces into wall segments
+        if (GetKey( olc::Key::G ).bPressed) bMergeFaces = !bMergeFaces;
+        // toggle between angular and pinhole projection
+        if (GetKey( olc::Key::C ).bPressed) nProjectionMode = (nProjectionMode + 1) % 2;
+        // toggle between sorted and lazy face ordering
+        if (GetKey( olc::Key::K ).bPressed) nOrderMode = (nOrderMode + 1) % 2;
+        // toggle culling with the PVS - they're computed when they're first needed
+        if (GetKey( olc::Key::U ).bPressed) {
+            bUsePVS = !bUsePVS;
+            if (bUsePVS && pvsData.vCellFirst.empty()) InitPVS();
+        }
+        // in pipelined mode, a next visible set that was built for other modes must be rebuilt
+        if (VisibleSetModes() != vModesBefore) bNextValid = false;
+        // toggle map flag
+        if (GetKey( olc::Key::M ).bPressed) bMapMode = !bMapMode;
+        // toggle info on screen flag
+        if (GetKey( olc::Key::I ).bPressed) bInfoMode = !bInfoMode;
+        // manipulate map scale
+        if (GetKey( olc::NP_ADD ).bHeld) fMapScale += 1.0f * fElapsedTime;
+        if (GetKey( olc::NP_SUB ).bHeld) fMapScale -= 1.0f * fElapsedTime;
+
+        // step 2 - game logic
+        // ===================
+
+        // step 3a - render logic
+        // ======================
+
+        // time stamps for timing the stages of the render pipeline
+        curTimings = StageTimings();
+        BenchClock::time_point tFrameStart = BenchClock::now();
+        BenchClock::time_point tStageStart = tFrameStart;
+
+        if (GetKey( olc::Key::T ).bPressed) { bTestMode = true; }
+
+        bool bPipelined = PipelineModeActive();
+        if (bPipelined) {
+            // take over the visible set that was built in the background (or build it now, if there is none), and
+            // start building the one for the next frame
+            if (!bNextValid) BuildNextVisibleSet();
+            SwapVisibleSets();
+            visibilityTask.Launch( [this]() { BuildNextVisibleSet(); } );
+        } else {
+            bNextValid = false;
+            vTilesToRender.clear();
+            vFacesToRender.clear();
+            nCellsVisited = 0;
+            ResetCornerCache();
+        }
+        // in frontier and BSP mode these steps are done by the traversal during rendering
+        if (!bPipelined && nVisibilityMode == VIS_SORTED) {
+            // collect all tiles that are visible (i.e. who have at least one
+            // face column within the players FoV) in the global tiles to render list
+            GetVisibleTiles( vTilesToRender );
+            curTimings.fTiles = MicrosSince( tStageStart );
+
+            // from the visible tiles list, analyse which of the faces are potentially
+            // visible for the player. This faces to render list is sorted from close by to far away
+            tStageStart = BenchClock::now();
+            GetVisibleFaces( vTilesToRender, vFacesToRender );
+            curTimings.fFaces = MicrosSince( tStageStart );
+
+            // in lazy order mode the faces are ordered while they're rendered
+            if (LazyOrderActive()) {
+                InitLazyOrder( vFacesToRender );
+            } else {
+                tStageStart = BenchClock::now();
+                SortVisibleFaces( vFacesToRender );
+                curTimings.fSort = MicrosSince( tStageStart );
+            }
+        }
+
+        // test output
+        if (bTestMode) {
+            PrintTilesList( vTilesToRender );
+            PrintFacesList( vFacesToRender );
+        }
+
+        // step 3b - render
+        // ================
+
+        SetDrawTarget( nLayerBG );
+        DrawDecal( { 0.0f, 0.0f }, pDecalBG );
+
+        SetDrawTarget( nLayerScene );
+        Clear( olc::BLANK );  // Use blank to keep the background layer visible
+
+        // iterate over visible faces list - use the occlusion list approach to determine whether
+        // faces are (partly) occluded, and draw them as quads
+
+        vWorkerStats.clear();
+        if (bPipelined) {
+            // the visible spans were queued by the visibility stage, so only the rasterization is left
+            RenderQuadJobs( mainState );
+            tStageStart = BenchClock::now();
+            RenderDeferredQuads( mainState );
+            mainState.fRaster += MicrosSince( tStageStart );
+
+            curTimings.fRaster = mainState.fRaster;
+            nFacesRendered     = mainState.nFacesRendered;
+        } else if (BandModeActive()) {
+            // the bands are rendered in parallel - the occlusion and raster timings are summed over the bands
+            RenderBands();
+        } else {
+            if (bTestMode) PrintOcclusion( mainState, "Before InitOccList()" );
+
+            // in job mode the visible spans are queued, and rendered in parallel after all faces are processed
+            mainState.bQueueJobs = JobModeActive();
+            InitOcclusion( mainState );
+
+            if (bTestMode) PrintOcclusion( mainState, "After InitOccList()" );
+
+            if (nVisibilityMode == VIS_FRONTIER) {
+                // the traversal determines, orders and renders the faces in one go
+                tStageStart = BenchClock::now();
+                RenderFrontToBack( mainState, vFacesToRender, nCellsVisited );
+                curTimings.fFaces = MicrosSince( tStageStart ) - mainState.fOcclusion - mainState.fRaster;
+            } else if (nVisibilityMode == VIS_BSP) {
+                // the tree walk orders and renders the faces in one go, like the frontier traversal
+                tStageStart = BenchClock::now();
+                RenderBspFrontToBack( mainState, vFacesToRender, nCellsVisited );
+                curTimings.fFaces = MicrosSince( tStageStart ) - mainState.fOcclusion - mainState.fRaster;
+            } else if (nVisibilityMode == VIS_PORTALS) {
+                // likewise for the recursion through the portals
+                tStageStart = BenchClock::now();
+                RenderPortalsFrontToBack( mainState, vFacesToRender, nCellsVisited );
+                curTimings.fFaces = MicrosSince( tStageStart ) - mainState.fOcclusion - mainState.fRaster;
+            } else if (LazyOrderActive()) {
+                FaceInfo *pFace;
+                while (!ScreenOccluded( mainState ) && (pFace = NextLazyFace()) != nullptr) {
+                    RenderFaceOccluded( mainState, *pFace );
+                }
+                curTimings.fSort = lazyOrder.fMicros;
+            } else {
+                for (int i = 0; i < (int)vFacesToRender.size() && !ScreenOccluded( mainState ); i++) {
+                    RenderFaceOccluded( mainState, vFacesToRender[i] );
+                }
+            }
+            if (mainState.bQueueJobs) {
+                RenderQuadJobs( mainState );
+            }
+            tStageStart = BenchClock::now();
+            RenderDeferredQuads( mainState );
+            mainState.fRaster += MicrosSince( tStageStart );
+
+            curTimings.fOcclusion = mainState.fOcclusion;
+            curTimings.fRaster    = mainState.fRaster;
+            nFacesRendered        = mainState.nFacesRendered;
+        }
+        // in pipelined mode, waiting for the visibility stage is part of the frame
+        curTimings.fFrame = MicrosSince( tFrameStart ) + fWaitMicros;
+
+        SetDrawTarget( nLayerHUD );
+        Clear( olc::BLANK );
+
+        // render optional horizontal and/or vertical raster lines (for testing)
+        RenderRaster( bHorRasterMode, bVerRasterMode );
+
+        if (bMapMode) {
+            // render minimap (for debugging) and player in it
+            olc::vi2d position = { 50, 50 };
+            RenderMiniMap( position, fMapScale );
+        }
+
+        if (bInfoMode) {
+            // render player values for debugging
+            RenderPlayerInfo( { ScreenWidth() / 2 -  75, 10 } );
+            // render characteristics on rendering algorithm
+            RenderDebugInfo(  { ScreenWidth()     - 200, 10 } );
+        }
+
+        // step 4 - frame bookkeeping
+        // ==========================
+
+        // in headless mode the frame only exists in memory, so always compose it there
+        if (HEADLESS_MODE || nDumpFormat != DUMP_NONE) {
+            ComposeFrame();
+        }
+        if (nDumpFormat != DUMP_NONE && nFrameCount % nDumpEvery == 0) {
+            DumpFrame( DumpFileName( nFrameCount ), nDumpFormat );
+        }
+        nFrameCount += 1;
+
+        // in benchmark mode, record this frame and advance to the next frame, or to the next run
+        if (bBenchMode) {
+            RecordBenchFrame();
+            nBenchFrame += 1;
+            if (nBenchFrame >= nBenchFramesPerRun) {
+                nBenchFrame = 0;
+                nBenchRun  += 1;
+                if (nBenchRun >= (int)vBenchModes.size()) {
+                    WriteBenchResults();
+                    visibilityTask.Wait();
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // quit if the requested nr of frames is rendered - don't leave the visibility stage running
+        if (nMaxFrames > 0 && nFrameCount >= nMaxFrames) {
+            visibilityTask.Wait();
+            return false;
+        }
         return true;
     }
 };
 
-int main()
+int main( int argc, char *argv[] )
 {
 	AlternativeRayCaster demo;
-	if (demo.Construct( SCREEN_X / PIXEL_X, SCREEN_Y / PIXEL_Y, PIXEL_X, PIXEL_Y ))
-		demo.Start();
+	int nExitCode = 0;
+	if (!demo.ParseCommandLine( argc, argv, nExitCode ))
+		return nExitCode;
+	if (demo.Construct( SCREEN_X / PIXEL_X, SCREEN_Y / PIXEL_Y, PIXEL_X, PIXEL_Y )) {
+		// microbenchmarks don't need a running engine
+		if (!demo.RunMicroBenchmarks())
+			demo.Start();
+	}
 
 	return 0;
 }